@@ -6,21 +6,54 @@
 #include <thread>
 #include <string>
 #include <fstream>
+#include <iterator>
 #include <iostream>
 #include <sstream>
 #include <set>
+#include <map>
+#include <deque>
+#include <tuple>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <stdexcept>
+#include <cerrno>
+#include <cctype>
+#include <cmath>
+#include <csignal>
+#include <ctime>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/perf_event.h>
+#include <dirent.h>
 
 struct pmc_event_type_t
 {
 	int event;
 	int umask;
+	const char *name;
+	int cmask;
+	bool invert;
+	bool edge;
+	unsigned counters;  // general-purpose counters it can be counted on, bit n for IA32_PMCn
+	u_int32_t msr_index;  // auxiliary MSR programmed along with it, or 0
+	u_int64_t msr_value;
 public:
-	pmc_event_type_t(int event, int umask)
-		: event(event), umask(umask) {}
+	pmc_event_type_t(int event, int umask, const char *name, int cmask = 0, bool invert = false, bool edge = false, unsigned counters = 0xff)
+		: event(event), umask(umask), name(name), cmask(cmask), invert(invert), edge(edge), counters(counters), msr_index(0), msr_value(0) {}
 };
 
 template<class T, size_t N>
@@ -29,12 +62,12 @@ constexpr size_t length_of(T(&)[N]) {
 }
 
 static const pmc_event_type_t UOPS_DISPATCHED_PORT[] = {
-	pmc_event_type_t(0xa1, 0x01),
-	pmc_event_type_t(0xa1, 0x02),
-	pmc_event_type_t(0xa1, 0x0c),
-	pmc_event_type_t(0xa1, 0x30),
-	pmc_event_type_t(0xa1, 0x40),
-	pmc_event_type_t(0xa1, 0x80),
+	pmc_event_type_t(0xa1, 0x01, "UOPS_DISPATCHED_PORT.PORT_0"),
+	pmc_event_type_t(0xa1, 0x02, "UOPS_DISPATCHED_PORT.PORT_1"),
+	pmc_event_type_t(0xa1, 0x0c, "UOPS_DISPATCHED_PORT.PORT_2"),
+	pmc_event_type_t(0xa1, 0x30, "UOPS_DISPATCHED_PORT.PORT_3"),
+	pmc_event_type_t(0xa1, 0x40, "UOPS_DISPATCHED_PORT.PORT_4"),
+	pmc_event_type_t(0xa1, 0x80, "UOPS_DISPATCHED_PORT.PORT_5"),
 };
 
 typedef size_t msr_addr_t;
@@ -61,6 +94,40 @@ static const msr_addr_t IA32_PERFEVTSEL[] = {
 	0x18d,
 };
 
+// The fixed counters count architectural events, in this order, and are controlled by 4 bits each in
+// IA32_FIXED_CTR_CTRL: ring 0, ring 3, any thread and PMI.
+static const msr_addr_t IA32_FIXED_CTR[] = {
+	0x309,
+	0x30a,
+	0x30b,
+};
+
+static const pmc_event_type_t FIXED_EVENTS[] = {
+	pmc_event_type_t(0xc0, 0x00, "INST_RETIRED.ANY"),
+	pmc_event_type_t(0x3c, 0x00, "CPU_CLK_UNHALTED.THREAD_ANY"),
+	pmc_event_type_t(0x00, 0x03, "CPU_CLK_UNHALTED.REF_TSC"),
+};
+
+enum fixed_counter_t {
+	FIXED_INST_RETIRED,
+	FIXED_CPU_CLK_UNHALTED,
+	FIXED_REF_TSC,
+};
+
+// Offcore response events count the requests and responses selected by their MSR_OFFCORE_RSP.
+static const msr_addr_t MSR_OFFCORE_RSP[] = {
+	0x1a6,
+	0x1a7,
+};
+
+static const pmc_event_type_t OFFCORE_RESPONSE[] = {
+	pmc_event_type_t(0xb7, 0x01, "OFFCORE_RESPONSE_0"),
+	pmc_event_type_t(0xbb, 0x01, "OFFCORE_RESPONSE_1"),
+};
+
+static const msr_addr_t IA32_FIXED_CTR_CTRL = 0x38d;
+static const msr_addr_t IA32_PERF_GLOBAL_CTRL = 0x38f;
+
 struct pmc_config_t {
 	u_int8_t event_select      :8;
 	u_int8_t unit_mask         :8;
@@ -171,11 +238,13 @@ std::string trim(const std::string &s) {
 	return s.substr(start, end - start + 1);
 }
 
-std::vector<cpu_t> cpuinfo() {
-	std::ifstream cpuinfo("/proc/cpuinfo");
+std::vector<cpu_t> cpuinfo(const std::string &path = "/proc/cpuinfo") {
+	std::ifstream cpuinfo(path);
+	if (!cpuinfo)
+		throw std::runtime_error("can't open " + path);
 
 	std::vector<cpu_t> processors;
-	cpu_t processor;
+	cpu_t processor = cpu_t();
 
 	std::string line;
 	while (std::getline(cpuinfo, line)) {
@@ -187,7 +256,7 @@ std::vector<cpu_t> cpuinfo() {
 
 		const auto idx = line.find(":");
 		if (idx == std::string::npos)
-			throw std::runtime_error("can't parse /proc/cpuinfo");
+			throw std::runtime_error("can't parse " + path);
 
 		std::string key = trim(line.substr(0, idx));
 		std::string value = trim(line.substr(idx + 1));
@@ -198,6 +267,8 @@ std::vector<cpu_t> cpuinfo() {
 			processor.id = std::stoi(value);
 		} else if (key == "cpu family") {
 			processor.cpu_family = std::stoi(value);
+		} else if (key == "physical id") {
+			processor.physical_id = std::stoi(value);
 		} else if (key == "model") {
 			processor.model = std::stoi(value);
 		} else if (key == "flags") {
@@ -214,20 +285,24 @@ struct pmc_info_t {
 	int version_id;
 	int num_pmc_per_thread;
 	int pmc_bitwidth;
+	int num_fixed;
+	int fixed_bitwidth;
 };
 
 pmc_info_t pmcinfo() {
-	u_int64_t rax;
+	u_int64_t rax, rdx;
 	asm volatile (
 		"cpuid"
-		: "=a"(rax)
+		: "=a"(rax), "=d"(rdx)
 		: "a"(0x0a)
-		: "ebx", "ecx", "edx"
+		: "ebx", "ecx"
 	);
 	pmc_info_t info;
 	info.version_id = rax & 0xff;
 	info.num_pmc_per_thread = (rax >> 8) & 0xff;
 	info.pmc_bitwidth = (rax >> 16) & 0xff;
+	info.num_fixed = rdx & 0x1f;
+	info.fixed_bitwidth = (rdx >> 5) & 0xff;
 	return info;
 }
 
@@ -275,92 +350,7728 @@ u_int64_t rdtsc() {
 	return ((u_int64_t) edx) << 32 | eax;
 }
 
-int
-main(int argc, char **argv)
-{
-	std::cerr << "CPU Family: " << cpu_family() << std::endl;
-	std::cerr << "CPU Model: " << cpu_model() << std::endl;
-	std::cerr << std::endl;
+// Static port model of Sandy Bridge, the only microarchitecture supported for now. Port n is bit n of a port_mask_t,
+// in the same order as UOPS_DISPATCHED_PORT.
+typedef unsigned port_mask_t;
 
-	pmc_info_t info = pmcinfo();
-	std::cerr << "Version ID of architectural performance monitoring (CPUID.0AH:EAX[7:0]): " << info.version_id << std::endl;
-	std::cerr << "Number of general-purpose performance monitoring counter per logical processor (CPUID.0AH:EAX[15:8]): " << info.num_pmc_per_thread << std::endl;
-	std::cerr << "Bit width of general-purpose performance monitoring counter: " << info.pmc_bitwidth << std::endl;
-	std::cerr << std::endl;
+static const size_t NUM_PORTS = length_of(UOPS_DISPATCHED_PORT);
+static const port_mask_t P0 = 1 << 0, P1 = 1 << 1, P2 = 1 << 2, P3 = 1 << 3, P4 = 1 << 4, P5 = 1 << 5;
+static const port_mask_t P01 = P0 | P1, P05 = P0 | P5, P15 = P1 | P5, P015 = P0 | P1 | P5, P23 = P2 | P3;
 
-	if (info.version_id < 3 || cpu_family() != 6 || cpu_model() != 42) {
-		std::cerr << "Sorry your CPU is not supported yet: family = " << cpu_family() << ", " << "model = " << cpu_model() << std::endl;
-		exit(EXIT_FAILURE);
+enum operand_access_t {
+	ACCESS_RMW,   // memory destination is loaded, modified and stored back
+	ACCESS_READ,  // memory operands are only read (cmp, test, ...)
+	ACCESS_MOVE,  // memory source is only loaded, memory destination is only stored
+	ACCESS_NONE,  // memory syntax without memory access (lea, nop)
+};
+
+struct instruction_ports_t {
+	const char *mnemonic; // a trailing '*' matches any suffix
+	operand_access_t access;
+	port_mask_t uops[4];  // non-memory uops, zero terminated
+};
+
+static const instruction_ports_t SANDY_BRIDGE_INSTRUCTIONS[] = {
+	{"nop*", ACCESS_NONE, {0}},
+	{"lea", ACCESS_NONE, {P01}},
+	{"mov", ACCESS_MOVE, {P015}},
+	{"movabs", ACCESS_MOVE, {P015}},
+	{"movzx", ACCESS_MOVE, {P015}},
+	{"movsx", ACCESS_MOVE, {P015}},
+	{"movz*", ACCESS_MOVE, {P015}},
+	{"movs[sd]", ACCESS_MOVE, {P5}},
+	{"movs*", ACCESS_MOVE, {P015}},
+	{"push*", ACCESS_MOVE, {P23, P4}},
+	{"popcnt", ACCESS_READ, {P1}},
+	{"pop*", ACCESS_MOVE, {P23}},
+	{"call*", ACCESS_MOVE, {P5, P23, P4}},
+	{"ret*", ACCESS_MOVE, {P5, P23}},
+	{"j*", ACCESS_READ, {P5}},
+	{"cmp", ACCESS_READ, {P015}},
+	{"test", ACCESS_READ, {P015}},
+	{"bt*", ACCESS_READ, {P05}},
+	{"add", ACCESS_RMW, {P015}},
+	{"sub", ACCESS_RMW, {P015}},
+	{"and", ACCESS_RMW, {P015}},
+	{"or", ACCESS_RMW, {P015}},
+	{"xor", ACCESS_RMW, {P015}},
+	{"inc", ACCESS_RMW, {P015}},
+	{"dec", ACCESS_RMW, {P015}},
+	{"neg", ACCESS_RMW, {P015}},
+	{"not", ACCESS_RMW, {P015}},
+	{"adc", ACCESS_RMW, {P015, P05}},
+	{"sbb", ACCESS_RMW, {P015, P05}},
+	{"cmov*", ACCESS_READ, {P015, P05}},
+	{"set*", ACCESS_RMW, {P05}},
+	{"shl", ACCESS_RMW, {P05}},
+	{"shr", ACCESS_RMW, {P05}},
+	{"sar", ACCESS_RMW, {P05}},
+	{"sal", ACCESS_RMW, {P05}},
+	{"rol", ACCESS_RMW, {P05}},
+	{"ror", ACCESS_RMW, {P05}},
+	{"imul", ACCESS_READ, {P1}},
+	{"mul", ACCESS_READ, {P1, P05, P05}},
+	{"div", ACCESS_READ, {P0, P0, P0, P015}},
+	{"idiv", ACCESS_READ, {P0, P0, P0, P015}},
+	{"cdq*", ACCESS_NONE, {P05}},
+	{"cqo", ACCESS_NONE, {P05}},
+	{"cltq", ACCESS_NONE, {P015}},
+	{"cltd", ACCESS_NONE, {P05}},
+	{"cqto", ACCESS_NONE, {P05}},
+	{"xchg", ACCESS_RMW, {P015, P015, P015}},
+	// SSE/AVX; a leading 'v' is stripped before lookup
+	{"movap*", ACCESS_MOVE, {P5}},
+	{"movup*", ACCESS_MOVE, {P5}},
+	{"movdq*", ACCESS_MOVE, {P015}},
+	{"movd", ACCESS_MOVE, {P015}},
+	{"movq", ACCESS_MOVE, {P015}},
+	{"broadcast*", ACCESS_MOVE, {P5}},
+	{"add[ps][sd]", ACCESS_READ, {P1}},
+	{"sub[ps][sd]", ACCESS_READ, {P1}},
+	{"min[ps][sd]", ACCESS_READ, {P1}},
+	{"max[ps][sd]", ACCESS_READ, {P1}},
+	{"cmp*[ps][sd]", ACCESS_READ, {P1}},
+	{"addsub*", ACCESS_READ, {P1}},
+	{"mul[ps][sd]", ACCESS_READ, {P0}},
+	{"div[ps][sd]", ACCESS_READ, {P0}},
+	{"sqrt*", ACCESS_READ, {P0}},
+	{"rcp*", ACCESS_READ, {P0}},
+	{"rsqrt*", ACCESS_READ, {P0}},
+	{"and*p[sd]", ACCESS_READ, {P5}},
+	{"or*p[sd]", ACCESS_READ, {P5}},
+	{"xorp[sd]", ACCESS_READ, {P5}},
+	{"blend*", ACCESS_READ, {P05}},
+	{"shuf*", ACCESS_READ, {P5}},
+	{"unpck*", ACCESS_READ, {P5}},
+	{"perm*", ACCESS_READ, {P5}},
+	{"insert*", ACCESS_READ, {P5}},
+	{"extract*", ACCESS_MOVE, {P5}},
+	{"pshuf*", ACCESS_READ, {P15}},
+	{"punpck*", ACCESS_READ, {P15}},
+	{"pmul*", ACCESS_READ, {P0}},
+	{"pmadd*", ACCESS_READ, {P0}},
+	{"psll*", ACCESS_READ, {P0}},
+	{"psrl*", ACCESS_READ, {P0}},
+	{"psra*", ACCESS_READ, {P0}},
+	{"p*", ACCESS_READ, {P15}},
+	{"cvt*", ACCESS_READ, {P1, P5}},
+	{"ucomis*", ACCESS_READ, {P0}},
+	{"comis*", ACCESS_READ, {P0}},
+	{"zeroupper", ACCESS_NONE, {0}},
+};
+
+// Matches a mnemonic against a pattern where '*' is any sequence and "[ab]" is one of the listed characters.
+bool match_mnemonic(const char *pattern, const char *s) {
+	for (; *pattern; ++pattern, ++s) {
+		if (*pattern == '*') {
+			for (const char *rest = s; ; ++rest) {
+				if (match_mnemonic(pattern + 1, rest))
+					return true;
+				if (!*rest)
+					return false;
+			}
+		} else if (*pattern == '[') {
+			const char *end = strchr(pattern, ']');
+			if (!*s || std::find(pattern + 1, end, *s) == end)
+				return false;
+			pattern = end;
+		} else if (*pattern != *s) {
+			return false;
+		}
 	}
+	return *s == '\0';
+}
 
-	const std::vector<cpu_t> cpus = cpuinfo();
-	if (cpus[0].flags.find("constant_tsc") == cpus[0].flags.end() || cpus[0].flags.find("nonstop_tsc") == cpus[0].flags.end()) {
-		std::cerr << "Cannot calculate core utilization because constant_tsc or nonstop_tsc is not available on your CPU." << std::endl;
-		exit(EXIT_FAILURE);
+const instruction_ports_t *lookup_instruction(std::string mnemonic, bool att) {
+	if (mnemonic.size() > 1 && mnemonic[0] == 'v' && mnemonic != "vzeroupper")
+		mnemonic = mnemonic.substr(1);
+	else if (mnemonic == "vzeroupper")
+		mnemonic = "zeroupper";
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		for (const auto &insn : SANDY_BRIDGE_INSTRUCTIONS)
+			if (match_mnemonic(insn.mnemonic, mnemonic.c_str()))
+				return &insn;
+		// AT&T syntax carries the operand size as a suffix (addl, movq, ...)
+		if (!att || mnemonic.size() < 2 || std::string("bwlq").find(mnemonic.back()) == std::string::npos)
+			break;
+		mnemonic.pop_back();
 	}
+	return NULL;
+}
 
-	const int num_cores = std::accumulate(cpus.begin(), cpus.end(), 0, [](const int &a, const cpu_t &b) { return std::max(a, b.core_id); }) + 1;
-	std::vector<std::vector<msr_t>> core_msrs(num_cores);
+// Splits operands on commas outside of parentheses and brackets.
+std::vector<std::string> split_operands(const std::string &s) {
+	std::vector<std::string> operands;
+	std::string operand;
+	int depth = 0;
+	for (char c : s) {
+		if (c == '(' || c == '[')
+			++depth;
+		else if (c == ')' || c == ']')
+			--depth;
+		if (c == ',' && depth == 0) {
+			operands.push_back(trim(operand));
+			operand.clear();
+		} else {
+			operand += c;
+		}
+	}
+	if (!trim(operand).empty())
+		operands.push_back(trim(operand));
+	return operands;
+}
+
+struct port_prediction_t {
+	size_t instructions;
+	size_t unknown;
+	double uops;
+	double cycles;              // predicted cycles per iteration, limited by the most contended port set
+	std::vector<double> loads;  // uops per iteration on each port
+};
+
+// Solves the fractional port assignment that minimizes the maximum port load. For each set of ports S, the uops that
+// can only go to S need at least |uops in S| / |S| cycles; the largest such bound is the optimum. Peeling off the
+// bottleneck set and repeating on the remaining ports gives the balanced per-port loads.
+port_prediction_t solve_port_assignment(std::vector<port_mask_t> uops) {
+	port_prediction_t prediction;
+	prediction.instructions = 0;
+	prediction.unknown = 0;
+	prediction.uops = uops.size();
+	prediction.cycles = 0;
+	prediction.loads.assign(NUM_PORTS, 0.0);
+
+	port_mask_t remaining = (1 << NUM_PORTS) - 1;
+	while (remaining && !uops.empty()) {
+		double worst = -1;
+		port_mask_t worst_set = 0;
+		for (port_mask_t set = remaining; set; set = (set - 1) & remaining) {
+			size_t n = 0;
+			for (port_mask_t uop : uops)
+				if ((uop & ~set) == 0)
+					++n;
+			const double load = n / (double) __builtin_popcount(set);
+			if (load > worst) {
+				worst = load;
+				worst_set = set;
+			}
+		}
+
+		prediction.cycles = std::max(prediction.cycles, worst);
+		for (size_t port = 0; port < NUM_PORTS; ++port)
+			if (worst_set & (1 << port))
+				prediction.loads[port] = worst;
+
+		remaining &= ~worst_set;
+		std::vector<port_mask_t> rest;
+		for (port_mask_t uop : uops)
+			if (uop & ~worst_set)
+				rest.push_back(uop & ~worst_set);
+		uops.swap(rest);
+	}
+	return prediction;
+}
+
+// Predicts per-port uops of one iteration of a basic block given as `objdump -d` output or as plain assembly, one
+// instruction per line, in either AT&T or Intel syntax.
+port_prediction_t predict_ports(std::istream &in) {
+	static const std::set<std::string> PREFIXES = {"lock", "rep", "repz", "repe", "repnz", "repne", "data16", "notrack", "bnd", "addr32", "cs", "ds", "ss", "es", "fs", "gs"};
+
+	std::vector<port_mask_t> uops;
+	size_t instructions = 0, unknown = 0;
+	std::string line;
+	while (std::getline(in, line)) {
+		// labels, section headers and objdump's "file format" banner
+		if (trim(line).empty() || trim(line).back() == ':' || line.find("file format") != std::string::npos)
+			continue;
+		line = line.substr(0, line.find_first_of("#;<"));
+		std::string text;
+		const auto fields = split(line, '\t');
+		if (fields.size() >= 2 && !trim(fields[0]).empty() && trim(fields[0]).back() == ':') {
+			// objdump: "  4004d6:\t48 89 e5  \tmov    %rsp,%rbp", or without the bytes with --no-show-raw-insn;
+			// a line with nothing but bytes continues the previous instruction
+			text = trim(fields.back());
+			if (fields.size() == 2 && text.find_first_not_of("0123456789abcdef ") == std::string::npos)
+				continue;
+		} else {
+			text = trim(line);
+			for (char &c : text)
+				if (c == '\t')
+					c = ' ';
+			if (text.empty() || text[0] == '.' || text.back() == ':')
+				continue;
+		}
+		if (text.empty() || text.find("(bad)") != std::string::npos)
+			continue;
+
+		std::string mnemonic, operands;
+		for (;;) {
+			const auto sp = text.find(' ');
+			mnemonic = text.substr(0, sp);
+			operands = sp == std::string::npos ? "" : trim(text.substr(sp + 1));
+			if (!PREFIXES.count(mnemonic) || operands.empty())
+				break;
+			text = operands;
+		}
+		std::transform(mnemonic.begin(), mnemonic.end(), mnemonic.begin(), ::tolower);
+
+		const std::vector<std::string> ops = split_operands(operands);
+		const bool att = operands.find('%') != std::string::npos || operands.find('$') != std::string::npos;
+		bool mem_src = false, mem_dst = false;
+		for (size_t i = 0; i < ops.size(); ++i) {
+			const bool mem = ops[i].find('(') != std::string::npos || ops[i].find('[') != std::string::npos;
+			const bool dst = att ? i + 1 == ops.size() : i == 0;
+			if (mem && dst)
+				mem_dst = true;
+			else if (mem)
+				mem_src = true;
+		}
+
+		++instructions;
+		const instruction_ports_t *insn = lookup_instruction(mnemonic, att || ops.empty());
+		if (!insn) {
+			std::cerr << "warning: unknown instruction, assuming one ALU uop: " << text << std::endl;
+			++unknown;
+			uops.push_back(P015);
+			continue;
+		}
+
+		bool load = false, store = false, op = true;
+		switch (insn->access) {
+		case ACCESS_RMW:
+			load = mem_src || mem_dst;
+			store = mem_dst;
+			break;
+		case ACCESS_READ:
+			load = mem_src || mem_dst;
+			break;
+		case ACCESS_MOVE:
+			load = mem_src;
+			store = mem_dst;
+			op = !mem_src && !mem_dst;
+			break;
+		case ACCESS_NONE:
+			break;
+		}
+		if (load)
+			uops.push_back(P23);
+		if (op)
+			for (size_t i = 0; i < length_of(insn->uops) && insn->uops[i]; ++i)
+				uops.push_back(insn->uops[i]);
+		if (store) {
+			uops.push_back(P23);
+			uops.push_back(P4);
+		}
+	}
+
+	port_prediction_t prediction = solve_port_assignment(uops);
+	prediction.instructions = instructions;
+	prediction.unknown = unknown;
+	return prediction;
+}
+
+// Disassembles machine code with objdump, at offsets from 0.
+std::string disassemble(const std::string &code) {
+	char path[] = "/tmp/core-port-stat.XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0)
+		throw std::runtime_error(std::string("failed to create temporary file: ") + strerror(errno));
+
+	const bool written = write(fd, code.data(), code.size()) == (ssize_t) code.size();
+	close(fd);
+	if (!written) {
+		unlink(path);
+		throw std::runtime_error("failed to write temporary file");
+	}
+
+	FILE *objdump = popen(("objdump -D -b binary -m i386:x86-64 " + std::string(path)).c_str(), "r");
+	std::stringstream disassembly;
+	char buf[4096];
+	size_t n;
+	while (objdump && (n = fread(buf, 1, sizeof(buf), objdump)) > 0)
+		disassembly.write(buf, n);
+	const int status = objdump ? pclose(objdump) : -1;
+	unlink(path);
+	if (status != 0)
+		throw std::runtime_error("failed to disassemble with objdump");
+	return disassembly.str();
+}
+
+// Disassembles raw machine code, e.g. "48 01 d8 c3", with objdump and predicts it.
+port_prediction_t predict_ports_of_bytes(const std::string &hex) {
+	std::string code;
+	std::string digits;
+	for (char c : hex)
+		if (isxdigit(c))
+			digits += c;
+	for (size_t i = 0; i + 1 < digits.size(); i += 2)
+		code += (char) std::stoi(digits.substr(i, 2), NULL, 16);
+	std::istringstream disassembly(disassemble(code));
+	return predict_ports(disassembly);
+}
+
+void print_prediction(FILE *out, const port_prediction_t &prediction) {
+	fprintf(out, "Predicted (Sandy Bridge): %zu instructions (%zu unknown), %.0f uops, %.2f cycles/iteration\n",
+		prediction.instructions, prediction.unknown, prediction.uops, prediction.cycles);
+	fprintf(out, "port      ");
+	for (size_t port = 0; port < NUM_PORTS; ++port)
+		fprintf(out, " %6zu", port);
+	fprintf(out, "\nuops/iter ");
+	for (size_t port = 0; port < NUM_PORTS; ++port)
+		fprintf(out, " %6.2f", prediction.loads[port]);
+	fprintf(out, "\nbusy      ");
+	for (size_t port = 0; port < NUM_PORTS; ++port)
+		fprintf(out, " %5.1f%%", prediction.cycles > 0 ? prediction.loads[port] / prediction.cycles * 100 : 0.0);
+	fprintf(out, "\n");
+}
+
+u_int64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Formats v into out, which must have room for 20 characters, and returns the length.
+size_t format_uint(char *out, u_int64_t v, int min_digits = 1) {
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v || n < min_digits);
+	for (int i = 0; i < n; ++i)
+		out[i] = digits[n - 1 - i];
+	return n;
+}
+
+// Formats v with a fixed number of decimals into out, which must have room for 32 characters, and returns the length.
+size_t format_fixed(char *out, double v, int precision) {
+	static const u_int64_t SCALE[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+	precision = std::min<int>(precision, length_of(SCALE) - 1);
+	if (!std::isfinite(v) || std::fabs(v) >= 1e12)
+		return snprintf(out, 32, "%.17g", v);
+
+	size_t n = 0;
+	if (v < 0)
+		out[n++] = '-';
+	const u_int64_t scaled = llround(std::fabs(v) * SCALE[precision]);
+	n += format_uint(out + n, scaled / SCALE[precision]);
+	if (precision > 0) {
+		out[n++] = '.';
+		n += format_uint(out + n, scaled % SCALE[precision], precision);
+	}
+	return n;
+}
+
+// Appends JSON to a reusable buffer. Numbers are formatted by hand and the buffer only grows until it fits the
+// largest document, so writing a document doesn't allocate. Commas between members are inserted automatically.
+struct json_writer_t {
+private:
+	std::vector<char> buf;
+	size_t len;
+	bool need_comma;
+
+	void reserve(size_t n) {
+		if (len + n > buf.size())
+			buf.resize(std::max(buf.size() * 2, len + n));
+	}
+
+	void put(char c) {
+		reserve(1);
+		buf[len++] = c;
+	}
+
+	void put(const char *s, size_t n) {
+		reserve(n);
+		memcpy(&buf[len], s, n);
+		len += n;
+	}
+
+	void separate() {
+		if (need_comma)
+			put(',');
+		need_comma = false;
+	}
+
+
+public:
+	json_writer_t()
+		: buf(4096), len(0), need_comma(false) {}
+
+	void clear() {
+		len = 0;
+		need_comma = false;
+	}
+
+	const char *data() const {
+		return buf.data();
+	}
+
+	size_t size() const {
+		return len;
+	}
+
+	json_writer_t &begin_object() {
+		separate();
+		put('{');
+		return *this;
+	}
+
+	json_writer_t &end_object() {
+		put('}');
+		need_comma = true;
+		return *this;
+	}
+
+	json_writer_t &begin_array() {
+		separate();
+		put('[');
+		return *this;
+	}
+
+	json_writer_t &end_array() {
+		put(']');
+		need_comma = true;
+		return *this;
+	}
+
+	// keys are literals in this file, so they are not escaped
+	json_writer_t &key(const char *k) {
+		separate();
+		put('"');
+		put(k, strlen(k));
+		put("\":", 2);
+		return *this;
+	}
+
+	json_writer_t &value(u_int64_t v) {
+		separate();
+		reserve(20);
+		len += format_uint(&buf[len], v);
+		need_comma = true;
+		return *this;
+	}
+
+	json_writer_t &value(int v) {
+		separate();
+		if (v < 0)
+			put('-');
+		reserve(20);
+		len += format_uint(&buf[len], v < 0 ? -(int64_t) v : v);
+		need_comma = true;
+		return *this;
+	}
+
+	json_writer_t &value(double v, int precision = 4) {
+		separate();
+		if (!std::isfinite(v)) {
+			put("null", 4);
+		} else {
+			reserve(32);
+			len += format_fixed(&buf[len], v, precision);
+		}
+		need_comma = true;
+		return *this;
+	}
+
+	json_writer_t &value(const char *s) {
+		separate();
+		put('"');
+		for (; *s; ++s) {
+			if (*s == '"' || *s == '\\') {
+				put('\\');
+				put(*s);
+			} else if ((unsigned char) *s < 0x20) {
+				static const char HEX[] = "0123456789abcdef";
+				put("\\u00", 4);
+				put(HEX[*s >> 4]);
+				put(HEX[*s & 0xf]);
+			} else {
+				put(*s);
+			}
+		}
+		put('"');
+		need_comma = true;
+		return *this;
+	}
+
+	json_writer_t &newline() {
+		put('\n');
+		need_comma = false;
+		return *this;
+	}
+};
+
+// Writes all of buf to fd, retrying short writes.
+void write_fully(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error(std::string("failed to write output: ") + strerror(errno));
+		buf += n;
+		len -= n;
+	}
+}
+
+static const char *const DEFAULT_EVENT_INDEX = "events.idx";
+static const char *const DEFAULT_FINGERPRINTS = "fingerprints.db";
+// load latency threshold in cycles, as in perf mem: an L1 hit takes 4 to 5 cycles, so a low one samples nearly every load
+static const unsigned DEFAULT_LOAD_LATENCY = 30;
+
+struct options_t {
+	u_int64_t interval_ns;
+	int sampler_cpu;
+	bool rt;
+	int rt_priority;
+	int overhead_every;
+	std::string predict_path;
+	bool ndjson;
+	bool rollup;
+	std::string record_path;
+	bool classify;
+	double classify_threshold;
+	size_t top;
+	std::vector<std::string> events;
+	std::string event_index;
+	bool memory;
+	bool frontend;
+	bool flops;
+	bool roofline;
+	double peak_gflops;    // per core, 0 for the nominal peak
+	double bandwidth_gbps;  // per package, 0 to measure it
+	bool power;
+	bool assists;
+	double assist_threshold;  // assists and clears per thousand instructions
+	unsigned load_latency;    // threshold in cycles, 0 for no load sampling
+	size_t loops;
+	std::string fingerprints;  // file, empty for none
+	std::string ring_path;     // ring capture, empty for none
+	double ring_hours;
+	std::string serve_path;    // control socket, empty for none
+public:
+	options_t()
+		: interval_ns(1000 * 1000 * 1000), sampler_cpu(-1), rt(false), rt_priority(50), overhead_every(0), ndjson(false), rollup(false),
+		  classify(false), classify_threshold(0.8), top(0), event_index(DEFAULT_EVENT_INDEX), memory(false), frontend(false), flops(false), roofline(false), peak_gflops(0), bandwidth_gbps(0), power(false),
+		  assists(false), assist_threshold(1), load_latency(0), loops(0), ring_hours(24) {}
+};
+
+void usage(const char *prog) {
+	fprintf(stderr,
+		"Usage: %s [OPTION]...\n"
+		"\n"
+		"  -i, --interval=MS      sampling interval in milliseconds (default: 1000)\n"
+		"  -c, --sampler-cpu=CPU  pin the sampling thread to CPU (a housekeeping core)\n"
+		"  -r, --rt[=PRIO]        run the sampler as SCHED_FIFO (default priority: 50),\n"
+		"                         lock all memory and prefault sample buffers\n"
+		"  -o, --overhead[=N]     report the sampler's own cost every N intervals (default: 10)\n"
+		"  -p, --predict=FILE     compare the busiest core's port distribution with the prediction for\n"
+		"                         the basic block in FILE (see the predict command)\n"
+		"  -f, --format=FORMAT    text (default) on stderr, or ndjson on stdout with one object per interval\n"
+		"  -w, --record=FILE      also record the counters to a capture file\n"
+		"  -R, --rollup           add per-package and per-NUMA-node means and their imbalance\n"
+		"  -b, --classify[=PCT]   also count unhalted core cycles and name the port group each core is bound on,\n"
+		"                         i.e. whose ports are all busy in PCT%% of them (default: 80)\n"
+		"  -t, --top[=N]          trace context switches and list the N processes (default: 5) with the highest\n"
+		"                         utilization of any port, sharing each core's counts by time on CPU\n"
+		"  -e, --event=NAME[,...] also count events by name, from the event index (see the events command)\n"
+		"  -E, --event-index=FILE event index to look names up in (default: events.idx)\n"
+		"  -m, --memory           count offcore responses and show per-core read bandwidth from the LLC, local\n"
+		"                         DRAM and, on Sandy Bridge-EP, remote DRAM and remote caches\n"
+		"  -d, --frontend         count where the front end got uops from (uop cache, decoders, microcode),\n"
+		"                         the issue slots it left empty and DSB-to-MITE switch penalties\n"
+		"  -F, --flops            count floating-point operations by width and precision and show GFLOPS and\n"
+		"                         the vectorized fraction\n"
+		"  -L, --roofline[=GFLOPS,GB/S]\n"
+		"                         place each core on the roofline of its package from --flops and --memory,\n"
+		"                         given the peak GFLOPS of a core and the bandwidth of a package, shared\n"
+		"                         evenly by the cores reading DRAM (default: 8 double-precision FLOPs per\n"
+		"                         cycle at the TSC frequency and the measured read bandwidth, of which a core\n"
+		"                         gets at most what it reads alone)\n"
+		"  -P, --power            show each core's unhalted frequency, its time in turbo, at nominal and below\n"
+		"                         frequency, and whether it was throttled for temperature or power\n"
+		"  -a, --assists[=PKI]    count microcode assists, machine clears by cause and uops issued but not retired,\n"
+		"                         and flag cores with more than PKI of them per thousand instructions (default: 1)\n"
+		"  -l, --load-latency[=CYCLES]\n"
+		"                         sample loads taking at least CYCLES (default: 30) with PEBS and show latency\n"
+		"                         histograms by data source and the slowest instructions and cache lines\n"
+		"  -H, --loops[=N]        sample branch stacks and list the N hottest loops (default: 5) with their\n"
+		"                         iterations, IPC and predicted port utilization\n"
+		"  -g, --fingerprint[=FILE]\n"
+		"                         trace context switches, build the signature of each service (cgroup) and report\n"
+		"                         its distance from the one stored in FILE (default: fingerprints.db) on exit\n"
+		"  -W, --ring=FILE        record continuously to a preallocated ring capture, resumed if it exists\n"
+		"  -K, --ring-hours=H     hours of intervals the ring keeps (default: 24)\n"
+		"  -S, --serve=SOCKET     stream intervals as NDJSON to the clients of a Unix socket and take\n"
+		"                         their commands (status, overhead, stop)\n"
+		"  -h, --help             show this help\n"
+		"\n"
+		"Events that don't fit in the counters left by the ports are multiplexed: groups of them are counted in\n"
+		"turn, one per interval, and the others are estimated from the rate they were last counted at.\n"
+		"\n"
+		"       %s predict [FILE | --bytes=HEX]\n"
+		"\n"
+		"  Predict per-port uops and throughput of a basic block given as objdump -d output or\n"
+		"  assembly in FILE (default: stdin), or as raw machine code.\n"
+		"\n"
+		"       %s export [--format=csv|arrow] [--util] [--batch-size=MB] CAPTURE [OUTPUT]\n"
+		"\n"
+		"  Convert a capture to wide CSV or an Arrow IPC file with one column per core and counter,\n"
+		"  holding deltas, or utilization in percent with --util.\n"
+		"\n"
+		"       %s report [--from=TIME] [--to=TIME] [--each] [--rollup] [--classify[=PCT]] [--frontend]\n"
+		"                     [--flops] CAPTURE\n"
+		"\n"
+		"  Print the mean utilization of a capture, or of each interval with --each, between two points in\n"
+		"  time given as Unix seconds, local \"YYYY-MM-DD HH:MM:SS\", or offsets like +10m from the start\n"
+		"  or -10m from the end of the capture. Captures recorded with --classify,\n"
+		"  --frontend or --flops can be analyzed again with the same option.\n"
+		"\n"
+		"       %s render [--from=TIME] [--to=TIME] [--width=PX] [--row-height=PX] [--stat=mean|min|max]\n"
+		"                     CAPTURE PREFIX\n"
+		"\n"
+		"  Render a core x time heat map of each event to PREFIX.<EVENT>.svg.\n"
+		"\n"
+		"       %s merge [--from=TIME] [--to=TIME] [--by=ATTR,...] [--quantiles=PCT,...] [--threads=N]\n"
+		"                     [--ndjson] CAPTURE...\n"
+		"\n"
+		"  Merge the captures of many hosts in parallel into distributions of per-core utilization,\n"
+		"  grouped by uarch (default), model, host, cores or packages, or none.\n"
+		"\n"
+		"       %s query [--ndjson] CAPTURE QUERY\n"
+		"\n"
+		"  Run a query over the samples of a capture, one row per interval, core and event, e.g.\n"
+		"  'select socket, port, p99(util) where util > 0.8 group by socket, port window 10s'.\n"
+		"\n"
+		"       %s import [--cpuinfo=FILE] [--tsc-mhz=MHZ] [--hostname=NAME] [--interval=MS] PERF_STAT_CSV|PERF_DATA CAPTURE\n"
+		"\n"
+		"  Convert the output of perf stat -x, -I MS (optionally with -A or --per-core) into a capture,\n"
+		"  using the topology in FILE (default: /proc/cpuinfo) to sum CPUs into cores. A perf.data file of\n"
+		"  perf record -a with sampled counts ('{...}:S') is cut into intervals of MS (default: 1000).\n"
+		"\n"
+		"       %s events [--index=INDEX] compile JSON...\n"
+		"       %s events [--index=INDEX] list [PATTERN]\n"
+		"\n"
+		"  Compile Intel perfmon JSON event lists into an event index (default: events.idx), or list the\n"
+		"  events of an index matching PATTERN, where '*' is any sequence.\n",
+		prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+options_t parse_options(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"interval", required_argument, NULL, 'i'},
+		{"sampler-cpu", required_argument, NULL, 'c'},
+		{"rt", optional_argument, NULL, 'r'},
+		{"overhead", optional_argument, NULL, 'o'},
+		{"predict", required_argument, NULL, 'p'},
+		{"format", required_argument, NULL, 'f'},
+		{"record", required_argument, NULL, 'w'},
+		{"rollup", no_argument, NULL, 'R'},
+		{"classify", optional_argument, NULL, 'b'},
+		{"top", optional_argument, NULL, 't'},
+		{"event", required_argument, NULL, 'e'},
+		{"event-index", required_argument, NULL, 'E'},
+		{"memory", no_argument, NULL, 'm'},
+		{"frontend", no_argument, NULL, 'd'},
+		{"flops", no_argument, NULL, 'F'},
+		{"roofline", optional_argument, NULL, 'L'},
+		{"power", no_argument, NULL, 'P'},
+		{"assists", optional_argument, NULL, 'a'},
+		{"load-latency", optional_argument, NULL, 'l'},
+		{"loops", optional_argument, NULL, 'H'},
+		{"fingerprint", optional_argument, NULL, 'g'},
+		{"ring", required_argument, NULL, 'W'},
+		{"ring-hours", required_argument, NULL, 'K'},
+		{"serve", required_argument, NULL, 'S'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
+
+	options_t opts;
+	int c;
+	while ((c = getopt_long(argc, argv, "i:c:r::o::p:f:w:Rb::t::e:E:mdFL::Pa::l::H::g::W:K:S:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			opts.interval_ns = (u_int64_t) std::stoul(optarg) * 1000 * 1000;
+			break;
+		case 'c':
+			opts.sampler_cpu = std::stoi(optarg);
+			break;
+		case 'r':
+			opts.rt = true;
+			if (optarg)
+				opts.rt_priority = std::stoi(optarg);
+			break;
+		case 'o':
+			opts.overhead_every = optarg ? std::stoi(optarg) : 10;
+			break;
+		case 'p':
+			opts.predict_path = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "ndjson") == 0)
+				opts.ndjson = true;
+			else if (strcmp(optarg, "text") != 0)
+				throw std::runtime_error(std::string("unknown format: ") + optarg);
+			break;
+		case 'w':
+			opts.record_path = optarg;
+			break;
+		case 'R':
+			opts.rollup = true;
+			break;
+		case 'b':
+			opts.classify = true;
+			if (optarg)
+				opts.classify_threshold = std::stod(optarg) / 100;
+			break;
+		case 't':
+			opts.top = optarg ? std::stoul(optarg) : 5;
+			break;
+		case 'e':
+			for (const auto &name : split(optarg, ','))
+				opts.events.push_back(trim(name));
+			break;
+		case 'E':
+			opts.event_index = optarg;
+			break;
+		case 'm':
+			opts.memory = true;
+			break;
+		case 'd':
+			opts.frontend = true;
+			break;
+		case 'F':
+			opts.flops = true;
+			break;
+		case 'P':
+			opts.power = true;
+			break;
+		case 'W':
+			opts.ring_path = optarg;
+			break;
+		case 'K':
+			opts.ring_hours = std::stod(optarg);
+			break;
+		case 'S':
+			opts.serve_path = optarg;
+			break;
+		case 'g':
+			opts.fingerprints = optarg ? optarg : DEFAULT_FINGERPRINTS;
+			break;
+		case 'H':
+			opts.loops = optarg ? std::stoul(optarg) : 5;
+			break;
+		case 'l':
+			opts.load_latency = optarg ? std::stoul(optarg) : DEFAULT_LOAD_LATENCY;
+			break;
+		case 'a':
+			opts.assists = true;
+			if (optarg)
+				opts.assist_threshold = std::stod(optarg);
+			break;
+		case 'L': {
+			opts.roofline = opts.flops = opts.memory = true;
+			if (optarg) {
+				const std::vector<std::string> peaks = split(optarg, ',');
+				if (peaks.size() != 2)
+					throw std::runtime_error("roofline takes GFLOPS,GB/S");
+				opts.peak_gflops = atof(peaks[0].c_str());
+				opts.bandwidth_gbps = atof(peaks[1].c_str());
+			}
+			break;
+		}
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (opts.interval_ns == 0)
+		throw std::runtime_error("interval must be positive");
+	if (opts.classify_threshold <= 0 || opts.classify_threshold > 1)
+		throw std::runtime_error("classification threshold must be in (0, 100]");
+	if (opts.load_latency && opts.load_latency < 3)
+		throw std::runtime_error("load latency threshold must be at least 3 cycles");
+	if (!(opts.ring_hours > 0))
+		throw std::runtime_error("ring hours must be positive");
+	return opts;
+}
+
+// Isolates the sampler from the workload it measures, so that intervals don't stretch under load.
+void isolate_sampler(const options_t &opts) {
+	if (opts.sampler_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(opts.sampler_cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+			throw std::runtime_error("failed to pin sampler to cpu " + std::to_string(opts.sampler_cpu) + ": " + strerror(errno));
+	}
+
+	if (opts.rt) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = opts.rt_priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+			throw std::runtime_error(std::string("failed to set SCHED_FIFO: ") + strerror(errno));
+
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+			throw std::runtime_error(std::string("failed to lock memory: ") + strerror(errno));
+
+		// fault in the stack we are going to use, so that the loop never takes a page fault
+		volatile char stack[256 * 1024];
+		for (size_t i = 0; i < sizeof(stack); i += 4096)
+			stack[i] = 0;
+	}
+}
+
+// Tracks how far each wakeup lands behind its deadline.
+struct deadline_stats_t {
+	u_int64_t intervals;
+	u_int64_t late;
+	u_int64_t missed;
+	u_int64_t max_lateness_ns;
+public:
+	deadline_stats_t()
+		: intervals(0), late(0), missed(0), max_lateness_ns(0) {}
+};
+
+enum phase_t {
+	PHASE_READ,
+	PHASE_DELTA,
+	PHASE_AGGREGATE,
+	PHASE_OUTPUT,
+	NUM_PHASES,
+};
+
+static const char *const PHASE_NAMES[] = {
+	"read",
+	"delta",
+	"aggregate",
+	"output",
+};
+
+// The sampler's own cost, accumulated over a reporting window.
+struct overhead_t {
+	u_int64_t cycles[NUM_PHASES];
+	u_int64_t tsc_elapsed;
+	u_int64_t intervals;
+	u_int64_t syscalls;
+	struct rusage usage0;
+public:
+	overhead_t() {
+		reset();
+	}
+
+	void reset() {
+		std::fill(cycles, cycles + NUM_PHASES, 0);
+		tsc_elapsed = 0;
+		intervals = 0;
+		syscalls = 0;
+		getrusage(RUSAGE_SELF, &usage0);
+	}
+
+	void report(FILE *out) const {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		const double n = std::max<u_int64_t>(intervals, 1);
+
+		u_int64_t total = 0;
+		fprintf(out, "overhead/interval:");
+		for (int phase = 0; phase < NUM_PHASES; ++phase) {
+			fprintf(out, " %s %.0f", PHASE_NAMES[phase], cycles[phase] / n);
+			total += cycles[phase];
+		}
+		fprintf(out, " cycles, total %.0f cycles (%.4f%% of interval), %.1f syscalls, %.1f voluntary / %.1f involuntary context switches\n",
+			total / n, tsc_elapsed ? total / (double) tsc_elapsed * 100 : 0.0, syscalls / n,
+			(usage.ru_nvcsw - usage0.ru_nvcsw) / n, (usage.ru_nivcsw - usage0.ru_nivcsw) / n);
+	}
+
+	void report(json_writer_t &json) const {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		const double n = std::max<u_int64_t>(intervals, 1);
+
+		u_int64_t total = 0;
+		json.begin_object();
+		json.key("type").value("overhead");
+		json.key("intervals").value(intervals);
+		json.key("cycles").begin_object();
+		for (int phase = 0; phase < NUM_PHASES; ++phase) {
+			json.key(PHASE_NAMES[phase]).value(cycles[phase] / n, 1);
+			total += cycles[phase];
+		}
+		json.end_object();
+		json.key("fraction_of_interval").value(tsc_elapsed ? total / (double) tsc_elapsed : 0.0, 6);
+		json.key("syscalls").value(syscalls / n, 2);
+		json.key("voluntary_context_switches").value((usage.ru_nvcsw - usage0.ru_nvcsw) / n, 2);
+		json.key("involuntary_context_switches").value((usage.ru_nivcsw - usage0.ru_nivcsw) / n, 2);
+		json.end_object().newline();
+	}
+};
+
+// Topology of the sampled cores. Cores are numbered densely in (package, core id) order, since core ids repeat
+// across packages and need not be contiguous.
+struct topology_t {
+	int num_cores;
+	std::vector<core_id_t> core_ids;
+	std::vector<int> packages;
+	std::vector<int> nodes;
+	std::vector<std::vector<cpu_id_t>> cpus;
+	std::vector<int> core_of_cpu;  // core of each entry of the cpuinfo() it was built from
+};
+
+// NUMA node of a logical processor, from sysfs; 0 without NUMA.
+int cpu_node(cpu_id_t cpu) {
+	const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+	DIR *dir = opendir(path.c_str());
+	if (!dir)
+		return 0;
+	int node = 0;
+	while (struct dirent *entry = readdir(dir)) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+topology_t build_topology(const std::vector<cpu_t> &cpus) {
+	std::map<std::pair<int, core_id_t>, int> cores;
 	for (const auto &cpu : cpus)
-		core_msrs[cpu.core_id].emplace_back(cpu.open_msr());
+		cores.insert(std::make_pair(std::make_pair(cpu.physical_id, cpu.core_id), 0));
+	int index = 0;
+	for (auto &core : cores)
+		core.second = index++;
 
-	// configure
-	for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
-		for (size_t i = 0; i < length_of(UOPS_DISPATCHED_PORT); ++i) {
-			const int cpu_idx = i / info.num_pmc_per_thread;
-			const int pmc_idx = i % info.num_pmc_per_thread;
+	topology_t topology;
+	topology.num_cores = cores.size();
+	topology.core_ids.resize(topology.num_cores);
+	topology.packages.resize(topology.num_cores);
+	topology.nodes.resize(topology.num_cores);
+	topology.cpus.resize(topology.num_cores);
+	for (const auto &cpu : cpus) {
+		const int core = cores[std::make_pair(cpu.physical_id, cpu.core_id)];
+		if (topology.cpus[core].empty())
+			topology.nodes[core] = cpu_node(cpu.id);
+		topology.core_ids[core] = cpu.core_id;
+		topology.packages[core] = cpu.physical_id;
+		topology.cpus[core].push_back(cpu.id);
+		topology.core_of_cpu.push_back(core);
+	}
+	return topology;
+}
+
+// Where an event is counted on each core: a general-purpose counter of one of the core's logical processors, or a
+// fixed counter of its first. Events of group 0 are always counted; the other groups take turns in the same counters.
+struct counter_t {
+	pmc_event_type_t event;
+	int cpu_idx;
+	int pmc_idx;  // general-purpose counter, or -1
+	int fixed;    // fixed counter, or -1
+	int group;
+public:
+	counter_t(const pmc_event_type_t &event, int cpu_idx, int pmc_idx, int fixed, int group)
+		: event(event), cpu_idx(cpu_idx), pmc_idx(pmc_idx), fixed(fixed), group(group) {}
+
+	msr_addr_t msr() const {
+		return fixed >= 0 ? IA32_FIXED_CTR[fixed] : IA32_PMC[pmc_idx];
+	}
+};
+
+bool is_offcore(const pmc_event_type_t &event) {
+	return event.msr_index == MSR_OFFCORE_RSP[0] || event.msr_index == MSR_OFFCORE_RSP[1];
+}
+
+// Places events of a group on the general-purpose counters of a core's logical processors that are not used yet,
+// those restricted to fewer counters first. An offcore response event takes a free MSR_OFFCORE_RSP, which decides
+// its event code. Returns false if the group doesn't fit.
+bool place_events(const std::vector<pmc_event_type_t> &events, std::vector<bool> used, unsigned offcore_used, const pmc_info_t &info,
+                  int group, std::vector<counter_t> &counters) {
+	const unsigned available = (1u << info.num_pmc_per_thread) - 1;
+	std::vector<size_t> order(events.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return __builtin_popcount(events[a].counters & available) < __builtin_popcount(events[b].counters & available);
+	});
+
+	std::vector<counter_t> placed(events.size(), counter_t(events[0], 0, 0, -1, group));
+	for (size_t i : order) {
+		pmc_event_type_t event = events[i];
+		if (is_offcore(event)) {
+			// the MSRs are shared by the logical processors of a core
+			const size_t rsp = offcore_used & 1 ? 1 : 0;
+			if (offcore_used & (1u << rsp))
+				return false;
+			offcore_used |= 1u << rsp;
+			event.event = OFFCORE_RESPONSE[rsp].event;
+			event.umask = OFFCORE_RESPONSE[rsp].umask;
+			event.msr_index = MSR_OFFCORE_RSP[rsp];
+		}
+		size_t slot = 0;
+		while (slot < used.size() && (used[slot] || !(event.counters & (1u << (slot % info.num_pmc_per_thread)))))
+			++slot;
+		if (slot == used.size())
+			return false;
+		used[slot] = true;
+		placed[i] = counter_t(event, slot / info.num_pmc_per_thread, slot % info.num_pmc_per_thread, -1, group);
+	}
+	counters.insert(counters.end(), placed.begin(), placed.end());
+	return true;
+}
+
+// Places the always-counted events, then packs the multiplexed ones in order into as few groups as fit in the
+// remaining counters, followed by the fixed counters.
+std::vector<counter_t> assign_counters(const std::vector<pmc_event_type_t> &always, const std::vector<pmc_event_type_t> &multiplexed,
+                                       const std::vector<fixed_counter_t> &fixed, const pmc_info_t &info, size_t threads_per_core) {
+	std::vector<bool> used(info.num_pmc_per_thread * threads_per_core);
+	unsigned offcore_used = 0;
+	std::vector<counter_t> counters;
+	if (!always.empty() && !place_events(always, used, offcore_used, info, 0, counters))
+		throw std::runtime_error(std::to_string(always.size()) + " events don't fit in the " + std::to_string(used.size()) + " counters of a core");
+	for (const auto &counter : counters) {
+		used[counter.cpu_idx * info.num_pmc_per_thread + counter.pmc_idx] = true;
+		if (is_offcore(counter.event))
+			offcore_used |= counter.event.msr_index == MSR_OFFCORE_RSP[0] ? 1 : 2;
+	}
+
+	std::vector<pmc_event_type_t> group;
+	std::vector<counter_t> placed;
+	int num_groups = 0;
+	for (const auto &event : multiplexed) {
+		group.push_back(event);
+		placed.clear();
+		if (place_events(group, used, offcore_used, info, num_groups + 1, placed))
+			continue;
+		// close the group without the event and start the next one with it
+		group.pop_back();
+		if (!group.empty())
+			place_events(group, used, offcore_used, info, ++num_groups, counters);
+		group.assign(1, event);
+		placed.clear();
+		if (!place_events(group, used, offcore_used, info, num_groups + 1, placed))
+			throw std::runtime_error(std::string("no free counter for ") + event.name);
+	}
+	if (!group.empty())
+		place_events(group, used, offcore_used, info, ++num_groups, counters);
+
+	for (fixed_counter_t f : fixed) {
+		if (f >= info.num_fixed)
+			throw std::runtime_error(std::string("no fixed counter for ") + FIXED_EVENTS[f].name);
+		counters.push_back(counter_t(FIXED_EVENTS[f], 0, -1, f, 0));
+	}
+	return counters;
+}
+
+// Programs the general-purpose counter of an event on a core, and the MSR_OFFCORE_RSP it needs.
+void program_counter(std::vector<msr_t> &msrs, const counter_t &counter) {
+	pmc_config_t conf;
+	memset(&conf, 0, sizeof(pmc_config_t));
+	conf.unit_mask = counter.event.umask;
+	conf.event_select = counter.event.event;
+	conf.counter_mask = counter.event.cmask;
+	conf.invert_counter_mask = counter.event.invert;
+	conf.edge_detect = counter.event.edge;
+	conf.user_mode = true;
+	conf.operating_system_mode = true;
+	conf.any_thread = true;
+	conf.enable_counters = true;
+
+	auto &msr = msrs[counter.cpu_idx];
+	if (counter.event.msr_index)
+		msr.wrmsr(counter.event.msr_index, counter.event.msr_value);
+	msr.wrmsr(IA32_PERFEVTSEL[counter.pmc_idx], *(u_int64_t*)&conf);
+}
+
+// The values the sampler finds in the PMU registers it programs, written back on exit so that other users of the
+// counters get their configuration back.
+struct pmu_state_t {
+private:
+	std::vector<std::vector<msr_t>> &core_msrs;
+	struct saved_t {
+		core_id_t core;
+		int cpu_idx;
+		msr_addr_t msr;
+		u_int64_t value;
+	};
+	std::vector<saved_t> saved;
 
-			pmc_config_t conf;
-			memset(&conf, 0, sizeof(pmc_config_t));
-			const pmc_event_type_t &port = UOPS_DISPATCHED_PORT[i];
-			conf.unit_mask = port.umask;
-			conf.event_select = port.event;
-			conf.user_mode = true;
-			conf.operating_system_mode = true;
-			conf.any_thread = true;
-			conf.enable_counters = true;
+	void save(core_id_t core, int cpu_idx, msr_addr_t msr) {
+		for (const auto &s : saved)
+			if (s.core == core && s.cpu_idx == cpu_idx && s.msr == msr)
+				return;
+		saved.push_back(saved_t{core, cpu_idx, msr, core_msrs[core][cpu_idx].rdmsr(msr)});
+	}
 
-			auto &msr = core_msrs[core_id][cpu_idx];
-			msr.wrmsr(IA32_PERFEVTSEL[pmc_idx], *(u_int64_t*)&conf);
+public:
+	pmu_state_t(const pmu_state_t &) = delete;
+	pmu_state_t &operator=(const pmu_state_t &) = delete;
+	pmu_state_t(std::vector<std::vector<msr_t>> &core_msrs, const std::vector<counter_t> &counters)
+		: core_msrs(core_msrs) {
+		for (core_id_t core = 0; core < (core_id_t) core_msrs.size(); ++core) {
+			bool fixed = false;
+			for (const auto &counter : counters) {
+				if (counter.fixed >= 0) {
+					fixed = true;
+					continue;
+				}
+				save(core, counter.cpu_idx, IA32_PERFEVTSEL[counter.pmc_idx]);
+				if (counter.event.msr_index)
+					save(core, counter.cpu_idx, counter.event.msr_index);
+			}
+			if (fixed) {
+				save(core, 0, IA32_FIXED_CTR_CTRL);
+				save(core, 0, IA32_PERF_GLOBAL_CTRL);
+			}
+		}
+	}
+	// restores on every way out of the sampler that unwinds, including a failed rdmsr or wrmsr
+	~pmu_state_t() {
+		try {
+			for (auto s = saved.rbegin(); s != saved.rend(); ++s)
+				core_msrs[s->core][s->cpu_idx].wrmsr(s->msr, s->value);
+		} catch (const std::exception &e) {
+			std::cerr << "can't restore the counter configuration: " << e.what() << std::endl;
 		}
 	}
+};
 
-	// reset
-	std::vector<std::vector<u_int64_t>> values(num_cores);
+// Counter deltas of one sampling interval, indexed by core * num_events + event.
+struct interval_t {
+	u_int64_t time_ns;  // CLOCK_REALTIME at the end of the interval
+	u_int64_t tsc;
+	u_int64_t tsc_delta;
+	u_int64_t lateness_ns;
+	size_t num_events;
+	std::vector<u_int64_t> deltas;
+	std::vector<double> utils;
+	std::vector<bool> estimated;   // of each event: multiplexed out, and scaled from the last interval it was counted
+	u_int64_t cycles[NUM_PHASES];  // sampler cost; the output phase is that of the previous interval
+};
+
+void format_text(std::string &line, const interval_t &interval, int num_cores) {
+	char buf[64];
 	for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
-		for (size_t i = 0; i < length_of(UOPS_DISPATCHED_PORT); ++i) {
-			const int cpu_idx = i / info.num_pmc_per_thread;
-			const int pmc_idx = i % info.num_pmc_per_thread;
+		line += '[';
+		for (size_t i = 0; i < interval.num_events; ++i) {
+			// ~ instead of % marks the estimate of an event multiplexed out
+			snprintf(buf, sizeof(buf), interval.estimated[i] ? "%6.2f~" : "%6.2f%%", interval.utils[core_id * interval.num_events + i]);
+			line += buf;
+		}
+		line += "] ";
+	}
+}
+
+void format_prediction(std::string &line, const interval_t &interval, int num_cores, const port_prediction_t &prediction) {
+	const size_t num_events = interval.num_events;
+	const std::vector<u_int64_t> &deltas = interval.deltas;
 
-			auto &msr = core_msrs[core_id][cpu_idx];
-			msr.wrmsr(IA32_PMC[pmc_idx], 0);
+	// microbenchmarks run on one core, so compare against the core dispatching the most uops; the ports are the first
+	// events of a live interval
+	core_id_t busiest = 0;
+	u_int64_t busiest_uops = 0;
+	for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
+		const u_int64_t uops = std::accumulate(&deltas[core_id * num_events], &deltas[core_id * num_events + NUM_PORTS], (u_int64_t) 0);
+		if (uops > busiest_uops) {
+			busiest = core_id;
+			busiest_uops = uops;
 		}
-		values[core_id].resize(length_of(UOPS_DISPATCHED_PORT));
 	}
 
-	u_int64_t tsc0 = rdtsc();
-	while (true) {
-		usleep(1000 * 1000);
+	char buf[64];
+	line += "predicted [";
+	for (size_t i = 0; i < NUM_PORTS; ++i) {
+		snprintf(buf, sizeof(buf), "%6.2f%%", prediction.uops > 0 ? prediction.loads[i] / prediction.uops * 100 : 0.0);
+		line += buf;
+	}
+	snprintf(buf, sizeof(buf), "] core %d [", busiest);
+	line += buf;
+	for (size_t i = 0; i < NUM_PORTS; ++i) {
+		snprintf(buf, sizeof(buf), "%6.2f%%", busiest_uops ? deltas[busiest * num_events + i] / (double) busiest_uops * 100 : 0.0);
+		line += buf;
+	}
+	line += "] (share of uops)\n";
+}
+
+// Per-group means of the per-core utilization of an interval, for groups such as packages or NUMA nodes, and the
+// spread between the busiest and the idlest group.
+struct rollup_t {
+	const char *kind;
+	const char *groups_key;     // NDJSON keys
+	const char *imbalance_key;
+	std::vector<int> ids;          // group id of each group
+	std::vector<size_t> groups;    // group of each core
+	std::vector<size_t> sizes;     // cores in each group
+	size_t num_events;
+	std::vector<double> utils;     // group * num_events + event
+	double imbalance;              // percentage points between the busiest and the idlest group
+	size_t imbalance_event;
 
-		u_int64_t tsc = rdtsc();
-		u_int64_t hz = tsc - tsc0;
-		tsc0 = tsc;
+public:
+	rollup_t(const char *kind, const char *groups_key, const char *imbalance_key, const std::vector<int> &core_groups, size_t num_events)
+		: kind(kind), groups_key(groups_key), imbalance_key(imbalance_key), num_events(num_events), imbalance(0), imbalance_event(0) {
+		ids = core_groups;
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		sizes.assign(ids.size(), 0);
+		for (int id : core_groups) {
+			groups.push_back(std::lower_bound(ids.begin(), ids.end(), id) - ids.begin());
+			++sizes[groups.back()];
+		}
+		utils.resize(ids.size() * num_events);
+	}
 
-		for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
-			fprintf(stderr, "[");
-			for (size_t i = 0; i < length_of(UOPS_DISPATCHED_PORT); ++i) {
-				const int cpu_idx = i / info.num_pmc_per_thread;
-				const int pmc_idx = i % info.num_pmc_per_thread;
+	// one pass over the per-core utilization, accumulating into the groups
+	void update(const std::vector<double> &core_utils) {
+		std::fill(utils.begin(), utils.end(), 0.0);
+		for (size_t core = 0; core < groups.size(); ++core) {
+			double *group = &utils[groups[core] * num_events];
+			const double *util = &core_utils[core * num_events];
+			for (size_t e = 0; e < num_events; ++e)
+				group[e] += util[e];
+		}
+		imbalance = 0;
+		imbalance_event = 0;
+		for (size_t e = 0; e < num_events; ++e) {
+			double lo = INFINITY, hi = -INFINITY;
+			for (size_t g = 0; g < ids.size(); ++g) {
+				utils[g * num_events + e] /= sizes[g];
+				lo = std::min(lo, utils[g * num_events + e]);
+				hi = std::max(hi, utils[g * num_events + e]);
+			}
+			if (hi - lo > imbalance) {
+				imbalance = hi - lo;
+				imbalance_event = e;
+			}
+		}
+	}
+
+	void format_text(std::string &line) const {
+		char buf[64];
+		for (size_t g = 0; g < ids.size(); ++g) {
+			snprintf(buf, sizeof(buf), "%s %d [", kind, ids[g]);
+			line += buf;
+			for (size_t e = 0; e < num_events; ++e) {
+				snprintf(buf, sizeof(buf), "%6.2f%%", utils[g * num_events + e]);
+				line += buf;
+			}
+			line += "] ";
+		}
+		snprintf(buf, sizeof(buf), "imbalance %.2f (event %zu)\n", imbalance, imbalance_event);
+		line += buf;
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t g = 0; g < ids.size(); ++g) {
+			json.begin_object();
+			json.key("id").value(ids[g]);
+			json.key("cores").value((u_int64_t) sizes[g]);
+			json.key("util").begin_array();
+			for (size_t e = 0; e < num_events; ++e)
+				json.value(utils[g * num_events + e]);
+			json.end_array();
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// Position of an event among those of an interval, by encoding; -1 if it isn't counted.
+template<class Event>
+int find_event(const std::vector<Event> &events, const pmc_event_type_t &event) {
+	for (size_t i = 0; i < events.size(); ++i)
+		if (events[i].event == event.event && events[i].umask == event.umask)
+			return i;
+	return -1;
+}
+
+// Ports or groups of ports a core can run out of, the execution resources behind them, and the instructions to cut
+// when they saturate. Groups come first, since when all their ports are saturated none of them alone is the limit.
+struct port_group_t {
+	port_mask_t ports;
+	const char *label;
+	const char *resources;
+	const char *hint;
+};
+
+static const port_group_t SANDY_BRIDGE_PORT_GROUPS[] = {
+	{P015, "p015", "ports 0, 1 and 5: all ALUs", "fewer ALU uops overall: vectorize, hoist invariant work"},
+	{P23, "p23", "ports 2 and 3: loads and store addresses", "fewer loads and stores: keep values in registers"},
+	{P0, "p0", "port 0: ALU, divider, FP multiply, vector shifts and multiplies", "fewer divisions, FP multiplies and vector shifts"},
+	{P1, "p1", "port 1: ALU, FP add, integer multiply, LEA", "fewer FP adds, integer multiplies and three-operand LEAs"},
+	{P2, "p2", "port 2: loads and store addresses", "fewer loads and stores: keep values in registers"},
+	{P3, "p3", "port 3: loads and store addresses", "fewer loads and stores: keep values in registers"},
+	{P4, "p4", "port 4: store data", "fewer stores: keep values in registers, merge narrow stores"},
+	{P5, "p5", "port 5: ALU, shuffles, branches, FP logic", "fewer shuffles, permutes, blends and taken branches"},
+};
+
+// cores unhalted for less of an interval than this aren't classified
+static const double IDLE_FRACTION = 0.05;
+
+// Names the execution resource limiting each core in an interval: the port group whose ports all dispatch uops in at
+// least `threshold` of the core's unhalted cycles, preferring larger groups and then busier ones.
+struct port_classifier_t {
+	enum { IDLE = -2, NOT_BOUND = -1 };
+
+	double threshold;
+	int port_events[NUM_PORTS];  // positions of the events in the interval
+	int unhalted_event;
+	std::vector<int> bounds;     // group of each core, IDLE or NOT_BOUND
+	std::vector<double> unhalted;  // fraction of the interval each core was unhalted
+	std::vector<double> busy;    // core * NUM_PORTS + port: fraction of unhalted cycles the port dispatched a uop
+
+public:
+	template<class Event>
+	port_classifier_t(double threshold, const std::vector<Event> &events, int num_cores)
+		: threshold(threshold), bounds(num_cores, IDLE), unhalted(num_cores), busy(num_cores * NUM_PORTS) {
+		for (size_t port = 0; port < NUM_PORTS; ++port)
+			port_events[port] = find_event(events, UOPS_DISPATCHED_PORT[port]);
+		unhalted_event = find_event(events, FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED]);
+		if (unhalted_event < 0 || std::find(port_events, port_events + NUM_PORTS, -1) != port_events + NUM_PORTS)
+			throw std::runtime_error(std::string("classification needs the port events and ") + FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED].name);
+	}
+
+	void update(const interval_t &interval) {
+		const size_t num_events = interval.num_events;
+		for (size_t core = 0; core < bounds.size(); ++core) {
+			const u_int64_t *deltas = &interval.deltas[core * num_events];
+			const u_int64_t cycles = deltas[unhalted_event];
+			unhalted[core] = interval.tsc_delta ? cycles / (double) interval.tsc_delta : 0.0;
+			for (size_t port = 0; port < NUM_PORTS; ++port)
+				busy[core * NUM_PORTS + port] = cycles ? deltas[port_events[port]] / (double) cycles : 0.0;
+
+			bounds[core] = unhalted[core] < IDLE_FRACTION ? IDLE : NOT_BOUND;
+			if (bounds[core] == IDLE)
+				continue;
+			int best_ports = 0;
+			double best_busy = 0;
+			for (size_t g = 0; g < length_of(SANDY_BRIDGE_PORT_GROUPS); ++g) {
+				// a group is as busy as its idlest port
+				const port_mask_t ports = SANDY_BRIDGE_PORT_GROUPS[g].ports;
+				double group_busy = INFINITY;
+				for (size_t port = 0; port < NUM_PORTS; ++port)
+					if (ports & (1 << port))
+						group_busy = std::min(group_busy, busy[core * NUM_PORTS + port]);
+				const int num_ports = __builtin_popcount(ports);
+				if (group_busy >= threshold && (num_ports > best_ports || (num_ports == best_ports && group_busy > best_busy))) {
+					bounds[core] = g;
+					best_ports = num_ports;
+					best_busy = group_busy;
+				}
+			}
+		}
+	}
+
+	const char *label(size_t core) const {
+		switch (bounds[core]) {
+		case IDLE:
+			return "idle";
+		case NOT_BOUND:
+			return "none";
+		default:
+			return SANDY_BRIDGE_PORT_GROUPS[bounds[core]].label;
+		}
+	}
+
+	// the label of each core, then the resources and hint of each group some core is bound on
+	void format_text(std::string &line) const {
+		char buf[64];
+		line += "bound";
+		for (size_t core = 0; core < bounds.size(); ++core) {
+			snprintf(buf, sizeof(buf), " %zu:%s", core, label(core));
+			line += buf;
+		}
+		line += '\n';
+		for (size_t g = 0; g < length_of(SANDY_BRIDGE_PORT_GROUPS); ++g) {
+			if (std::find(bounds.begin(), bounds.end(), (int) g) == bounds.end())
+				continue;
+			const port_group_t &group = SANDY_BRIDGE_PORT_GROUPS[g];
+			line += "  ";
+			line += group.label;
+			line += " (";
+			line += group.resources;
+			line += "): ";
+			line += group.hint;
+			line += '\n';
+		}
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t core = 0; core < bounds.size(); ++core) {
+			json.begin_object();
+			json.key("bound").value(label(core));
+			json.key("unhalted").value(unhalted[core], 4);
+			json.key("port_busy").begin_array();
+			for (size_t port = 0; port < NUM_PORTS; ++port)
+				json.value(busy[core * NUM_PORTS + port], 4);
+			json.end_array();
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// Offcore response encodings of Sandy Bridge (SDM vol. 3B, 18.9.5). A response is counted when it matches one of the
+// request types in bits 15:0, one of the suppliers in bits 30:17 and one of the snoop results in bits 37:31. Remote
+// suppliers exist only on Sandy Bridge-EP.
+static const u_int64_t SNB_OFFCORE_ALL_READS = 0x3f7;            // demand and prefetch data, RFO and code reads
+static const u_int64_t SNB_OFFCORE_LLC_HIT = 0xfull << 18;       // LLC_HITM, LLC_HITE, LLC_HITS, LLC_HITF
+static const u_int64_t SNB_OFFCORE_LOCAL = 1ull << 22;
+static const u_int64_t SNB_OFFCORE_REMOTE = 0xffull << 23;
+static const u_int64_t SNB_OFFCORE_SNP_NO_DATA = 0xfull << 31;   // SNP_NONE, SNP_NOT_NEEDED, SNP_MISS, HIT_NO_FWD
+static const u_int64_t SNB_OFFCORE_SNP_DATA = 0x3ull << 35;      // HIT_FWD, HITM
+static const u_int64_t SNB_OFFCORE_SNP_ANY = SNB_OFFCORE_SNP_NO_DATA | SNB_OFFCORE_SNP_DATA;
+
+struct offcore_class_t {
+	const char *name;
+	const char *key;
+	u_int64_t response;
+	bool remote;
+	bool dram;
+};
+
+static const offcore_class_t SANDY_BRIDGE_OFFCORE_CLASSES[] = {
+	{"OFFCORE_RESPONSE.ALL_READS.LLC_HIT", "llc_hit", SNB_OFFCORE_LLC_HIT | SNB_OFFCORE_SNP_ANY, false, false},
+	{"OFFCORE_RESPONSE.ALL_READS.LOCAL_DRAM", "local_dram", SNB_OFFCORE_LOCAL | SNB_OFFCORE_SNP_ANY, false, true},
+	{"OFFCORE_RESPONSE.ALL_READS.REMOTE_DRAM", "remote_dram", SNB_OFFCORE_REMOTE | SNB_OFFCORE_SNP_NO_DATA, true, true},
+	{"OFFCORE_RESPONSE.ALL_READS.REMOTE_CACHE", "remote_cache", SNB_OFFCORE_REMOTE | SNB_OFFCORE_SNP_DATA, true, false},
+};
+
+static const size_t NUM_OFFCORE_CLASSES = length_of(SANDY_BRIDGE_OFFCORE_CLASSES);
+
+// the offcore response events of the traffic classes a CPU model supports
+std::vector<pmc_event_type_t> offcore_class_events(int model) {
+	std::vector<pmc_event_type_t> events;
+	for (const auto &c : SANDY_BRIDGE_OFFCORE_CLASSES) {
+		if (c.remote && model != 45)
+			continue;
+		pmc_event_type_t event = OFFCORE_RESPONSE[0];
+		event.name = c.name;
+		event.msr_index = MSR_OFFCORE_RSP[0];
+		event.msr_value = SNB_OFFCORE_ALL_READS | c.response;
+		events.push_back(event);
+	}
+	return events;
+}
+
+// Bytes each core read per second from each offcore traffic class, at a cache line per response.
+struct memory_traffic_t {
+	int class_events[NUM_OFFCORE_CLASSES];  // positions in the interval, -1 for classes not counted
+	double tsc_hz;
+	std::vector<double> rates;              // core * NUM_OFFCORE_CLASSES + class
+
+public:
+	template<class Event>
+	memory_traffic_t(const std::vector<Event> &events, int num_cores, double tsc_hz)
+		: tsc_hz(tsc_hz), rates(num_cores * NUM_OFFCORE_CLASSES) {
+		for (size_t c = 0; c < NUM_OFFCORE_CLASSES; ++c) {
+			class_events[c] = -1;
+			for (size_t i = 0; i < events.size(); ++i)
+				if (strcmp(events[i].name, SANDY_BRIDGE_OFFCORE_CLASSES[c].name) == 0)
+					class_events[c] = i;
+		}
+	}
+
+	void update(const interval_t &interval) {
+		const double seconds = interval.tsc_delta / tsc_hz;
+		for (size_t core = 0; core < rates.size() / NUM_OFFCORE_CLASSES; ++core)
+			for (size_t c = 0; c < NUM_OFFCORE_CLASSES; ++c)
+				rates[core * NUM_OFFCORE_CLASSES + c] = class_events[c] >= 0 && seconds > 0 ?
+					interval.deltas[core * interval.num_events + class_events[c]] * 64 / seconds : 0.0;
+	}
+
+	void format_text(std::string &line) const {
+		char buf[64];
+		line += "memory MB/s (LLC hit, local DRAM, remote DRAM, remote cache)";
+		for (size_t core = 0; core < rates.size() / NUM_OFFCORE_CLASSES; ++core) {
+			line += " [";
+			for (size_t c = 0; c < NUM_OFFCORE_CLASSES; ++c) {
+				if (class_events[c] >= 0)
+					snprintf(buf, sizeof(buf), " %8.1f", rates[core * NUM_OFFCORE_CLASSES + c] / 1e6);
+				else
+					snprintf(buf, sizeof(buf), " %8s", "-");
+				line += buf;
+			}
+			line += ']';
+		}
+		line += '\n';
+	}
+
+	// bytes per second of the classes counted
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t core = 0; core < rates.size() / NUM_OFFCORE_CLASSES; ++core) {
+			json.begin_object();
+			for (size_t c = 0; c < NUM_OFFCORE_CLASSES; ++c)
+				if (class_events[c] >= 0)
+					json.key(SANDY_BRIDGE_OFFCORE_CLASSES[c].key).value(rates[core * NUM_OFFCORE_CLASSES + c], 0);
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// Where the IDQ (instruction decode queue) got its uops from on Sandy Bridge: the decoded uop cache (DSB), the legacy
+// decoders (MITE) or the microcode sequencer (MS), the issue slots it left empty while the back end could take uops, and
+// the cycles lost switching from the DSB to the decoders.
+static const pmc_event_type_t FRONTEND_EVENTS[] = {
+	pmc_event_type_t(0x79, 0x08, "IDQ.DSB_UOPS"),
+	pmc_event_type_t(0x79, 0x04, "IDQ.MITE_UOPS"),
+	pmc_event_type_t(0x79, 0x30, "IDQ.MS_UOPS"),
+	pmc_event_type_t(0x9c, 0x01, "IDQ_UOPS_NOT_DELIVERED.CORE"),
+	pmc_event_type_t(0xab, 0x02, "DSB2MITE_SWITCHES.PENALTY_CYCLES"),
+};
+
+enum frontend_event_t {
+	FRONTEND_DSB,
+	FRONTEND_MITE,
+	FRONTEND_MS,
+	FRONTEND_NOT_DELIVERED,
+	FRONTEND_DSB2MITE,
+	NUM_FRONTEND_EVENTS,
+};
+
+// uops the front end can issue per cycle
+static const int ISSUE_WIDTH = 4;
+
+// Front-end supply of each core: the share of uops each source delivered, the fraction of issue slots left empty by the
+// front end and the fraction of unhalted cycles spent in DSB-to-MITE switch penalties.
+struct frontend_t {
+	int frontend_events[NUM_FRONTEND_EVENTS];  // positions of the events in the interval
+	int unhalted_event;
+	std::vector<double> shares;                // core * 3 + source: DSB, MITE, MS
+	std::vector<double> not_delivered;
+	std::vector<double> switch_penalty;
+
+public:
+	template<class Event>
+	frontend_t(const std::vector<Event> &events, int num_cores)
+		: shares(num_cores * 3), not_delivered(num_cores), switch_penalty(num_cores) {
+		for (size_t i = 0; i < NUM_FRONTEND_EVENTS; ++i)
+			frontend_events[i] = find_event(events, FRONTEND_EVENTS[i]);
+		unhalted_event = find_event(events, FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED]);
+		if (unhalted_event < 0 || std::find(frontend_events, frontend_events + NUM_FRONTEND_EVENTS, -1) != frontend_events + NUM_FRONTEND_EVENTS)
+			throw std::runtime_error(std::string("frontend analysis needs the IDQ, IDQ_UOPS_NOT_DELIVERED and DSB2MITE_SWITCHES events and ") +
+				FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED].name);
+	}
+
+	void update(const interval_t &interval) {
+		for (size_t core = 0; core < not_delivered.size(); ++core) {
+			const u_int64_t *deltas = &interval.deltas[core * interval.num_events];
+			const u_int64_t cycles = deltas[unhalted_event];
+			u_int64_t uops = 0;
+			for (int source = FRONTEND_DSB; source <= FRONTEND_MS; ++source)
+				uops += deltas[frontend_events[source]];
+			for (int source = FRONTEND_DSB; source <= FRONTEND_MS; ++source)
+				shares[core * 3 + source] = uops ? deltas[frontend_events[source]] / (double) uops : 0.0;
+			not_delivered[core] = cycles ? deltas[frontend_events[FRONTEND_NOT_DELIVERED]] / (double) (ISSUE_WIDTH * cycles) : 0.0;
+			switch_penalty[core] = cycles ? deltas[frontend_events[FRONTEND_DSB2MITE]] / (double) cycles : 0.0;
+		}
+	}
+
+	void format_text(std::string &line) const {
+		char buf[64];
+		line += "frontend (DSB MITE MS % of uops, % of slots not delivered, % of cycles in DSB-MITE switches)";
+		for (size_t core = 0; core < not_delivered.size(); ++core) {
+			snprintf(buf, sizeof(buf), " [%5.1f %5.1f %5.1f %5.1f %5.1f]", shares[core * 3] * 100, shares[core * 3 + 1] * 100,
+				shares[core * 3 + 2] * 100, not_delivered[core] * 100, switch_penalty[core] * 100);
+			line += buf;
+		}
+		line += '\n';
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t core = 0; core < not_delivered.size(); ++core) {
+			json.begin_object();
+			json.key("dsb").value(shares[core * 3], 4);
+			json.key("mite").value(shares[core * 3 + 1], 4);
+			json.key("ms").value(shares[core * 3 + 2], 4);
+			json.key("not_delivered").value(not_delivered[core], 4);
+			json.key("dsb2mite_penalty").value(switch_penalty[core], 4);
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// Floating-point operations executed on Sandy Bridge by width and precision, with the operations per instruction.
+// These count executed rather than retired uops, so replays after cache misses count again.
+struct fp_event_t {
+	pmc_event_type_t event;
+	int flops;
+	bool vector;
+};
+
+static const fp_event_t SANDY_BRIDGE_FP_EVENTS[] = {
+	{pmc_event_type_t(0x10, 0x01, "FP_COMP_OPS_EXE.X87"), 1, false},
+	{pmc_event_type_t(0x10, 0x80, "FP_COMP_OPS_EXE.SSE_SCALAR_DOUBLE"), 1, false},
+	{pmc_event_type_t(0x10, 0x20, "FP_COMP_OPS_EXE.SSE_SCALAR_SINGLE"), 1, false},
+	{pmc_event_type_t(0x10, 0x10, "FP_COMP_OPS_EXE.SSE_PACKED_DOUBLE"), 2, true},
+	{pmc_event_type_t(0x10, 0x40, "FP_COMP_OPS_EXE.SSE_PACKED_SINGLE"), 4, true},
+	{pmc_event_type_t(0x11, 0x02, "SIMD_FP_256.PACKED_DOUBLE"), 4, true},
+	{pmc_event_type_t(0x11, 0x01, "SIMD_FP_256.PACKED_SINGLE"), 8, true},
+};
+
+static const size_t NUM_FP_EVENTS = length_of(SANDY_BRIDGE_FP_EVENTS);
+
+// Floating-point operations per second of each core and the fraction of them done by vector instructions.
+struct flops_t {
+	int fp_events[NUM_FP_EVENTS];  // positions of the events in the interval
+	double tsc_hz;
+	std::vector<double> rates;     // flops per second of each core
+	std::vector<double> vectorized;
+
+public:
+	template<class Event>
+	flops_t(const std::vector<Event> &events, int num_cores, double tsc_hz)
+		: tsc_hz(tsc_hz), rates(num_cores), vectorized(num_cores) {
+		for (size_t i = 0; i < NUM_FP_EVENTS; ++i) {
+			fp_events[i] = find_event(events, SANDY_BRIDGE_FP_EVENTS[i].event);
+			if (fp_events[i] < 0)
+				throw std::runtime_error(std::string("FLOPS need ") + SANDY_BRIDGE_FP_EVENTS[i].event.name);
+		}
+	}
+
+	void update(const interval_t &interval) {
+		const double seconds = interval.tsc_delta / tsc_hz;
+		for (size_t core = 0; core < rates.size(); ++core) {
+			const u_int64_t *deltas = &interval.deltas[core * interval.num_events];
+			u_int64_t flops = 0, vector_flops = 0;
+			for (size_t i = 0; i < NUM_FP_EVENTS; ++i) {
+				const u_int64_t n = deltas[fp_events[i]] * SANDY_BRIDGE_FP_EVENTS[i].flops;
+				flops += n;
+				if (SANDY_BRIDGE_FP_EVENTS[i].vector)
+					vector_flops += n;
+			}
+			rates[core] = seconds > 0 ? flops / seconds : 0.0;
+			vectorized[core] = flops ? vector_flops / (double) flops : 0.0;
+		}
+	}
+
+	void format_text(std::string &line) const {
+		char buf[64];
+		line += "GFLOPS (vectorized %)";
+		for (size_t core = 0; core < rates.size(); ++core) {
+			snprintf(buf, sizeof(buf), " [%7.2f %5.1f%%]", rates[core] / 1e9, vectorized[core] * 100);
+			line += buf;
+		}
+		line += '\n';
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t core = 0; core < rates.size(); ++core) {
+			json.begin_object();
+			json.key("flops").value(rates[core], 0);
+			json.key("vectorized").value(vectorized[core], 4);
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// Double-precision operations a Sandy Bridge core can execute per cycle: a 256-bit add and a 256-bit multiply.
+static const int PEAK_FLOPS_PER_CYCLE = 8;
+// bytes each thread streams through when measuring bandwidth, well past the LLC
+static const size_t BANDWIDTH_BUFFER = 64 << 20;
+static const int BANDWIDTH_PASSES = 4;
+
+// Read bandwidth in bytes per second of one thread streaming on each of the given CPUs at once: the threads fill their
+// buffers, wait until all of them have, and the bytes they read are divided by the time from the start to the last.
+double measure_bandwidth(const std::vector<cpu_id_t> &cpus) {
+	int ready = 0, go = 0;
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < cpus.size(); ++t) {
+		threads.emplace_back([&cpus, &ready, &go, t]() {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[t], &set);
+			sched_setaffinity(0, sizeof(set), &set);
+			std::vector<u_int64_t> buffer(BANDWIDTH_BUFFER / sizeof(u_int64_t), 1);
+			volatile u_int64_t sink = 0;
+			__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+			while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+				sched_yield();
+			for (int pass = 0; pass < BANDWIDTH_PASSES; ++pass) {
+				u_int64_t sum = 0;
+				for (size_t i = 0; i < buffer.size(); i += 8)  // a cache line
+					sum += buffer[i];
+				sink = sink + sum;
+			}
+		});
+	}
+	while (__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < (int) cpus.size())
+		sched_yield();
+	const u_int64_t start = monotonic_ns();
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for (auto &thread : threads)
+		thread.join();
+	const u_int64_t ns = monotonic_ns() - start;
+	return ns ? (double) BANDWIDTH_BUFFER * BANDWIDTH_PASSES * cpus.size() / ns * 1e9 : 0.0;
+}
+
+// the first logical processor of each core of the first package
+std::vector<cpu_id_t> first_package_cpus(const topology_t &topology) {
+	std::vector<cpu_id_t> cpus;
+	for (core_id_t core_id = 0; core_id < topology.num_cores; ++core_id)
+		if (topology.packages[core_id] == topology.packages[0])
+			cpus.push_back(topology.cpus[core_id][0]);
+	return cpus;
+}
+
+// Places each core on the roofline of its package: arithmetic intensity is FLOPs per byte read from DRAM, and the roof
+// is the lower of the core's peak FLOPS and the core's share of the bandwidth times that intensity. The cores reading
+// DRAM in an interval share their package's bandwidth evenly, and none gets more than one core can stream alone.
+struct roofline_t {
+	const flops_t &flops;
+	const memory_traffic_t &memory;
+	const std::vector<int> &packages;
+	double peak_flops;            // per core
+	double bandwidth;             // bytes per second per package
+	double core_bandwidth;        // bytes per second of a core alone
+	std::vector<double> intensities;
+	std::vector<double> shares;   // of the bandwidth, bytes per second
+	std::vector<double> roofs;
+
+public:
+	roofline_t(const flops_t &flops, const memory_traffic_t &memory, const std::vector<int> &packages, double peak_flops,
+	           double bandwidth, double core_bandwidth)
+		: flops(flops), memory(memory), packages(packages), peak_flops(peak_flops), bandwidth(bandwidth),
+		  core_bandwidth(core_bandwidth), intensities(flops.rates.size()), shares(flops.rates.size()), roofs(flops.rates.size()) {}
+
+	void update() {
+		std::map<int, int> readers;
+		for (size_t core = 0; core < intensities.size(); ++core) {
+			double dram = 0;
+			for (size_t c = 0; c < NUM_OFFCORE_CLASSES; ++c)
+				if (SANDY_BRIDGE_OFFCORE_CLASSES[c].dram)
+					dram += memory.rates[core * NUM_OFFCORE_CLASSES + c];
+			intensities[core] = dram > 0 ? flops.rates[core] / dram : INFINITY;
+			if (dram > 0)
+				++readers[packages[core]];
+		}
+		for (size_t core = 0; core < intensities.size(); ++core) {
+			shares[core] = std::min(core_bandwidth, bandwidth / std::max(readers[packages[core]], 1));
+			roofs[core] = std::min(peak_flops, intensities[core] * shares[core]);
+		}
+	}
+
+	// the intensity above which a core can reach its peak
+	double ridge(size_t core) const {
+		return peak_flops / shares[core];
+	}
+
+	const char *bound(size_t core) const {
+		if (flops.rates[core] == 0)
+			return "idle";
+		return intensities[core] < ridge(core) ? "memory" : "compute";
+	}
+
+	void format_text(std::string &line) const {
+		char buf[96];
+		line += "roofline (FLOP/byte, % of roof, bound)";
+		for (size_t core = 0; core < intensities.size(); ++core) {
+			snprintf(buf, sizeof(buf), " [%7.2f %5.1f%% %s]", std::min(intensities[core], 9999.99),
+				roofs[core] > 0 ? flops.rates[core] / roofs[core] * 100 : 0.0, bound(core));
+			line += buf;
+		}
+		line += '\n';
+	}
+
+	// A log-log chart of GFLOPS over FLOP/byte with the roof of a core reading DRAM alone and each core as a digit or
+	// letter (its index in base 36), from 1/64 to 64 FLOP/byte and from a thousandth of the peak to twice the peak.
+	void format_chart(std::string &line) const {
+		const double alone = std::min(core_bandwidth, bandwidth);
+		static const int WIDTH = 61, HEIGHT = 12;
+		static const double MIN_INTENSITY = 1 / 64.0, OCTAVES_X = 12, OCTAVES_Y = 11;
+		auto column = [](double intensity) {
+			return (int) lround(log2(intensity / MIN_INTENSITY) / OCTAVES_X * (WIDTH - 1));
+		};
+		auto row = [this](double rate) {
+			return (int) lround(log2(2 * peak_flops / rate) / OCTAVES_Y * (HEIGHT - 1));
+		};
+		std::vector<std::string> grid(HEIGHT, std::string(WIDTH, ' '));
+		for (int x = 0; x < WIDTH; ++x) {
+			const double intensity = MIN_INTENSITY * exp2(x * OCTAVES_X / (WIDTH - 1));
+			const int y = row(std::min(peak_flops, intensity * alone));
+			if (y >= 0 && y < HEIGHT)
+				grid[y][x] = intensity * alone < peak_flops ? '/' : '-';
+		}
+		for (size_t core = 0; core < intensities.size(); ++core) {
+			if (flops.rates[core] <= 0)
+				continue;
+			const int x = std::max(0, std::min(WIDTH - 1, column(intensities[core])));
+			const int y = std::max(0, std::min(HEIGHT - 1, row(flops.rates[core])));
+			grid[y][x] = "0123456789abcdefghijklmnopqrstuvwxyz"[core % 36];
+		}
+		char buf[32];
+		for (int y = 0; y < HEIGHT; ++y) {
+			snprintf(buf, sizeof(buf), "%9.2f |", 2 * peak_flops / exp2(y * OCTAVES_Y / (HEIGHT - 1)) / 1e9);
+			line += buf;
+			line += grid[y];
+			line += '\n';
+		}
+		std::string axis(WIDTH, ' ');
+		axis.replace(0, 4, "1/64");
+		axis[column(1)] = '1';
+		axis.replace(WIDTH - 2, 2, "64");
+		line += "   GFLOPS +" + std::string(WIDTH, '-') + '\n';
+		line += std::string(11, ' ') + axis + " FLOP/byte\n";
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_object();
+		json.key("peak_flops").value(peak_flops, 0);
+		json.key("bandwidth").value(bandwidth, 0);
+		json.key("core_bandwidth").value(core_bandwidth, 0);
+		json.key("cores").begin_array();
+		for (size_t core = 0; core < intensities.size(); ++core) {
+			json.begin_object();
+			if (!std::isinf(intensities[core]))  // cores without DRAM reads have no intensity
+				json.key("intensity").value(intensities[core], 4);
+			json.key("flops").value(flops.rates[core], 0);
+			json.key("bandwidth").value(shares[core], 0);
+			json.key("roof").value(roofs[core], 0);
+			json.key("bound").value(bound(core));
+			json.end_object();
+		}
+		json.end_array();
+		json.end_object();
+	}
+};
+
+// Per-core thermal status: bit 0 is set while the core is throttled for temperature, bit 10 while it is held below
+// the requested frequency by a power limit, and their sticky log bits 1 and 11 record that it happened since last
+// cleared. Log bits are cleared by writing 0 to them; the others are left as read.
+static const msr_addr_t IA32_THERM_STATUS = 0x19c;
+static const u_int64_t THERM_STATUS_LOGS = 0xaaa;
+static const u_int64_t THERM_THROTTLE_LOG = 1ull << 1;
+static const u_int64_t POWER_LIMIT_LOG = 1ull << 11;
+
+// Frequency levels relative to the TSC (nominal) frequency, the nearest Sandy Bridge has to frequency licenses.
+enum frequency_level_t {
+	LEVEL_TURBO,
+	LEVEL_NOMINAL,
+	LEVEL_BELOW,
+	NUM_LEVELS,
+};
+
+static const char *const LEVEL_NAMES[] = {"turbo", "nominal", "below"};
+
+// unhalted frequencies within this fraction of nominal are nominal
+static const double NOMINAL_TOLERANCE = 0.02;
+
+// The average frequency of each core while unhalted, from its unhalted core and reference cycles, its frequency level,
+// whether it was throttled for temperature or power during the interval, and the unhalted time it spent at each level.
+struct power_t {
+	enum { THERMAL = 1, POWER_LIMIT = 2 };
+
+	int unhalted_event;
+	int ref_event;
+	double tsc_hz;
+	std::vector<double> hz;
+	std::vector<int> levels;
+	std::vector<int> throttled;   // THERMAL and POWER_LIMIT bits
+	std::vector<double> residency;  // core * NUM_LEVELS + level: unhalted seconds since the start
+	std::vector<u_int64_t> throttled_intervals;
+
+public:
+	template<class Event>
+	power_t(const std::vector<Event> &events, int num_cores, double tsc_hz)
+		: tsc_hz(tsc_hz), hz(num_cores), levels(num_cores, LEVEL_NOMINAL), throttled(num_cores),
+		  residency(num_cores * NUM_LEVELS), throttled_intervals(num_cores) {
+		unhalted_event = find_event(events, FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED]);
+		ref_event = find_event(events, FIXED_EVENTS[FIXED_REF_TSC]);
+		if (unhalted_event < 0 || ref_event < 0)
+			throw std::runtime_error(std::string("frequency tracking needs ") + FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED].name +
+				" and " + FIXED_EVENTS[FIXED_REF_TSC].name);
+	}
+
+	// Reads and clears the throttling logs of each core; returns the number of syscalls.
+	size_t sample(std::vector<std::vector<msr_t>> &core_msrs) {
+		size_t syscalls = 0;
+		for (size_t core = 0; core < core_msrs.size(); ++core) {
+			auto &msr = core_msrs[core][0];
+			const u_int64_t status = msr.rdmsr(IA32_THERM_STATUS);
+			++syscalls;
+			throttled[core] = (status & THERM_THROTTLE_LOG ? THERMAL : 0) | (status & POWER_LIMIT_LOG ? POWER_LIMIT : 0);
+			if (throttled[core]) {
+				msr.wrmsr(IA32_THERM_STATUS, status & THERM_STATUS_LOGS & ~(THERM_THROTTLE_LOG | POWER_LIMIT_LOG));
+				++syscalls;
+			}
+		}
+		return syscalls;
+	}
+
+	void update(const interval_t &interval) {
+		for (size_t core = 0; core < hz.size(); ++core) {
+			const u_int64_t *deltas = &interval.deltas[core * interval.num_events];
+			const u_int64_t ref = deltas[ref_event];
+			hz[core] = ref ? deltas[unhalted_event] * tsc_hz / ref : 0.0;
+			const double ratio = hz[core] / tsc_hz;
+			levels[core] = ratio > 1 + NOMINAL_TOLERANCE ? LEVEL_TURBO : ratio < 1 - NOMINAL_TOLERANCE ? LEVEL_BELOW : LEVEL_NOMINAL;
+			if (ref)
+				residency[core * NUM_LEVELS + levels[core]] += ref / tsc_hz;
+			if (throttled[core])
+				++throttled_intervals[core];
+		}
+	}
+
+	// share of the unhalted time a core spent at a level
+	double share(size_t core, int level) const {
+		const double *r = &residency[core * NUM_LEVELS];
+		const double total = r[LEVEL_TURBO] + r[LEVEL_NOMINAL] + r[LEVEL_BELOW];
+		return total > 0 ? r[level] / total : 0.0;
+	}
+
+	// the frequency, level and throttling of each core, then its residency at each level since the start
+	void format_text(std::string &line) const {
+		char buf[96];
+		line += "frequency GHz";
+		for (size_t core = 0; core < hz.size(); ++core) {
+			snprintf(buf, sizeof(buf), " [%4.2f %-7s%s%s]", hz[core] / 1e9, LEVEL_NAMES[levels[core]],
+				throttled[core] & THERMAL ? " thermal" : "", throttled[core] & POWER_LIMIT ? " power" : "");
+			line += buf;
+		}
+		line += "\nresidency % (turbo nominal below, throttled intervals)";
+		for (size_t core = 0; core < hz.size(); ++core) {
+			snprintf(buf, sizeof(buf), " [%5.1f %5.1f %5.1f %4llu]", share(core, LEVEL_TURBO) * 100, share(core, LEVEL_NOMINAL) * 100,
+				share(core, LEVEL_BELOW) * 100, (unsigned long long) throttled_intervals[core]);
+			line += buf;
+		}
+		line += '\n';
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t core = 0; core < hz.size(); ++core) {
+			json.begin_object();
+			json.key("hz").value(hz[core], 0);
+			json.key("level").value(LEVEL_NAMES[levels[core]]);
+			json.key("thermal_throttle").value((u_int64_t) (throttled[core] & THERMAL ? 1 : 0));
+			json.key("power_limit").value((u_int64_t) (throttled[core] & POWER_LIMIT ? 1 : 0));
+			json.key("residency").begin_object();
+			for (int level = 0; level < NUM_LEVELS; ++level)
+				json.key(LEVEL_NAMES[level]).value(share(core, level), 4);
+			json.end_object();
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// Sandy Bridge events for uops that are issued but never retire or that run through the microcode sequencer: assists
+// and machine clears, by cause. Issued and retired uops come first so that they are multiplexed into the same group.
+static const pmc_event_type_t ASSIST_EVENTS[] = {
+	pmc_event_type_t(0x0e, 0x01, "UOPS_ISSUED.ANY"),
+	pmc_event_type_t(0xc2, 0x01, "UOPS_RETIRED.ALL"),
+	pmc_event_type_t(0xca, 0x1e, "FP_ASSIST.ANY", 1),
+	pmc_event_type_t(0xc1, 0x10, "OTHER_ASSISTS.AVX_TO_SSE"),
+	pmc_event_type_t(0xc1, 0x20, "OTHER_ASSISTS.SSE_TO_AVX"),
+	pmc_event_type_t(0xc3, 0x02, "MACHINE_CLEARS.MEMORY_ORDERING"),
+	pmc_event_type_t(0xc3, 0x04, "MACHINE_CLEARS.SMC"),
+	pmc_event_type_t(0xc3, 0x20, "MACHINE_CLEARS.MASKMOV"),
+};
+
+enum assist_event_t {
+	ASSIST_UOPS_ISSUED,
+	ASSIST_UOPS_RETIRED,
+	FIRST_ASSIST_CAUSE,
+	NUM_ASSIST_EVENTS = length_of(ASSIST_EVENTS),
+};
+
+static const char *const ASSIST_KEYS[] = {
+	"uops_issued", "uops_retired", "fp_assist", "avx_to_sse", "sse_to_avx", "memory_ordering", "smc", "maskmov",
+};
+
+// Assists and machine clears per thousand instructions retired of each core, the share of issued uops that didn't
+// retire, and the cores where the causes together exceed a threshold, with the perf command that samples the worst
+// cause on the core's CPUs to find the code behind it.
+struct assists_t {
+	int assist_events[NUM_ASSIST_EVENTS];  // positions of the events in the interval
+	int inst_event;
+	double threshold;                      // per thousand instructions
+	std::vector<std::string> cpu_lists;    // CPUs of each core, for perf -C
+	std::vector<double> pki;               // core * NUM_ASSIST_EVENTS + event, causes only
+	std::vector<double> wasted;
+	std::vector<int> worst;                // cause of a flagged core, or -1
+
+public:
+	template<class Event>
+	assists_t(const std::vector<Event> &events, const topology_t &topology, double threshold)
+		: threshold(threshold), pki(topology.num_cores * NUM_ASSIST_EVENTS), wasted(topology.num_cores), worst(topology.num_cores, -1) {
+		for (size_t i = 0; i < NUM_ASSIST_EVENTS; ++i)
+			assist_events[i] = find_event(events, ASSIST_EVENTS[i]);
+		inst_event = find_event(events, FIXED_EVENTS[FIXED_INST_RETIRED]);
+		if (inst_event < 0 || std::find(assist_events, assist_events + NUM_ASSIST_EVENTS, -1) != assist_events + NUM_ASSIST_EVENTS)
+			throw std::runtime_error(std::string("assist detection needs the UOPS_ISSUED, UOPS_RETIRED, assist and machine clear events and ") +
+				FIXED_EVENTS[FIXED_INST_RETIRED].name);
+		for (const auto &cpus : topology.cpus) {
+			std::string list;
+			for (cpu_id_t cpu : cpus)
+				list += (list.empty() ? "" : ",") + std::to_string(cpu);
+			cpu_lists.push_back(list);
+		}
+	}
+
+	void update(const interval_t &interval) {
+		for (size_t core = 0; core < wasted.size(); ++core) {
+			const u_int64_t *deltas = &interval.deltas[core * interval.num_events];
+			const u_int64_t issued = deltas[assist_events[ASSIST_UOPS_ISSUED]];
+			const u_int64_t retired = deltas[assist_events[ASSIST_UOPS_RETIRED]];
+			// the two may be estimated from different intervals when multiplexed with other events
+			wasted[core] = issued > retired ? (issued - retired) / (double) issued : 0.0;
+			const u_int64_t instructions = deltas[inst_event];
+			double total = 0;
+			worst[core] = -1;
+			for (size_t i = FIRST_ASSIST_CAUSE; i < NUM_ASSIST_EVENTS; ++i) {
+				double &n = pki[core * NUM_ASSIST_EVENTS + i];
+				n = instructions ? deltas[assist_events[i]] * 1000.0 / instructions : 0.0;
+				total += n;
+				if (worst[core] < 0 || n > pki[core * NUM_ASSIST_EVENTS + worst[core]])
+					worst[core] = i;
+			}
+			if (total <= threshold)
+				worst[core] = -1;
+		}
+	}
+
+	// perf record command that samples the worst cause of a flagged core
+	std::string perf_command(size_t core) const {
+		const pmc_event_type_t &event = ASSIST_EVENTS[worst[core]];
+		char buf[96];
+		snprintf(buf, sizeof(buf), "perf record -C %s -e cpu/event=0x%02x,umask=0x%02x%s/ -g", cpu_lists[core].c_str(),
+			event.event, event.umask, event.cmask ? ",cmask=1" : "");
+		return buf;
+	}
+
+	// per core the assists and clears per thousand instructions and the share of wasted uops, then each flagged core
+	void format_text(std::string &line) const {
+		char buf[96];
+		line += "assists/clears PKI (FP, AVX-SSE, SSE-AVX, ordering, SMC, MASKMOV; % uops not retired)";
+		for (size_t core = 0; core < wasted.size(); ++core) {
+			line += " [";
+			for (size_t i = FIRST_ASSIST_CAUSE; i < NUM_ASSIST_EVENTS; ++i) {
+				snprintf(buf, sizeof(buf), "%s%.2f", i == FIRST_ASSIST_CAUSE ? "" : " ", pki[core * NUM_ASSIST_EVENTS + i]);
+				line += buf;
+			}
+			snprintf(buf, sizeof(buf), "; %.1f%%]", wasted[core] * 100);
+			line += buf;
+		}
+		line += '\n';
+		for (size_t core = 0; core < wasted.size(); ++core) {
+			if (worst[core] < 0)
+				continue;
+			snprintf(buf, sizeof(buf), "  core %zu: %s %.2f PKI, sample with: ", core, ASSIST_EVENTS[worst[core]].name,
+				pki[core * NUM_ASSIST_EVENTS + worst[core]]);
+			line += buf;
+			line += perf_command(core);
+			line += '\n';
+		}
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t core = 0; core < wasted.size(); ++core) {
+			json.begin_object();
+			for (size_t i = FIRST_ASSIST_CAUSE; i < NUM_ASSIST_EVENTS; ++i)
+				json.key(ASSIST_KEYS[i]).value(pki[core * NUM_ASSIST_EVENTS + i], 4);
+			json.key("wasted_uops").value(wasted[core], 4);
+			if (worst[core] >= 0) {
+				json.key("flagged").value(ASSIST_KEYS[worst[core]]);
+				json.key("perf_record").value(perf_command(core).c_str());
+			}
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+static const char *const TRACEFS_ROOTS[] = {
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+};
+
+// Tracepoint ID of sched_switch and the offsets of the fields we use in its raw samples, from its format file.
+struct sched_switch_format_t {
+	int id;
+	int prev_comm;
+	int prev_pid;
+	int next_comm;
+	int next_pid;
+};
+
+sched_switch_format_t sched_switch_format() {
+	for (const char *root : TRACEFS_ROOTS) {
+		const std::string dir = std::string(root) + "/events/sched/sched_switch/";
+		std::ifstream id(dir + "id");
+		std::ifstream format(dir + "format");
+		if (!id || !format)
+			continue;
+
+		sched_switch_format_t f;
+		f.id = f.prev_comm = f.prev_pid = f.next_comm = f.next_pid = -1;
+		id >> f.id;
+		std::string line;
+		while (std::getline(format, line)) {
+			// "	field:char prev_comm[16];	offset:8;	size:16;	signed:0;"
+			const std::vector<std::string> attrs = split(line, ';');
+			if (attrs.size() < 2 || trim(attrs[0]).compare(0, 6, "field:") != 0 || trim(attrs[1]).compare(0, 7, "offset:") != 0)
+				continue;
+			std::string decl = trim(attrs[0]);
+			decl = decl.substr(0, decl.find('['));
+			const std::string name = decl.substr(decl.find_last_of(" *") + 1);
+			const int offset = std::stoi(trim(attrs[1]).substr(7));
+			if (name == "prev_comm")
+				f.prev_comm = offset;
+			else if (name == "prev_pid")
+				f.prev_pid = offset;
+			else if (name == "next_comm")
+				f.next_comm = offset;
+			else if (name == "next_pid")
+				f.next_pid = offset;
+		}
+		if (f.id < 0 || f.prev_comm < 0 || f.prev_pid < 0 || f.next_comm < 0 || f.next_pid < 0)
+			throw std::runtime_error("unexpected format of " + dir + "format");
+		return f;
+	}
+	throw std::runtime_error("sched_switch tracepoint not found; is tracefs mounted?");
+}
+
+// pages of each per-CPU ring; a sched_switch sample takes about 100 bytes
+static const size_t SCHED_RING_PAGES = 512;
+// drains after which the process of a thread not seen switching or running is forgotten
+static const u_int64_t PROCESS_SWEEP_DRAINS = 64;
+
+// A stretch of time a task spent on a core within an interval.
+struct task_slice_t {
+	int core;
+	int pid;  // process, or thread while its process is unknown
+	char comm[16];
+	u_int64_t ns;
+};
+
+// Follows context switches on every CPU through sched_switch samples in per-CPU perf ring buffers, which are read in
+// place without syscalls, and cuts the time on CPU of each task into slices at interval boundaries.
+struct sched_tracer_t {
+private:
+	struct process_t {
+		int pid;
+		u_int64_t seen;  // drain the thread was last seen in
+	};
+
+	struct ring_t {
+		int fd;
+		char *base;
+		int core;
+		int tid;  // running thread, or -1 before the first switch
+		char comm[16];
+		u_int64_t since_ns;
+	};
+
+	sched_switch_format_t format;
+	size_t page_size;
+	size_t data_size;
+	std::vector<ring_t> rings;
+	std::unordered_map<int, process_t> processes;  // thread to process, learnt from the samples
+	u_int64_t drains;
+	std::vector<char> scratch;                     // a record wrapping around the end of a ring
+
+	// sample_type PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_RAW
+	struct sample_t {
+		struct perf_event_header header;
+		u_int32_t pid;
+		u_int32_t tid;
+		u_int64_t time;
+		u_int32_t size;  // of the raw tracepoint data that follows
+	} __attribute__((packed));
+
+	void slice(std::vector<task_slice_t> &slices, const ring_t &ring, int tid, const char *comm, u_int64_t end_ns) const {
+		// the idle task doesn't dispatch uops
+		if (tid <= 0 || end_ns <= ring.since_ns)
+			return;
+		const auto process = processes.find(tid);
+		task_slice_t s;
+		s.core = ring.core;
+		s.pid = process != processes.end() ? process->second.pid : tid;
+		memcpy(s.comm, comm, sizeof(s.comm));
+		s.comm[sizeof(s.comm) - 1] = '\0';
+		s.ns = end_ns - ring.since_ns;
+		slices.push_back(s);
+	}
+
+public:
+	u_int64_t lost;  // switches dropped by full rings during the last drain
+
+	sched_tracer_t(const sched_tracer_t &) = delete;
+	sched_tracer_t &operator=(const sched_tracer_t &) = delete;
+	// cpus and core_of_cpu as in topology_t; each ring holds pages, a power of two
+	sched_tracer_t(const std::vector<cpu_t> &cpus, const std::vector<int> &core_of_cpu, size_t pages)
+		: format(sched_switch_format()), page_size(sysconf(_SC_PAGESIZE)), data_size(pages * page_size), drains(0), scratch(65536), lost(0) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.config = format.id;
+		attr.sample_period = 1;
+		attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+		attr.use_clockid = 1;
+		attr.clockid = CLOCK_MONOTONIC;
+
+		const u_int64_t now = monotonic_ns();
+		for (size_t i = 0; i < cpus.size(); ++i) {
+			ring_t ring;
+			ring.fd = syscall(__NR_perf_event_open, &attr, -1, cpus[i].id, -1, PERF_FLAG_FD_CLOEXEC);
+			if (ring.fd < 0)
+				throw std::runtime_error("can't trace sched_switch on cpu " + std::to_string(cpus[i].id) + ": " + strerror(errno));
+			void *p = mmap(NULL, page_size + data_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+			if (p == MAP_FAILED) {
+				close(ring.fd);
+				throw std::runtime_error(std::string("can't map sched_switch ring: ") + strerror(errno));
+			}
+			ring.base = (char *) p;
+			ring.core = core_of_cpu[i];
+			ring.tid = -1;
+			memset(ring.comm, 0, sizeof(ring.comm));
+			ring.since_ns = now;
+			rings.push_back(ring);
+		}
+	}
+	~sched_tracer_t() {
+		for (const auto &ring : rings) {
+			munmap(ring.base, page_size + data_size);
+			close(ring.fd);
+		}
+	}
+
+	// Consumes the switches up to end_ns, appending a slice for each task that ran since the previous call; later
+	// switches are left in the rings for the next interval.
+	void drain(u_int64_t end_ns, std::vector<task_slice_t> &slices) {
+		lost = 0;
+		++drains;
+		for (auto &ring : rings) {
+			struct perf_event_mmap_page *meta = (struct perf_event_mmap_page *) ring.base;
+			const char *data = ring.base + page_size;
+			const u_int64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+			u_int64_t tail = meta->data_tail;
+			while (tail < head) {
+				const struct perf_event_header *header = (const struct perf_event_header *) (data + tail % data_size);
+				const char *record = (const char *) header;
+				if (tail % data_size + header->size > data_size) {
+					const size_t first = data_size - tail % data_size;
+					memcpy(scratch.data(), record, first);
+					memcpy(scratch.data() + first, data, header->size - first);
+					record = scratch.data();
+				}
+
+				if (header->type == PERF_RECORD_SAMPLE) {
+					const sample_t *sample = (const sample_t *) record;
+					if (sample->time > end_ns)
+						break;
+					const char *raw = record + sizeof(sample_t);
+					const int prev = *(const int32_t *) (raw + format.prev_pid);
+					const int next = *(const int32_t *) (raw + format.next_pid);
+					// the sample is taken in the context of the previous task, giving its process
+					processes[prev] = process_t{(int) sample->pid, drains};
+					slice(slices, ring, prev, raw + format.prev_comm, sample->time);
+					ring.tid = next;
+					memcpy(ring.comm, raw + format.next_comm, sizeof(ring.comm));
+					ring.since_ns = std::max(ring.since_ns, (u_int64_t) sample->time);
+				} else if (header->type == PERF_RECORD_LOST) {
+					lost += ((const u_int64_t *) (header + 1))[1];
+				}
+				tail += header->size;
+			}
+			__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+
+			slice(slices, ring, ring.tid, ring.comm, end_ns);
+			ring.since_ns = std::max(ring.since_ns, end_ns);
+			const auto running = processes.find(ring.tid);
+			if (running != processes.end())
+				running->second.seen = drains;
+		}
+
+		// threads exit and their ids are reused, so entries not refreshed for a while go
+		if (drains % PROCESS_SWEEP_DRAINS == 0) {
+			for (auto it = processes.begin(); it != processes.end();) {
+				if (drains - it->second.seen >= PROCESS_SWEEP_DRAINS)
+					it = processes.erase(it);
+				else
+					++it;
+			}
+		}
+	}
+};
+
+// Apportions each core's counter deltas of an interval to the tasks that ran on it by their time on CPU, and ranks
+// the tasks by their port pressure: the utilization they account for on their busiest port.
+struct task_top_t {
+	struct task_t {
+		int pid;
+		char comm[16];
+		u_int64_t ns;
+		double pressure;
+	};
+
+	size_t num_events;
+	size_t limit;
+	std::vector<task_t> tasks;
+	std::vector<double> utils;  // task * num_events + event
+	std::vector<size_t> order;  // the top tasks by pressure
+	std::unordered_map<int, size_t> index;
+	std::vector<u_int64_t> busy_ns;  // of each core
+
+public:
+	task_top_t(size_t num_events, size_t limit, int num_cores)
+		: num_events(num_events), limit(limit), busy_ns(num_cores) {}
+
+	void update(const interval_t &interval, const std::vector<task_slice_t> &slices) {
+		tasks.clear();
+		utils.clear();
+		index.clear();
+		std::fill(busy_ns.begin(), busy_ns.end(), 0);
+		for (const auto &s : slices)
+			busy_ns[s.core] += s.ns;
+
+		const double scale = interval.tsc_delta ? 100.0 / interval.tsc_delta : 0.0;
+		for (const auto &s : slices) {
+			auto it = index.find(s.pid);
+			if (it == index.end()) {
+				task_t task;
+				task.pid = s.pid;
+				memcpy(task.comm, s.comm, sizeof(task.comm));
+				task.ns = 0;
+				task.pressure = 0;
+				it = index.insert(std::make_pair(s.pid, tasks.size())).first;
+				tasks.push_back(task);
+				utils.resize(utils.size() + num_events, 0.0);
+			}
+			task_t &task = tasks[it->second];
+			task.ns += s.ns;
+			const double share = s.ns / (double) busy_ns[s.core] * scale;
+			const u_int64_t *deltas = &interval.deltas[s.core * num_events];
+			double *util = &utils[it->second * num_events];
+			for (size_t e = 0; e < num_events; ++e)
+				util[e] += deltas[e] * share;
+		}
+
+		for (size_t t = 0; t < tasks.size(); ++t)
+			tasks[t].pressure = *std::max_element(&utils[t * num_events], &utils[t * num_events + NUM_PORTS]);
+		order.resize(tasks.size());
+		std::iota(order.begin(), order.end(), 0);
+		const size_t n = std::min(limit, order.size());
+		std::partial_sort(order.begin(), order.begin() + n, order.end(), [this](size_t a, size_t b) {
+			return tasks[a].pressure > tasks[b].pressure;
+		});
+		order.resize(n);
+	}
+
+	void format_text(std::string &line, u_int64_t lost) const {
+		char buf[64];
+		for (size_t t : order) {
+			snprintf(buf, sizeof(buf), "%7d %-16s %8.1fms [", tasks[t].pid, tasks[t].comm, tasks[t].ns / 1e6);
+			line += buf;
+			for (size_t e = 0; e < num_events; ++e) {
+				snprintf(buf, sizeof(buf), "%6.2f%%", utils[t * num_events + e]);
+				line += buf;
+			}
+			line += "]\n";
+		}
+		if (lost) {
+			snprintf(buf, sizeof(buf), "(%llu context switches lost)\n", (unsigned long long) lost);
+			line += buf;
+		}
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		json.begin_array();
+		for (size_t t : order) {
+			json.begin_object();
+			json.key("pid").value(tasks[t].pid);
+			json.key("comm").value(tasks[t].comm);
+			json.key("on_cpu_ns").value(tasks[t].ns);
+			json.key("util").begin_array();
+			for (size_t e = 0; e < num_events; ++e)
+				json.value(utils[t * num_events + e]);
+			json.end_array();
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// MEM_TRANS_RETIRED.LOAD_LATENCY samples loads slower than the threshold in MSR_PEBS_LD_LAT_THRESHOLD with PEBS. Sandy
+// Bridge only counts it on IA32_PMC3, which the kernel then owns, so the sampler's own events leave it free.
+static const u_int64_t LOAD_LATENCY_EVENT = 0x01cd;
+static const int LOAD_LATENCY_PMC = 3;
+static const u_int64_t LOAD_SAMPLE_PERIOD = 10007;
+// the per-CPU rings hold an interval of samples at this many loads over the threshold per cycle, in 64 to 1024 pages;
+// samples past that are reported as lost
+static const double LOAD_RING_LOADS_PER_CYCLE = 0.1;
+static const size_t LOAD_RING_PAGES = 64;
+static const size_t LOAD_RING_MAX_PAGES = 1024;
+// distinct instruction and cache line pairs aggregated per interval; samples of further pairs are only counted
+static const size_t LOAD_SITES = 4096;
+static const size_t LOAD_TOP_SITES = 5;
+// latency histogram buckets in cycles: < 8, < 16, ... < 1024, and the rest
+static const int LOAD_LATENCY_BUCKETS = 9;
+
+enum load_source_t {
+	SOURCE_L1,
+	SOURCE_L2,
+	SOURCE_LLC,
+	SOURCE_DRAM,
+	SOURCE_REMOTE,
+	SOURCE_OTHER,
+	NUM_SOURCES,
+};
+
+static const char *const SOURCE_NAMES[] = {"L1", "L2", "LLC", "DRAM", "remote", "other"};
+
+load_source_t load_source(u_int64_t data_src) {
+	perf_mem_data_src src;
+	src.val = data_src;
+	if (src.mem_lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2 | PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2))
+		return SOURCE_REMOTE;
+	if (src.mem_lvl & PERF_MEM_LVL_LOC_RAM)
+		return SOURCE_DRAM;
+	if (src.mem_lvl & PERF_MEM_LVL_L3)
+		return SOURCE_LLC;
+	if (src.mem_lvl & PERF_MEM_LVL_L2)
+		return SOURCE_L2;
+	if (src.mem_lvl & (PERF_MEM_LVL_L1 | PERF_MEM_LVL_LFB))
+		return SOURCE_L1;
+	return SOURCE_OTHER;
+}
+
+// Samples loads with PEBS on every CPU into per-CPU perf rings and aggregates each interval's samples into latency
+// histograms per data source and an open-addressing table of instruction and data cache line pairs.
+struct load_sampler_t {
+private:
+	struct site_t {
+		u_int64_t ip;
+		u_int64_t line;  // 0 for a free slot
+		u_int64_t samples;
+		u_int64_t cycles;
+		unsigned sources;  // bit per load_source_t
+	};
+
+	// sample_type PERF_SAMPLE_IP | PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC
+	struct sample_t {
+		struct perf_event_header header;
+		u_int64_t ip;
+		u_int64_t addr;
+		u_int64_t weight;  // latency in core cycles
+		u_int64_t data_src;
+	};
+
+	size_t page_size;
+	size_t data_size;
+	std::vector<int> fds;
+	std::vector<char *> bases;
+	std::vector<site_t> sites;
+	std::vector<size_t> used;  // slots taken this interval
+	std::vector<char> scratch;
+
+	void add(const sample_t &sample) {
+		const load_source_t source = load_source(sample.data_src);
+		++samples[source];
+		cycles[source] += sample.weight;
+		int bucket = 0;
+		while (bucket < LOAD_LATENCY_BUCKETS - 1 && sample.weight >= (8ull << bucket))
+			++bucket;
+		++histograms[source * LOAD_LATENCY_BUCKETS + bucket];
+
+		const u_int64_t line = (sample.addr & ~63ull) | 1;  // never 0
+		size_t slot = ((sample.ip ^ line * 0x9e3779b97f4a7c15ull) * 0x9e3779b97f4a7c15ull >> 32) & (LOAD_SITES - 1);
+		for (size_t probe = 0; probe < LOAD_SITES; ++probe, slot = (slot + 1) & (LOAD_SITES - 1)) {
+			site_t &site = sites[slot];
+			if (site.line == 0) {
+				if (used.size() == LOAD_SITES / 2)  // keep probes short
+					break;
+				site.ip = sample.ip;
+				site.line = line;
+				used.push_back(slot);
+			} else if (site.ip != sample.ip || site.line != line) {
+				continue;
+			}
+			++site.samples;
+			site.cycles += sample.weight;
+			site.sources |= 1u << source;
+			return;
+		}
+		++dropped;
+	}
+
+public:
+	u_int64_t samples[NUM_SOURCES];
+	u_int64_t cycles[NUM_SOURCES];
+	u_int64_t histograms[NUM_SOURCES * LOAD_LATENCY_BUCKETS];
+	std::vector<size_t> top;  // slots of the sites with the most cycles
+	u_int64_t dropped;        // samples of sites that didn't fit in the table
+	u_int64_t lost;
+	unsigned threshold;
+
+	load_sampler_t(const load_sampler_t &) = delete;
+	load_sampler_t &operator=(const load_sampler_t &) = delete;
+
+	// pages of the ring of each CPU for an interval, a power of two as perf requires
+	static size_t ring_pages(u_int64_t interval_ns, double tsc_hz) {
+		const double bytes = interval_ns / 1e9 * tsc_hz * LOAD_RING_LOADS_PER_CYCLE / LOAD_SAMPLE_PERIOD * sizeof(sample_t);
+		size_t pages = LOAD_RING_PAGES;
+		while (pages < LOAD_RING_MAX_PAGES && pages * sysconf(_SC_PAGESIZE) < bytes)
+			pages *= 2;
+		return pages;
+	}
+
+	load_sampler_t(const std::vector<cpu_t> &cpus, unsigned threshold, size_t pages)
+		: page_size(sysconf(_SC_PAGESIZE)), data_size(pages * page_size), sites(LOAD_SITES), scratch(4096), threshold(threshold) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_RAW;
+		attr.config = LOAD_LATENCY_EVENT;
+		attr.config1 = threshold;
+		attr.sample_period = LOAD_SAMPLE_PERIOD;
+		attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC;
+		attr.precise_ip = 2;
+		attr.exclude_guest = 1;
+
+		for (const auto &cpu : cpus) {
+			const int fd = syscall(__NR_perf_event_open, &attr, -1, cpu.id, -1, PERF_FLAG_FD_CLOEXEC);
+			if (fd < 0)
+				throw std::runtime_error("can't sample load latency on cpu " + std::to_string(cpu.id) + ": " + strerror(errno));
+			void *p = mmap(NULL, page_size + data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) {
+				close(fd);
+				throw std::runtime_error(std::string("can't map load latency ring: ") + strerror(errno));
+			}
+			fds.push_back(fd);
+			bases.push_back((char *) p);
+		}
+		clear();
+	}
+	~load_sampler_t() {
+		for (size_t i = 0; i < fds.size(); ++i) {
+			munmap(bases[i], page_size + data_size);
+			close(fds[i]);
+		}
+	}
+
+	void clear() {
+		std::fill(samples, samples + NUM_SOURCES, 0);
+		std::fill(cycles, cycles + NUM_SOURCES, 0);
+		std::fill(histograms, histograms + NUM_SOURCES * LOAD_LATENCY_BUCKETS, 0);
+		for (size_t slot : used)
+			memset(&sites[slot], 0, sizeof(site_t));
+		used.clear();
+		top.clear();
+		dropped = 0;
+		lost = 0;
+	}
+
+	// Aggregates the samples taken since the previous call.
+	void drain() {
+		clear();
+		for (char *base : bases) {
+			struct perf_event_mmap_page *meta = (struct perf_event_mmap_page *) base;
+			const char *data = base + page_size;
+			const u_int64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+			u_int64_t tail = meta->data_tail;
+			while (tail < head) {
+				const struct perf_event_header *header = (const struct perf_event_header *) (data + tail % data_size);
+				const char *record = (const char *) header;
+				if (tail % data_size + header->size > data_size) {
+					const size_t first = data_size - tail % data_size;
+					memcpy(scratch.data(), record, first);
+					memcpy(scratch.data() + first, data, header->size - first);
+					record = scratch.data();
+				}
+				if (header->type == PERF_RECORD_SAMPLE)
+					add(*(const sample_t *) record);
+				else if (header->type == PERF_RECORD_LOST)
+					lost += ((const u_int64_t *) (header + 1))[1];
+				tail += header->size;
+			}
+			__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+		}
+
+		top = used;
+		const size_t n = std::min(LOAD_TOP_SITES, top.size());
+		std::partial_sort(top.begin(), top.begin() + n, top.end(), [this](size_t a, size_t b) {
+			return sites[a].cycles > sites[b].cycles;
+		});
+		top.resize(n);
+	}
+
+	// the sources of a site, most distant first
+	std::string site_sources(size_t slot) const {
+		std::string names;
+		for (int source = NUM_SOURCES - 1; source >= 0; --source) {
+			if (sites[slot].sources & (1u << source)) {
+				names += names.empty() ? "" : "+";
+				names += SOURCE_NAMES[source];
+			}
+		}
+		return names;
+	}
+
+	void format_text(std::string &line) const {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "loads >= %u cycles (samples, mean cycles; histogram <8 <16 ... <1024 >=1024)\n", threshold);
+		line += buf;
+		for (int source = 0; source < NUM_SOURCES; ++source) {
+			if (!samples[source])
+				continue;
+			snprintf(buf, sizeof(buf), "  %-6s %8llu %7.1f [", SOURCE_NAMES[source], (unsigned long long) samples[source],
+				cycles[source] / (double) samples[source]);
+			line += buf;
+			for (int b = 0; b < LOAD_LATENCY_BUCKETS; ++b) {
+				snprintf(buf, sizeof(buf), "%s%llu", b ? " " : "", (unsigned long long) histograms[source * LOAD_LATENCY_BUCKETS + b]);
+				line += buf;
+			}
+			line += "]\n";
+		}
+		for (size_t slot : top) {
+			const site_t &site = sites[slot];
+			snprintf(buf, sizeof(buf), "  ip 0x%llx line 0x%llx: %llu samples, mean %.1f cycles, ", (unsigned long long) site.ip,
+				(unsigned long long) (site.line & ~63ull), (unsigned long long) site.samples, site.cycles / (double) site.samples);
+			line += buf;
+			line += site_sources(slot);
+			line += '\n';
+		}
+		if (dropped || lost) {
+			snprintf(buf, sizeof(buf), "  (%llu samples past the site table, %llu lost)\n", (unsigned long long) dropped, (unsigned long long) lost);
+			line += buf;
+		}
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		char buf[32];
+		json.begin_object();
+		json.key("threshold").value((u_int64_t) threshold);
+		json.key("sources").begin_object();
+		for (int source = 0; source < NUM_SOURCES; ++source) {
+			json.key(SOURCE_NAMES[source]).begin_object();
+			json.key("samples").value(samples[source]);
+			json.key("cycles").value(cycles[source]);
+			json.key("histogram").begin_array();
+			for (int b = 0; b < LOAD_LATENCY_BUCKETS; ++b)
+				json.value(histograms[source * LOAD_LATENCY_BUCKETS + b]);
+			json.end_array();
+			json.end_object();
+		}
+		json.end_object();
+		json.key("sites").begin_array();
+		for (size_t slot : top) {
+			const site_t &site = sites[slot];
+			json.begin_object();
+			snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long) site.ip);
+			json.key("ip").value(buf);
+			snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long) (site.line & ~63ull));
+			json.key("line").value(buf);
+			json.key("samples").value(site.samples);
+			json.key("cycles").value(site.cycles);
+			json.key("sources").value(site_sources(slot).c_str());
+			json.end_object();
+		}
+		json.end_array();
+		json.key("dropped").value(dropped);
+		json.key("lost").value(lost);
+		json.end_object();
+	}
+};
+
+// Branch stacks are sampled every LBR_PERIOD user instructions, which the kernel counts on fixed counter 0.
+static const u_int64_t LBR_PERIOD = 200003;
+static const size_t LBR_RING_PAGES = 128;
+// distinct taken branches counted per interval; branches past half of them are dropped
+static const size_t BRANCH_PAIRS = 8192;
+// a backward branch this close to its target closes a loop
+static const u_int64_t MAX_LOOP_BODY = 4096;
+// loop bodies read and disassembled after the output of an interval, hottest first
+static const size_t LOOP_BODIES_PER_INTERVAL = 1;
+// a loop body is forgotten after this many intervals out of the ranking
+static const u_int64_t LOOP_BODY_INTERVALS = 64;
+// intervals before a loop body that couldn't be read or disassembled is tried again
+static const u_int64_t LOOP_BODY_RETRY = 16;
+
+// The instructions and predicted ports of a loop body, read from the process' memory and disassembled once for the
+// process that started at start.
+struct loop_body_t {
+	bool known;
+	u_int64_t ranked;  // interval the loop was last ranked in
+	u_int64_t retry;   // interval from which an unknown body is read
+	u_int64_t start;
+	port_prediction_t prediction;
+};
+
+// Start time of a process in clock ticks since boot, which tells a reused pid apart; 0 once it has exited.
+u_int64_t process_start_time(int pid) {
+	std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+	std::string stat;
+	std::getline(in, stat);
+	// the command in parentheses may hold spaces; starttime is the 20th field after it
+	const size_t paren = stat.rfind(')');
+	if (paren == std::string::npos)
+		return 0;
+	std::istringstream fields(stat.substr(paren + 1));
+	std::string field;
+	for (int i = 0; i < 20 && fields >> field; ++i) {
+	}
+	return fields ? std::strtoull(field.c_str(), NULL, 10) : 0;
+}
+
+// Reconstructs hot loops from sampled last branch records: each taken backward jump, conditional or not, closes a loop
+// from its target to itself, counted in an open-addressing table of branch pairs. Calls and returns are told apart by
+// the branch type the kernel saves, or left out by the LBR filter on kernels that can't save it. Sampled instruction pointers inside a loop estimate its
+// share of the instructions, and so its iterations per second given the instructions in its body; the cycles between
+// two consecutive records of the same back edge, where the LBR provides them, measure its cycles per iteration. The
+// port predictor gives the uops each iteration puts on every port.
+struct loop_sampler_t {
+private:
+	struct pair_t {
+		u_int64_t from;  // 0 for a free slot
+		u_int64_t to;
+		int pid;
+		u_int64_t records;
+		u_int64_t ip_samples;
+		u_int64_t cycles;
+		u_int64_t timed;  // iterations with cycles
+	};
+
+	// sample_type PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_BRANCH_STACK
+	struct sample_t {
+		struct perf_event_header header;
+		u_int64_t ip;
+		u_int32_t pid;
+		u_int32_t tid;
+		u_int64_t nr;  // of the perf_branch_entry that follow, newest first
+	};
+
+	size_t page_size;
+	size_t data_size;
+	std::vector<int> fds;
+	std::vector<char *> bases;
+	std::vector<pair_t> pairs;
+	std::vector<size_t> used;
+	std::vector<char> scratch;
+	std::map<std::tuple<int, u_int64_t, u_int64_t>, loop_body_t> bodies;
+	u_int64_t intervals;
+	bool typed;  // branch types are saved; otherwise the LBR records conditional branches only
+
+	static bool is_back_edge(u_int64_t from, u_int64_t to) {
+		return to <= from && from - to < MAX_LOOP_BODY;
+	}
+
+	bool is_jump(const perf_branch_entry &e) const {
+		return !typed || e.type == PERF_BR_COND || e.type == PERF_BR_UNCOND;
+	}
+
+	pair_t *find(int pid, u_int64_t from, u_int64_t to) {
+		size_t slot = (((from * 0x9e3779b97f4a7c15ull) ^ to ^ pid) * 0x9e3779b97f4a7c15ull >> 32) & (BRANCH_PAIRS - 1);
+		for (size_t probe = 0; probe < BRANCH_PAIRS; ++probe, slot = (slot + 1) & (BRANCH_PAIRS - 1)) {
+			pair_t &pair = pairs[slot];
+			if (pair.from == 0) {
+				if (used.size() == BRANCH_PAIRS / 2)  // keep probes short
+					return NULL;
+				pair.from = from;
+				pair.to = to;
+				pair.pid = pid;
+				used.push_back(slot);
+				return &pair;
+			}
+			if (pair.from == from && pair.to == to && pair.pid == pid)
+				return &pair;
+		}
+		return NULL;
+	}
+
+	void add(const sample_t &sample) {
+		++samples;
+		const perf_branch_entry *entries = (const perf_branch_entry *) (&sample + 1);
+		const perf_branch_entry *innermost = NULL;
+		for (u_int64_t i = 0; i < sample.nr; ++i) {
+			const perf_branch_entry &e = entries[i];
+			if (!is_jump(e))
+				continue;
+			pair_t *pair = find(sample.pid, e.from, e.to);
+			if (!pair) {
+				++dropped;
+				continue;
+			}
+			++pair->records;
+			if (!is_back_edge(e.from, e.to))
+				continue;
+			// the cycles of a record are those since the older one, an iteration if that closed the same loop
+			if (e.cycles && i + 1 < sample.nr && entries[i + 1].from == e.from && entries[i + 1].to == e.to) {
+				pair->cycles += e.cycles;
+				++pair->timed;
+			}
+			if (e.to <= sample.ip && sample.ip <= e.from && (!innermost || e.from - e.to < innermost->from - innermost->to))
+				innermost = &e;
+		}
+		if (innermost) {
+			pair_t *pair = find(sample.pid, innermost->from, innermost->to);
+			if (pair)
+				++pair->ip_samples;
+		}
+	}
+
+	// Reads the body of a loop up to and including its back edge, and predicts it.
+	void read_body(int pid, u_int64_t from, u_int64_t to, loop_body_t &b) {
+		b.known = false;
+		b.retry = intervals + LOOP_BODY_RETRY;
+		b.start = process_start_time(pid);
+		// the longest instruction past the branch's address
+		std::string code(from - to + 15, '\0');
+		const int fd = open(("/proc/" + std::to_string(pid) + "/mem").c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		const ssize_t n = pread(fd, &code[0], code.size(), to);
+		close(fd);
+		if (n != (ssize_t) code.size())
+			return;
+		try {
+			// keep the instructions at offsets up to the branch
+			std::istringstream disassembly(disassemble(code));
+			std::stringstream body;
+			std::string line;
+			while (std::getline(disassembly, line)) {
+				const size_t colon = line.find(':');
+				if (colon != std::string::npos && line.find('\t') == colon + 1 &&
+				    std::stoull(trim(line.substr(0, colon)), NULL, 16) > from - to)
+					break;
+				body << line << '\n';
+			}
+			b.prediction = predict_ports(body);
+			b.known = b.prediction.instructions > 0;
+		} catch (const std::exception &) {
+		}
+	}
+
+public:
+	struct loop_t {
+		int pid;
+		u_int64_t from;
+		u_int64_t to;
+		u_int64_t records;
+		double iterations;           // per second
+		double cycles;               // measured per iteration, 0 without LBR cycles
+		const loop_body_t *body;
+	};
+
+	size_t limit;
+	double tsc_hz;
+	u_int64_t samples;
+	u_int64_t dropped;
+	u_int64_t lost;
+	std::vector<loop_t> loops;  // the hottest, by records
+
+	loop_sampler_t(const loop_sampler_t &) = delete;
+	loop_sampler_t &operator=(const loop_sampler_t &) = delete;
+	loop_sampler_t(const std::vector<cpu_t> &cpus, size_t limit, double tsc_hz, size_t pages)
+		: page_size(sysconf(_SC_PAGESIZE)), data_size(pages * page_size), pairs(BRANCH_PAIRS), scratch(65536), intervals(0), typed(true),
+		  limit(limit), tsc_hz(tsc_hz), samples(0), dropped(0), lost(0) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		attr.sample_period = LBR_PERIOD;
+		attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_BRANCH_STACK;
+		attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_ANY | PERF_SAMPLE_BRANCH_TYPE_SAVE;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		for (const auto &cpu : cpus) {
+			int fd = syscall(__NR_perf_event_open, &attr, -1, cpu.id, -1, PERF_FLAG_FD_CLOEXEC);
+			if (fd < 0 && errno == EINVAL && fds.empty() && typed) {
+				// before Linux 4.14: have the LBR keep the conditional branches, which close most loops
+				typed = false;
+				attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_COND;
+				fd = syscall(__NR_perf_event_open, &attr, -1, cpu.id, -1, PERF_FLAG_FD_CLOEXEC);
+			}
+			if (fd < 0)
+				throw std::runtime_error("can't sample branch stacks on cpu " + std::to_string(cpu.id) + ": " + strerror(errno));
+			void *p = mmap(NULL, page_size + data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) {
+				close(fd);
+				throw std::runtime_error(std::string("can't map branch stack ring: ") + strerror(errno));
+			}
+			fds.push_back(fd);
+			bases.push_back((char *) p);
+		}
+	}
+	~loop_sampler_t() {
+		for (size_t i = 0; i < fds.size(); ++i) {
+			munmap(bases[i], page_size + data_size);
+			close(fds[i]);
+		}
+	}
+
+	// Aggregates the branch stacks sampled during an interval of the given length and ranks its loops.
+	void drain(u_int64_t tsc_delta) {
+		for (size_t slot : used)
+			memset(&pairs[slot], 0, sizeof(pair_t));
+		used.clear();
+		samples = dropped = lost = 0;
+		for (char *base : bases) {
+			struct perf_event_mmap_page *meta = (struct perf_event_mmap_page *) base;
+			const char *data = base + page_size;
+			const u_int64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+			u_int64_t tail = meta->data_tail;
+			while (tail < head) {
+				const struct perf_event_header *header = (const struct perf_event_header *) (data + tail % data_size);
+				const char *record = (const char *) header;
+				if (tail % data_size + header->size > data_size) {
+					const size_t first = data_size - tail % data_size;
+					memcpy(scratch.data(), record, first);
+					memcpy(scratch.data() + first, data, header->size - first);
+					record = scratch.data();
+				}
+				if (header->type == PERF_RECORD_SAMPLE)
+					add(*(const sample_t *) record);
+				else if (header->type == PERF_RECORD_LOST)
+					lost += ((const u_int64_t *) (header + 1))[1];
+				tail += header->size;
+			}
+			__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+		}
+		rank(tsc_delta);
+	}
+
+	// Picks the loops with the most records and estimates their iterations and cycles.
+	void rank(u_int64_t tsc_delta) {
+		std::vector<size_t> edges;
+		for (size_t slot : used)
+			if (is_back_edge(pairs[slot].from, pairs[slot].to))
+				edges.push_back(slot);
+		const size_t n = std::min(limit, edges.size());
+		std::partial_sort(edges.begin(), edges.begin() + n, edges.end(), [this](size_t a, size_t b) {
+			return pairs[a].records > pairs[b].records;
+		});
+		loops.clear();
+		const double seconds = tsc_delta / tsc_hz;
+		for (size_t i = 0; i < n; ++i) {
+			const pair_t &pair = pairs[edges[i]];
+			loop_t loop;
+			loop.pid = pair.pid;
+			loop.from = pair.from;
+			loop.to = pair.to;
+			loop.records = pair.records;
+			// the body is read after the output, and is unknown until then
+			loop_body_t &body = bodies[std::make_tuple(pair.pid, pair.from, pair.to)];
+			body.ranked = intervals;
+			loop.body = &body;
+			// every sample stands for LBR_PERIOD instructions
+			loop.iterations = loop.body->known && seconds > 0 ?
+				pair.ip_samples * (double) LBR_PERIOD / loop.body->prediction.instructions / seconds : 0.0;
+			loop.cycles = pair.timed ? pair.cycles / (double) pair.timed : 0.0;
+			loops.push_back(loop);
+		}
+	}
+
+	// Keeps the loop bodies once the interval has been output, so that no disassembly runs between reading the counters
+	// and writing them out: forgets the bodies of loops out of the ranking, reads again those of ranked loops whose
+	// process exited or whose pid was reused, and reads at most LOOP_BODIES_PER_INTERVAL of the bodies due.
+	void predict() {
+		for (auto it = bodies.begin(); it != bodies.end();) {
+			if (intervals - it->second.ranked >= LOOP_BODY_INTERVALS)
+				it = bodies.erase(it);
+			else
+				++it;
+		}
+		size_t budget = LOOP_BODIES_PER_INTERVAL;
+		for (const auto &loop : loops) {
+			loop_body_t &b = bodies[std::make_tuple(loop.pid, loop.from, loop.to)];
+			if (b.known && process_start_time(loop.pid) != b.start) {
+				b.known = false;
+				b.retry = intervals;
+			}
+			if (!b.known && b.retry <= intervals && budget > 0) {
+				read_body(loop.pid, loop.from, loop.to, b);
+				--budget;
+			}
+		}
+		++intervals;
+	}
+
+	// instructions per cycle of a loop, measured or else predicted; 0 when neither is known
+	static double ipc(const loop_t &loop, bool &measured) {
+		measured = loop.cycles > 0;
+		if (!loop.body->known)
+			return 0.0;
+		const double cycles = measured ? loop.cycles : loop.body->prediction.cycles;
+		return cycles > 0 ? loop.body->prediction.instructions / cycles : 0.0;
+	}
+
+	// utilization of a port of one core at TSC frequency
+	double port_util(const loop_t &loop, size_t port) const {
+		return loop.body->known ? loop.iterations * loop.body->prediction.loads[port] / tsc_hz : 0.0;
+	}
+
+	void format_text(std::string &line) const {
+		char buf[128];
+		line += "hot loops (pid, back edge, records, iterations/s, IPC measured or ~predicted, port utilization)\n";
+		for (const auto &loop : loops) {
+			bool measured;
+			const double loop_ipc = ipc(loop, measured);
+			snprintf(buf, sizeof(buf), "%7d 0x%llx->0x%llx %6llu %9.3g %s%5.2f [", loop.pid, (unsigned long long) loop.from,
+				(unsigned long long) loop.to, (unsigned long long) loop.records, loop.iterations, measured ? " " : "~", loop_ipc);
+			line += buf;
+			if (!loop.body->known) {
+				// not read yet, or unreadable until a retry
+				line += "body unknown]\n";
+				continue;
+			}
+			for (size_t port = 0; port < NUM_PORTS; ++port) {
+				snprintf(buf, sizeof(buf), "%6.2f%%", port_util(loop, port) * 100);
+				line += buf;
+			}
+			line += "]\n";
+		}
+		if (dropped || lost) {
+			snprintf(buf, sizeof(buf), "(%llu branch records past the pair table, %llu samples lost)\n",
+				(unsigned long long) dropped, (unsigned long long) lost);
+			line += buf;
+		}
+	}
+
+	void format_ndjson(json_writer_t &json) const {
+		char buf[32];
+		json.begin_array();
+		for (const auto &loop : loops) {
+			json.begin_object();
+			json.key("pid").value(loop.pid);
+			snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long) loop.from);
+			json.key("from").value(buf);
+			snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long) loop.to);
+			json.key("to").value(buf);
+			json.key("records").value(loop.records);
+			json.key("iterations").value(loop.iterations, 0);
+			bool measured;
+			const double loop_ipc = ipc(loop, measured);
+			if (loop_ipc > 0)
+				json.key(measured ? "ipc" : "predicted_ipc").value(loop_ipc, 3);
+			if (loop.body->known) {
+				json.key("instructions").value((u_int64_t) loop.body->prediction.instructions);
+				json.key("port_util").begin_array();
+				for (size_t port = 0; port < NUM_PORTS; ++port)
+					json.value(port_util(loop, port), 4);
+				json.end_array();
+			}
+			json.end_object();
+		}
+		json.end_array();
+	}
+};
+
+// A fingerprint file is a fingerprint_header_t followed by num_records fingerprint_record_t, one per service, holding
+// exponentially weighted means and variances of its signature over the runs that saw it.
+static const char FINGERPRINT_MAGIC[8] = {'C', 'P', 'S', 'F', 'P', 'R', '\0', '\0'};
+static const u_int32_t FINGERPRINT_VERSION = 1;
+// weight of a run in the stored means and variances
+static const double FINGERPRINT_ALPHA = 0.2;
+// deviations below this don't count as drift, however steady the stored runs were
+static const double FINGERPRINT_MIN_STDDEV = 0.02;
+// updates after which the service of a process not seen in --top is looked up again, as its PID may be reused
+static const u_int64_t SERVICE_SWEEP_UPDATES = 64;
+
+// the share of uops of each port, instructions per unhalted cycle and the share of issue slots the front end left empty
+enum fingerprint_feature_t {
+	FEATURE_IPC = NUM_PORTS,
+	FEATURE_FRONTEND,
+	NUM_FEATURES,
+};
+
+static const char *const FEATURE_NAMES[] = {"p0", "p1", "p2", "p3", "p4", "p5", "ipc", "frontend"};
+
+struct fingerprint_header_t {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t num_records;
+} __attribute__((packed));
+
+struct fingerprint_record_t {
+	char key[112];        // cgroup, or command of tasks outside of one
+	u_int64_t runs;
+	u_int32_t features;   // bit per feature measured
+	u_int32_t reserved;
+	double mean[NUM_FEATURES];
+	double var[NUM_FEATURES];
+} __attribute__((packed));
+
+// Builds the signature of each service, by cgroup or else command, from the counts --top apportions to its tasks,
+// weighted by their time on CPU, and compares it with the one stored when the run ends.
+struct fingerprint_store_t {
+	struct service_t {
+		double ns;
+		double sums[NUM_FEATURES];  // weighted by ns
+	};
+
+	std::string path;
+	int port_events[NUM_PORTS];
+	int inst_event;
+	int unhalted_event;
+	int not_delivered_event;  // -1 without --frontend
+	u_int32_t features;
+	std::vector<fingerprint_record_t> records;
+	std::map<std::string, service_t> services;
+	struct process_key_t {
+		std::string comm;
+		std::string key;
+		u_int64_t seen;  // update
+	};
+	std::unordered_map<int, process_key_t> keys;  // of each process, while it shows up
+	u_int64_t updates;
+
+	std::string service_key(int pid, const char *comm) {
+		auto it = keys.find(pid);
+		// another command under the same PID is a new process
+		if (it != keys.end() && it->second.comm == comm) {
+			it->second.seen = updates;
+			return it->second.key;
+		}
+		// cgroup v2 has a single "0::PATH" line; system-wide tasks sit in the root
+		std::string key = comm;
+		std::ifstream cgroup("/proc/" + std::to_string(pid) + "/cgroup");
+		std::string line;
+		while (std::getline(cgroup, line)) {
+			if (line.compare(0, 3, "0::") == 0 && line.size() > 4) {
+				key = line.substr(3);
+				break;
+			}
+		}
+		key = key.substr(0, sizeof(fingerprint_record_t().key) - 1);
+		keys[pid] = process_key_t{comm, key, updates};
+		return key;
+	}
+
+public:
+	template<class Event>
+	fingerprint_store_t(const std::string &path, const std::vector<Event> &events) : path(path), updates(0) {
+		for (size_t port = 0; port < NUM_PORTS; ++port)
+			port_events[port] = find_event(events, UOPS_DISPATCHED_PORT[port]);
+		inst_event = find_event(events, FIXED_EVENTS[FIXED_INST_RETIRED]);
+		unhalted_event = find_event(events, FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED]);
+		not_delivered_event = find_event(events, FRONTEND_EVENTS[FRONTEND_NOT_DELIVERED]);
+		if (inst_event < 0 || unhalted_event < 0)
+			throw std::runtime_error(std::string("fingerprints need ") + FIXED_EVENTS[FIXED_INST_RETIRED].name + " and " +
+				FIXED_EVENTS[FIXED_CPU_CLK_UNHALTED].name);
+		// the port shares and IPC always, the front end with --frontend
+		features = ((1u << (FEATURE_IPC + 1)) - 1) | (not_delivered_event >= 0 ? 1u << FEATURE_FRONTEND : 0);
+
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno != ENOENT)
+				throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+			return;
+		}
+		fingerprint_header_t header;
+		struct stat st;
+		const bool valid = read(fd, &header, sizeof(header)) == sizeof(header) &&
+			memcmp(header.magic, FINGERPRINT_MAGIC, sizeof(header.magic)) == 0 && header.version == FINGERPRINT_VERSION;
+		// the record count must match the file's size before anything is allocated for it
+		const bool complete = valid && fstat(fd, &st) == 0 &&
+			(u_int64_t) st.st_size == sizeof(header) + (u_int64_t) header.num_records * sizeof(fingerprint_record_t);
+		if (complete) {
+			records.resize(header.num_records);
+			const ssize_t size = records.size() * sizeof(fingerprint_record_t);
+			errno = 0;
+			if (read(fd, records.data(), size) != size) {
+				close(fd);
+				throw std::runtime_error("can't read " + path + ": " + (errno ? strerror(errno) : "short read"));
+			}
+		}
+		close(fd);
+		if (!valid)
+			throw std::runtime_error(path + " is not a fingerprint file");
+		if (!complete)
+			throw std::runtime_error(path + " is truncated or corrupt");
+	}
+
+	void update(const task_top_t &top) {
+		++updates;
+		const size_t num_events = top.num_events;
+		for (size_t t = 0; t < top.tasks.size(); ++t) {
+			const auto &task = top.tasks[t];
+			const double *util = &top.utils[t * num_events];
+			if (util[unhalted_event] <= 0)
+				continue;
+			service_t &service = services[service_key(task.pid, task.comm)];
+			double uops = 0;
+			for (size_t port = 0; port < NUM_PORTS; ++port)
+				uops += util[port_events[port]];
+			for (size_t port = 0; port < NUM_PORTS; ++port)
+				service.sums[port] += task.ns * (uops > 0 ? util[port_events[port]] / uops : 0.0);
+			service.sums[FEATURE_IPC] += task.ns * util[inst_event] / util[unhalted_event];
+			if (not_delivered_event >= 0)
+				service.sums[FEATURE_FRONTEND] += task.ns * util[not_delivered_event] / (ISSUE_WIDTH * util[unhalted_event]);
+			service.ns += task.ns;
+		}
+		if (updates % SERVICE_SWEEP_UPDATES == 0) {
+			for (auto it = keys.begin(); it != keys.end();) {
+				if (updates - it->second.seen >= SERVICE_SWEEP_UPDATES)
+					it = keys.erase(it);
+				else
+					++it;
+			}
+		}
+	}
+
+	fingerprint_record_t *find(const std::string &key) {
+		for (auto &record : records)
+			if (key == record.key)
+				return &record;
+		return NULL;
+	}
+
+	// RMS over the features both measured of the deviations of a run from the stored means, in stored standard deviations
+	static double distance(const fingerprint_record_t &record, const double *run, u_int32_t features) {
+		double sum = 0;
+		int n = 0;
+		for (int f = 0; f < NUM_FEATURES; ++f) {
+			if (!(features & record.features & (1u << f)))
+				continue;
+			const double stddev = std::max(sqrt(record.var[f]), FINGERPRINT_MIN_STDDEV * (f == FEATURE_IPC ? record.mean[f] : 1.0));
+			const double z = (run[f] - record.mean[f]) / stddev;
+			sum += z * z;
+			++n;
+		}
+		return n ? sqrt(sum / n) : 0.0;
+	}
+
+	// Reports the distance of each service from its stored fingerprint and folds this run into the store.
+	void finish(FILE *text, json_writer_t *json) {
+		if (text)
+			fprintf(text, "\nfingerprints (%s): distance in standard deviations, then this run's signature (%s)\n", path.c_str(),
+				"p0..p5 share of uops, IPC, frontend-bound slots");
+		if (json) {
+			json->begin_object();
+			json->key("type").value("fingerprints");
+			json->key("services").begin_array();
+		}
+		for (const auto &entry : services) {
+			const service_t &service = entry.second;
+			if (service.ns <= 0)
+				continue;
+			double run[NUM_FEATURES];
+			for (int f = 0; f < NUM_FEATURES; ++f)
+				run[f] = service.sums[f] / service.ns;
+			fingerprint_record_t *record = find(entry.first);
+			const bool known = record != NULL;
+			const double d = known ? distance(*record, run, features) : 0.0;
+			if (text) {
+				if (known)
+					fprintf(text, "%8.2f ", d);
+				else
+					fprintf(text, "%8s ", "new");
+				for (int f = 0; f < NUM_FEATURES; ++f)
+					if (features & (1u << f))
+						fprintf(text, "%s=%.3f ", FEATURE_NAMES[f], run[f]);
+				fprintf(text, "%s\n", entry.first.c_str());
+			}
+			if (json) {
+				json->begin_object();
+				json->key("service").value(entry.first.c_str());
+				if (known)
+					json->key("distance").value(d, 4);
+				json->key("on_cpu_ns").value((u_int64_t) service.ns);
+				json->key("signature").begin_object();
+				for (int f = 0; f < NUM_FEATURES; ++f)
+					if (features & (1u << f))
+						json->key(FEATURE_NAMES[f]).value(run[f], 4);
+				json->end_object();
+				json->end_object();
+			}
+
+			if (!record) {
+				records.push_back(fingerprint_record_t());
+				record = &records.back();
+				memset(record, 0, sizeof(*record));
+				strncpy(record->key, entry.first.c_str(), sizeof(record->key) - 1);
+			}
+			for (int f = 0; f < NUM_FEATURES; ++f) {
+				if (!(features & (1u << f)))
+					continue;
+				if (!(record->features & (1u << f))) {
+					record->mean[f] = run[f];
+					record->var[f] = 0;
+					continue;
+				}
+				// exponentially weighted mean and variance
+				const double diff = run[f] - record->mean[f];
+				const double incr = FINGERPRINT_ALPHA * diff;
+				record->mean[f] += incr;
+				record->var[f] = (1 - FINGERPRINT_ALPHA) * (record->var[f] + diff * incr);
+			}
+			record->features |= features;
+			++record->runs;
+		}
+		if (json) {
+			json->end_array();
+			json->end_object().newline();
+		}
+		save();
+	}
+
+	// replaces the file at once, so that an interrupted save leaves the previous fingerprints
+	void save() const {
+		const std::string tmp = path + ".tmp";
+		const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("can't create " + tmp + ": " + strerror(errno));
+		fingerprint_header_t header;
+		memcpy(header.magic, FINGERPRINT_MAGIC, sizeof(header.magic));
+		header.version = FINGERPRINT_VERSION;
+		header.num_records = records.size();
+		write_fully(fd, (const char *) &header, sizeof(header));
+		write_fully(fd, (const char *) records.data(), records.size() * sizeof(fingerprint_record_t));
+		const bool synced = fsync(fd) == 0;
+		close(fd);
+		if (!synced || rename(tmp.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("can't save " + path + ": " + strerror(errno));
+	}
+};
+
+void format_ndjson(json_writer_t &json, const interval_t &interval, const topology_t &topology, const std::vector<rollup_t> &rollups,
+                   const port_classifier_t *classifier, const frontend_t *frontend, const flops_t *flops,
+                   const memory_traffic_t *memory, const roofline_t *roofline, const power_t *power,
+                   const assists_t *assists, const load_sampler_t *loads, const loop_sampler_t *loops,
+                   const task_top_t *top) {
+	json.begin_object();
+	json.key("type").value("interval");
+	json.key("time_ns").value(interval.time_ns);
+	json.key("tsc").value(interval.tsc);
+	json.key("tsc_delta").value(interval.tsc_delta);
+	json.key("late_ns").value(interval.lateness_ns);
+	json.key("sampler_cycles").begin_object();
+	for (int phase = 0; phase < NUM_PHASES; ++phase)
+		json.key(PHASE_NAMES[phase]).value(interval.cycles[phase]);
+	json.end_object();
+	if (std::find(interval.estimated.begin(), interval.estimated.end(), true) != interval.estimated.end()) {
+		json.key("estimated").begin_array();
+		for (size_t i = 0; i < interval.num_events; ++i)
+			if (interval.estimated[i])
+				json.value((u_int64_t) i);
+		json.end_array();
+	}
+	json.key("cores").begin_array();
+	for (core_id_t core_id = 0; core_id < topology.num_cores; ++core_id) {
+		json.begin_object();
+		json.key("core").value(core_id);
+		json.key("core_id").value(topology.core_ids[core_id]);
+		json.key("package").value(topology.packages[core_id]);
+		json.key("node").value(topology.nodes[core_id]);
+		json.key("cpus").begin_array();
+		for (cpu_id_t cpu : topology.cpus[core_id])
+			json.value(cpu);
+		json.end_array();
+		json.key("deltas").begin_array();
+		for (size_t i = 0; i < interval.num_events; ++i)
+			json.value(interval.deltas[core_id * interval.num_events + i]);
+		json.end_array();
+		json.key("util").begin_array();
+		for (size_t i = 0; i < interval.num_events; ++i)
+			json.value(interval.utils[core_id * interval.num_events + i]);
+		json.end_array();
+		json.end_object();
+	}
+	json.end_array();
+	for (const auto &rollup : rollups) {
+		json.key(rollup.groups_key);
+		rollup.format_ndjson(json);
+		json.key(rollup.imbalance_key).value(rollup.imbalance);
+	}
+	if (classifier) {
+		json.key("classification");
+		classifier->format_ndjson(json);
+	}
+	if (frontend) {
+		json.key("frontend");
+		frontend->format_ndjson(json);
+	}
+	if (flops) {
+		json.key("flops");
+		flops->format_ndjson(json);
+	}
+	if (memory) {
+		json.key("memory");
+		memory->format_ndjson(json);
+	}
+	if (roofline) {
+		json.key("roofline");
+		roofline->format_ndjson(json);
+	}
+	if (power) {
+		json.key("power");
+		power->format_ndjson(json);
+	}
+	if (assists) {
+		json.key("assists");
+		assists->format_ndjson(json);
+	}
+	if (loads) {
+		json.key("loads");
+		loads->format_ndjson(json);
+	}
+	if (loops) {
+		json.key("loops");
+		loops->format_ndjson(json);
+	}
+	if (top) {
+		json.key("tasks");
+		top->format_ndjson(json);
+	}
+	json.end_object().newline();
+}
+
+// A capture is a capture_header_t, num_cores int32 package IDs and num_events capture_event_t, padded to header_size,
+// followed by fixed-size records of u_int64_t: the wall clock in ns, the TSC, and the count accumulated since the
+// start of the recording of each counter, indexed by core_id * num_events + event. Accumulated counts don't wrap, so
+// any two records give the deltas between them. The counts are followed by a bit mask of the events whose deltas in the
+// interval ending at the record were estimated rather than counted, because they were multiplexed out; a capture with
+// CAPTURE_ESTIMATES clear in its flags has none.
+//
+// A ring capture (version 2) has a fixed number of record slots, preallocated, and a capture_ring_t after the events
+// counting the records ever committed; record n is in slot n % capacity, and the last capacity of them are kept. Its
+// records end in a sequence word, n + 1, with CAPTURE_RESTART set on the first record after the sampler resumed the
+// ring: the TSC may have restarted with the host, and the interval before that record spans the downtime.
+static const char CAPTURE_MAGIC[8] = {'C', 'P', 'S', 'C', 'A', 'P', '\0', '\0'};
+static const u_int32_t CAPTURE_VERSION = 1;
+static const u_int32_t CAPTURE_RING_VERSION = 2;
+static const size_t CAPTURE_RECORD_HEADER = 2;  // time_ns and tsc precede the counters of a record
+static const u_int64_t CAPTURE_RESTART = 1ull << 63;
+static const u_int32_t CAPTURE_ESTIMATES = 1;  // in the header flags: some events are multiplexed
+
+struct capture_header_t {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t header_size;
+	u_int32_t record_size;
+	u_int32_t num_cores;
+	u_int32_t num_events;
+	u_int32_t cpu_family;
+	u_int32_t cpu_model;
+	u_int32_t flags;
+	u_int64_t interval_ns;
+	u_int64_t tsc_hz;
+	char hostname[64];
+} __attribute__((packed));
+
+// words of the mask of estimated events in a record
+size_t capture_mask_words(size_t num_events) {
+	return (num_events + 63) / 64;
+}
+
+// Sets the mask of estimated events of a record, which starts at mask.
+void capture_set_mask(u_int64_t *mask, const std::vector<bool> &estimated) {
+	std::fill(mask, mask + capture_mask_words(estimated.size()), 0);
+	for (size_t e = 0; e < estimated.size(); ++e)
+		if (estimated[e])
+			mask[e / 64] |= 1ull << (e % 64);
+}
+
+struct capture_event_t {
+	u_int8_t event;
+	u_int8_t umask;
+	char name[62];
+} __attribute__((packed));
+
+struct capture_ring_t {
+	u_int64_t capacity;
+	u_int64_t committed;  // stored after the record it commits
+};
+
+// offset of the capture_ring_t of a ring capture, 8-byte aligned for atomic access
+size_t capture_ring_offset(const capture_header_t &h) {
+	return (sizeof(capture_header_t) + h.num_cores * sizeof(int32_t) + h.num_events * sizeof(capture_event_t) + 7) / 8 * 8;
+}
+
+// Records first to end (exclusive) of a ring that can be read.
+struct ring_span_t {
+	u_int64_t first;
+	u_int64_t end;
+};
+
+// The records of a ring whose sequence words follow each other, found from the sequence words rather than from the
+// committed count, which may be stale: writeback doesn't order the count after the records, and a kill may come
+// between the two stores, or a live writer may wrap around while the records are read. From committed the span rolls
+// forward over records written but not yet counted, or back to the newest record in place when the count reached the
+// disk before its records, and then takes the records before it down to the first that isn't the one before, as a
+// slot the writer has already reused is. Torn or missing records read as zeros or as records of another lap. The
+// clock isn't trusted for this, as NTP may step it back.
+ring_span_t consistent_span(const char *slots, size_t record_size, u_int64_t capacity, u_int64_t committed) {
+	ring_span_t span = {committed, committed};
+	if (!capacity)
+		return span;
+	auto sequence = [&](u_int64_t n) {
+		return *(const u_int64_t *) (slots + n % capacity * record_size + record_size - sizeof(u_int64_t)) & ~CAPTURE_RESTART;
+	};
+	while (span.end < committed + capacity && sequence(span.end) == span.end + 1)
+		++span.end;
+	while (span.end > 0 && span.end + capacity > committed && sequence(span.end - 1) != span.end)
+		--span.end;
+	span.first = span.end;
+	while (span.first > 0 && span.first + capacity > span.end && sequence(span.first - 1) == span.first)
+		--span.first;
+	return span;
+}
+
+// Estimates the TSC frequency against CLOCK_MONOTONIC.
+u_int64_t calibrate_tsc_hz() {
+	const u_int64_t ns0 = monotonic_ns();
+	const u_int64_t tsc0 = rdtsc();
+	usleep(20 * 1000);
+	const u_int64_t tsc = rdtsc();
+	const u_int64_t ns = monotonic_ns();
+	return (tsc - tsc0) * 1e9 / (ns - ns0);
+}
+
+capture_header_t local_capture_header(u_int64_t interval_ns) {
+	capture_header_t h;
+	memset(&h, 0, sizeof(h));
+	h.cpu_family = cpu_family();
+	h.cpu_model = cpu_model();
+	h.interval_ns = interval_ns;
+	h.tsc_hz = calibrate_tsc_hz();
+	gethostname(h.hostname, sizeof(h.hostname) - 1);
+	return h;
+}
+
+// The header of a capture of the given version, up to its first record; host supplies the CPU, interval, TSC frequency
+// and hostname.
+std::vector<char> capture_file_header(u_int32_t version, const capture_header_t &host, const topology_t &topology,
+                                      const pmc_event_type_t *events, size_t num_events) {
+	std::vector<char> header(sizeof(capture_header_t) + topology.num_cores * sizeof(int32_t) + num_events * sizeof(capture_event_t));
+	if (version == CAPTURE_RING_VERSION)
+		header.resize((header.size() + 7) / 8 * 8 + sizeof(capture_ring_t));
+	header.resize((header.size() + 63) / 64 * 64);
+	capture_header_t &h = *(capture_header_t *) header.data();
+	h = host;
+	memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+	h.version = version;
+	h.header_size = header.size();
+	h.record_size = (CAPTURE_RECORD_HEADER + topology.num_cores * num_events + capture_mask_words(num_events) + (version == CAPTURE_RING_VERSION)) *
+		sizeof(u_int64_t);
+	h.num_cores = topology.num_cores;
+	h.num_events = num_events;
+
+	int32_t *packages = (int32_t *) (header.data() + sizeof(capture_header_t));
+	for (int core = 0; core < topology.num_cores; ++core)
+		packages[core] = topology.packages[core];
+	capture_event_t *e = (capture_event_t *) (packages + topology.num_cores);
+	for (size_t i = 0; i < num_events; ++i) {
+		e[i].event = events[i].event;
+		e[i].umask = events[i].umask;
+		strncpy(e[i].name, events[i].name, sizeof(e[i].name) - 1);
+	}
+	return header;
+}
+
+struct capture_writer_t {
+private:
+	int fd;
+	std::vector<u_int64_t> record;
+
+public:
+	capture_writer_t(const capture_writer_t &) = delete;
+	capture_writer_t &operator=(const capture_writer_t &) = delete;
+	capture_writer_t(const std::string &path, const capture_header_t &host, const topology_t &topology, const pmc_event_type_t *events, size_t num_events) {
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+
+		const std::vector<char> header = capture_file_header(CAPTURE_VERSION, host, topology, events, num_events);
+		write_fully(fd, header.data(), header.size());
+		record.resize(((const capture_header_t *) header.data())->record_size / sizeof(u_int64_t));
+	}
+	~capture_writer_t() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+public:
+	void write(u_int64_t time_ns, u_int64_t tsc, const std::vector<u_int64_t> &counts, const std::vector<bool> &estimated) {
+		record[0] = time_ns;
+		record[1] = tsc;
+		std::copy(counts.begin(), counts.end(), record.begin() + CAPTURE_RECORD_HEADER);
+		capture_set_mask(&record[CAPTURE_RECORD_HEADER + counts.size()], estimated);
+		write_fully(fd, (const char *) record.data(), record.size() * sizeof(u_int64_t));
+	}
+};
+
+// the sampler hands a ring capture's dirty pages to writeback at this period
+static const u_int64_t FLUSH_INTERVAL_NS = 10ull * 1000 * 1000 * 1000;
+
+// Records into a preallocated ring capture through a shared mapping: a record is copied into its slot and committed
+// by storing the new count, without syscalls, and the kernel writes the pages back even if the sampler dies. An
+// existing ring of the same layout is resumed from its last consistent record, so restarts keep the history.
+struct ring_writer_t {
+private:
+	int fd;
+	char *base;
+	size_t length;
+	size_t header_size;
+	size_t record_size;
+	capture_ring_t *ring;
+	u_int64_t restart;  // CAPTURE_RESTART until the first record after resuming is written
+
+public:
+	std::vector<u_int64_t> resumed;  // counts of the last record of a resumed ring, zeros for a new one
+
+	ring_writer_t(const ring_writer_t &) = delete;
+	ring_writer_t &operator=(const ring_writer_t &) = delete;
+	ring_writer_t(const std::string &path, const capture_header_t &host, const topology_t &topology, const pmc_event_type_t *events,
+	              size_t num_events, u_int64_t capacity)
+		: fd(-1), base(NULL), length(0), restart(0) {
+		const std::vector<char> header = capture_file_header(CAPTURE_RING_VERSION, host, topology, events, num_events);
+		const capture_header_t &h = *(const capture_header_t *) header.data();
+		header_size = h.header_size;
+		record_size = h.record_size;
+		length = header_size + capacity * record_size;
+		const size_t ring_offset = capture_ring_offset(h);
+
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+			throw std::runtime_error("can't stat " + path + ": " + strerror(errno));
+		const bool resume = st.st_size > 0;
+		if (resume && (size_t) st.st_size != length)
+			throw std::runtime_error(path + " is a ring of another size or layout");
+		// allocated up front, so that a full disk can't fault a store into the mapping
+		if (!resume && (errno = posix_fallocate(fd, 0, length)) != 0)
+			throw std::runtime_error("can't allocate " + path + ": " + strerror(errno));
+		void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			throw std::runtime_error("can't map " + path + ": " + strerror(errno));
+		base = (char *) p;
+		ring = (capture_ring_t *) (base + ring_offset);
+
+		resumed.assign(topology.num_cores * num_events, 0);
+		if (resume) {
+			// the host fields may differ between runs; the layout, packages and events may not
+			const capture_header_t &old = *(const capture_header_t *) base;
+			if (memcmp(old.magic, CAPTURE_MAGIC, sizeof(old.magic)) != 0 || old.version != CAPTURE_RING_VERSION ||
+			    old.header_size != h.header_size || old.record_size != h.record_size || ring->capacity != capacity ||
+			    memcmp(base + sizeof(capture_header_t), header.data() + sizeof(capture_header_t), ring_offset - sizeof(capture_header_t)) != 0)
+				throw std::runtime_error(path + " is a ring of another size or layout");
+			// a resumed ring may be given multiplexed events for the first time
+			((capture_header_t *) base)->flags |= h.flags;
+			// records written past a stale count are kept; the count never goes back, as readers may hold it
+			const ring_span_t span = consistent_span(base + header_size, record_size, capacity, ring->committed);
+			__atomic_store_n(&ring->committed, std::max(ring->committed, span.end), __ATOMIC_RELEASE);
+			if (span.end > span.first) {
+				const u_int64_t *last = (const u_int64_t *) (base + header_size + (span.end - 1) % capacity * record_size);
+				std::copy(last + CAPTURE_RECORD_HEADER, last + CAPTURE_RECORD_HEADER + resumed.size(), resumed.begin());
+				restart = CAPTURE_RESTART;
+			}
+		} else {
+			memcpy(base, header.data(), ring_offset);
+			ring->capacity = capacity;
+			ring->committed = 0;
+		}
+	}
+	~ring_writer_t() {
+		if (base) {
+			msync(base, length, MS_SYNC);
+			munmap(base, length);
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+
+	u_int64_t committed() const {
+		return ring->committed;
+	}
+
+	void write(u_int64_t time_ns, u_int64_t tsc, const std::vector<u_int64_t> &counts, const std::vector<bool> &estimated) {
+		const u_int64_t n = ring->committed;
+		u_int64_t *record = (u_int64_t *) (base + header_size + n % ring->capacity * record_size);
+		record[0] = time_ns;
+		record[1] = tsc;
+		std::copy(counts.begin(), counts.end(), record + CAPTURE_RECORD_HEADER);
+		capture_set_mask(record + CAPTURE_RECORD_HEADER + counts.size(), estimated);
+		record[record_size / sizeof(u_int64_t) - 1] = (n + 1) | restart;
+		restart = 0;
+		__atomic_store_n(&ring->committed, n + 1, __ATOMIC_RELEASE);
+	}
+
+	// Starts writeback of the dirty pages, so that a crash of the host loses little.
+	void flush() {
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+};
+
+// Read-only view of a capture file, mapped into memory.
+struct capture_t {
+private:
+	int fd;
+	const char *base;
+	size_t length;
+	u_int64_t capacity;  // of a ring, 0 for a linear capture
+	u_int64_t first;     // slot of the oldest record of a ring
+
+public:
+	capture_header_t header;
+	std::vector<int> packages;
+	std::vector<capture_event_t> events;
+	size_t num_records;
+	// records of a ring that don't continue the one before them, in order; a linear capture is one run of the sampler
+	std::vector<size_t> restarts;
+
+	capture_t(const capture_t &) = delete;
+	capture_t &operator=(const capture_t &) = delete;
+	capture_t(const std::string &path)
+		: fd(-1), base(NULL), length(0), capacity(0), first(0) {
+		fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(capture_header_t))
+			throw std::runtime_error(path + " is not a capture");
+		length = st.st_size;
+		void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			throw std::runtime_error("can't map " + path + ": " + strerror(errno));
+		base = (const char *) p;
+
+		memcpy(&header, base, sizeof(header));
+		if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 || (header.version != CAPTURE_VERSION && header.version != CAPTURE_RING_VERSION))
+			throw std::runtime_error(path + " is not a capture of a supported version");
+		// in 64 bits, so that no core or event count can wrap around to a valid record size
+		const u_int64_t num_counters = (u_int64_t) header.num_cores * header.num_events;
+		const bool ring_version = header.version == CAPTURE_RING_VERSION;
+		if (header.header_size > length ||
+		    header.record_size != (CAPTURE_RECORD_HEADER + num_counters + capture_mask_words(header.num_events) + ring_version) * sizeof(u_int64_t) ||
+		    sizeof(capture_header_t) + (u_int64_t) header.num_cores * sizeof(int32_t) + (u_int64_t) header.num_events * sizeof(capture_event_t) > header.header_size)
+			throw std::runtime_error(path + " has a corrupt header");
+
+		const int32_t *p_packages = (const int32_t *) (base + sizeof(capture_header_t));
+		packages.assign(p_packages, p_packages + header.num_cores);
+		const capture_event_t *p_events = (const capture_event_t *) (p_packages + header.num_cores);
+		events.assign(p_events, p_events + header.num_events);
+		// a record cut short by a crash is ignored
+		num_records = (length - header.header_size) / header.record_size;
+		if (header.version == CAPTURE_RING_VERSION) {
+			const capture_ring_t *ring = (const capture_ring_t *) (base + capture_ring_offset(header));
+			if (capture_ring_offset(header) + sizeof(capture_ring_t) > header.header_size || ring->capacity > num_records)
+				throw std::runtime_error(path + " has a corrupt ring");
+			capacity = ring->capacity;
+			// the ring may be recording: take the records committed by now
+			const u_int64_t committed = __atomic_load_n(&ring->committed, __ATOMIC_ACQUIRE);
+			const ring_span_t span = consistent_span(base + header.header_size, header.record_size, capacity, committed);
+			num_records = span.end - span.first;
+			first = span.first % std::max<u_int64_t>(capacity, 1);
+			for (size_t r = 1; r < num_records; ++r)
+				if (!continues(r))
+					restarts.push_back(r);
+		}
+	}
+	~capture_t() {
+		if (base)
+			munmap((void *) base, length);
+		if (fd >= 0)
+			close(fd);
+	}
+
+public:
+	size_t num_counters() const {
+		return header.num_cores * header.num_events;
+	}
+
+	const u_int64_t *record(size_t i) const {
+		const size_t slot = capacity ? (first + i) % capacity : i;
+		return (const u_int64_t *) (base + header.header_size + slot * header.record_size);
+	}
+
+	u_int64_t time_ns(size_t i) const {
+		return record(i)[0];
+	}
+
+	u_int64_t tsc(size_t i) const {
+		return record(i)[1];
+	}
+
+	const u_int64_t *counts(size_t i) const {
+		return record(i) + CAPTURE_RECORD_HEADER;
+	}
+
+	// whether the delta of event e in the interval ending at record i was estimated
+	bool estimated(size_t i, size_t e) const {
+		return record(i)[CAPTURE_RECORD_HEADER + num_counters() + e / 64] >> (e % 64) & 1;
+	}
+
+	// Whether record r continues record r - 1, so that the interval between them can be read: not the first record
+	// after a restart of the sampler, and neither the TSC nor the clock went back.
+	bool continues(size_t r) const {
+		if (tsc(r) < tsc(r - 1) || time_ns(r) < time_ns(r - 1))
+			return false;
+		return !capacity || !(record(r)[header.record_size / sizeof(u_int64_t) - 1] & CAPTURE_RESTART);
+	}
+
+	// number of the intervals between records first and last that can be read
+	size_t intervals(size_t first, size_t last) const {
+		return last - first - (std::upper_bound(restarts.begin(), restarts.end(), last) - std::upper_bound(restarts.begin(), restarts.end(), first));
+	}
+
+	// index of the first record at or after time_ns
+	size_t lower_bound(u_int64_t time_ns) const {
+		size_t lo = 0, hi = num_records;
+		while (lo < hi) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (this->time_ns(mid) < time_ns)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+	void advise_sequential() const {
+		madvise((void *) base, length, MADV_SEQUENTIAL);
+	}
+};
+
+// Minimal FlatBuffers builder, enough for Arrow IPC metadata. Like the reference implementation it builds the buffer
+// back to front, so an object is referred to by its distance from the end of the buffer.
+struct flatbuffer_builder_t {
+public:
+	typedef u_int32_t ref_t;
+
+private:
+	std::vector<u_int8_t> buf;  // the data occupies the last `used` bytes
+	size_t used;
+	std::vector<std::pair<u_int16_t, ref_t>> fields;
+	ref_t table_start;
+
+	void grow(size_t n) {
+		if (used + n <= buf.size())
+			return;
+		std::vector<u_int8_t> larger(std::max(buf.size() * 2, used + n));
+		memcpy(&larger[larger.size() - used], &buf[buf.size() - used], used);
+		buf.swap(larger);
+	}
+
+	void push(const void *p, size_t n) {
+		if (n == 0)
+			return;
+		grow(n);
+		used += n;
+		memcpy(&buf[buf.size() - used], p, n);
+	}
+
+	// pads so that the buffer is aligned to `align` once `extra` more bytes are written
+	void prealign(size_t extra, size_t align) {
+		const size_t padding = (align - (used + extra) % align) % align;
+		grow(padding);
+		memset(&buf[buf.size() - used - padding], 0, padding);
+		used += padding;
+	}
+
+	template<class T>
+	void push_scalar(T v) {
+		prealign(sizeof(T), sizeof(T));
+		push(&v, sizeof(T));
+	}
+
+	void push_ref(ref_t target) {
+		prealign(sizeof(u_int32_t), sizeof(u_int32_t));
+		const u_int32_t offset = used + sizeof(u_int32_t) - target;
+		push(&offset, sizeof(offset));
+	}
+
+public:
+	flatbuffer_builder_t()
+		: buf(1024), used(0), table_start(0) {}
+
+	void clear() {
+		used = 0;
+	}
+
+	const u_int8_t *data() const {
+		return &buf[buf.size() - used];
+	}
+
+	size_t size() const {
+		return used;
+	}
+
+	ref_t string(const std::string &s) {
+		prealign(s.size() + 1, sizeof(u_int32_t));
+		push("", 1);
+		push(s.data(), s.size());
+		push_scalar<u_int32_t>(s.size());
+		return used;
+	}
+
+	ref_t vector_of_refs(const std::vector<ref_t> &refs) {
+		prealign(refs.size() * sizeof(u_int32_t), sizeof(u_int32_t));
+		for (size_t i = refs.size(); i-- > 0; )
+			push_ref(refs[i]);
+		push_scalar<u_int32_t>(refs.size());
+		return used;
+	}
+
+	ref_t vector_of_structs(const void *data, size_t n, size_t size, size_t align) {
+		prealign(n * size, sizeof(u_int32_t));
+		prealign(n * size, align);
+		push(data, n * size);
+		push_scalar<u_int32_t>(n);
+		return used;
+	}
+
+	// children have to be built before their table is started
+	void start_table() {
+		fields.clear();
+		table_start = used;
+	}
+
+	template<class T>
+	void add_scalar(u_int16_t id, T v) {
+		push_scalar(v);
+		fields.push_back(std::make_pair(id, used));
+	}
+
+	void add_ref(u_int16_t id, ref_t target) {
+		push_ref(target);
+		fields.push_back(std::make_pair(id, used));
+	}
+
+	ref_t end_table() {
+		push_scalar<int32_t>(0);
+		const ref_t table = used;
+
+		u_int16_t num_fields = 0;
+		for (const auto &field : fields)
+			num_fields = std::max<u_int16_t>(num_fields, field.first + 1);
+		std::vector<u_int16_t> offsets(num_fields, 0);
+		for (const auto &field : fields)
+			offsets[field.first] = table - field.second;
+		for (size_t i = num_fields; i-- > 0; )
+			push_scalar<u_int16_t>(offsets[i]);
+		push_scalar<u_int16_t>(table - table_start);
+		push_scalar<u_int16_t>((num_fields + 2) * sizeof(u_int16_t));
+
+		// the table starts with the signed distance back to its vtable
+		const int32_t vtable = used - table;
+		memcpy(&buf[buf.size() - table], &vtable, sizeof(vtable));
+		return table;
+	}
+
+	void finish(ref_t root) {
+		prealign(sizeof(u_int32_t), 8);
+		push_ref(root);
+	}
+};
+
+// Writes an Arrow IPC file (Feather v2) of uint64 and float64 columns without nulls, one record batch at a time.
+struct arrow_writer_t {
+private:
+	struct block_t {
+		int64_t offset;
+		int32_t metadata_length;
+		int32_t padding;
+		int64_t body_length;
+	};
+
+	// Arrow format constants, from Schema.fbs and Message.fbs
+	static const int16_t METADATA_V5 = 4;
+	static const u_int8_t HEADER_SCHEMA = 1;
+	static const u_int8_t HEADER_RECORD_BATCH = 3;
+	static const u_int8_t TYPE_INT = 2;
+	static const u_int8_t TYPE_FLOATING_POINT = 3;
+	static const int16_t PRECISION_DOUBLE = 2;
+
+	int fd;
+	std::vector<std::string> names;
+	std::vector<bool> floating;
+	int64_t offset;
+	std::vector<block_t> blocks;
+	flatbuffer_builder_t fb;
+
+	void write(const void *p, size_t n) {
+		write_fully(fd, (const char *) p, n);
+		offset += n;
+	}
+
+	flatbuffer_builder_t::ref_t build_schema() {
+		std::vector<flatbuffer_builder_t::ref_t> refs;
+		for (size_t i = 0; i < names.size(); ++i) {
+			const auto name_ref = fb.string(names[i]);
+			const auto children = fb.vector_of_refs(std::vector<flatbuffer_builder_t::ref_t>());
+			fb.start_table();
+			if (floating[i]) {
+				fb.add_scalar<int16_t>(0, PRECISION_DOUBLE);
+			} else {
+				fb.add_scalar<int32_t>(0, 64);
+				fb.add_scalar<u_int8_t>(1, 0);
+			}
+			const auto type = fb.end_table();
+			fb.start_table();
+			fb.add_ref(0, name_ref);
+			fb.add_scalar<u_int8_t>(1, 0);
+			fb.add_scalar<u_int8_t>(2, floating[i] ? TYPE_FLOATING_POINT : TYPE_INT);
+			fb.add_ref(3, type);
+			fb.add_ref(5, children);
+			refs.push_back(fb.end_table());
+		}
+		const auto fields = fb.vector_of_refs(refs);
+		fb.start_table();
+		fb.add_ref(1, fields);
+		return fb.end_table();
+	}
+
+	// writes an encapsulated message: continuation marker, metadata length, metadata, body
+	void write_message(u_int8_t header_type, flatbuffer_builder_t::ref_t header, const char *body, int64_t body_length) {
+		fb.start_table();
+		fb.add_scalar<int64_t>(3, body_length);
+		fb.add_ref(2, header);
+		fb.add_scalar<int16_t>(0, METADATA_V5);
+		fb.add_scalar<u_int8_t>(1, header_type);
+		fb.finish(fb.end_table());
+
+		block_t block;
+		block.offset = offset;
+		block.metadata_length = 8 + fb.size();
+		block.padding = 0;
+		block.body_length = body_length;
+		const int32_t prefix[2] = {-1, (int32_t) fb.size()};
+		write(prefix, sizeof(prefix));
+		write(fb.data(), fb.size());
+		if (body_length > 0)
+			write(body, body_length);
+		if (header_type == HEADER_RECORD_BATCH)
+			blocks.push_back(block);
+	}
+
+public:
+	arrow_writer_t(int fd, const std::vector<std::string> &names, const std::vector<bool> &floating)
+		: fd(fd), names(names), floating(floating), offset(0) {
+		write("ARROW1\0\0", 8);
+		fb.clear();
+		write_message(HEADER_SCHEMA, build_schema(), NULL, 0);
+	}
+
+	// columns holds num_rows values of each column, one column after another
+	void write_batch(const char *columns, size_t num_rows) {
+		const int64_t column_length = num_rows * 8;
+		std::vector<int64_t> nodes, buffers;
+		for (size_t i = 0; i < names.size(); ++i) {
+			nodes.push_back(num_rows);
+			nodes.push_back(0);
+			buffers.push_back(i * column_length);  // no validity bitmap
+			buffers.push_back(0);
+			buffers.push_back(i * column_length);
+			buffers.push_back(column_length);
+		}
+
+		fb.clear();
+		const auto buffers_ref = fb.vector_of_structs(buffers.data(), buffers.size() / 2, 16, 8);
+		const auto nodes_ref = fb.vector_of_structs(nodes.data(), nodes.size() / 2, 16, 8);
+		fb.start_table();
+		fb.add_scalar<int64_t>(0, num_rows);
+		fb.add_ref(1, nodes_ref);
+		fb.add_ref(2, buffers_ref);
+		write_message(HEADER_RECORD_BATCH, fb.end_table(), columns, column_length * names.size());
+	}
+
+	void finish() {
+		const int32_t eos[2] = {-1, 0};
+		write(eos, sizeof(eos));
+
+		fb.clear();
+		const auto batches = fb.vector_of_structs(blocks.data(), blocks.size(), sizeof(block_t), 8);
+		const auto dictionaries = fb.vector_of_structs(NULL, 0, sizeof(block_t), 8);
+		const auto schema = build_schema();
+		fb.start_table();
+		fb.add_ref(1, schema);
+		fb.add_ref(2, dictionaries);
+		fb.add_ref(3, batches);
+		fb.add_scalar<int16_t>(0, METADATA_V5);
+		fb.finish(fb.end_table());
+		write(fb.data(), fb.size());
+		const int32_t footer_length = fb.size();
+		write(&footer_length, sizeof(footer_length));
+		write("ARROW1", 6);
+	}
+};
+
+// Buffers CSV output and writes it out in large chunks.
+struct csv_writer_t {
+private:
+	int fd;
+	std::vector<char> buf;
+	size_t len;
+	bool first;
+
+	void reserve(size_t n) {
+		if (len + n > buf.size())
+			flush();
+	}
+
+public:
+	csv_writer_t(int fd)
+		: fd(fd), buf(1 << 20), len(0), first(true) {}
+	~csv_writer_t() {
+		flush();
+	}
+
+	void flush() {
+		write_fully(fd, buf.data(), len);
+		len = 0;
+	}
+
+	// quoted if needed, as imported raw event names such as cpu/event=0xc2,umask=0x01/ have commas
+	void field(const std::string &s) {
+		if (s.find_first_of(",\"\n") == std::string::npos) {
+			reserve(s.size() + 1);
+			if (!first)
+				buf[len++] = ',';
+			memcpy(&buf[len], s.data(), s.size());
+			len += s.size();
+		} else {
+			reserve(2 * s.size() + 3);
+			if (!first)
+				buf[len++] = ',';
+			buf[len++] = '"';
+			for (char c : s) {
+				if (c == '"')
+					buf[len++] = '"';
+				buf[len++] = c;
+			}
+			buf[len++] = '"';
+		}
+		first = false;
+	}
+
+	void field(u_int64_t v) {
+		reserve(21);
+		if (!first)
+			buf[len++] = ',';
+		len += format_uint(&buf[len], v);
+		first = false;
+	}
+
+	void field(double v) {
+		reserve(33);
+		if (!first)
+			buf[len++] = ',';
+		len += format_fixed(&buf[len], v, 4);
+		first = false;
+	}
+
+	void end_row() {
+		reserve(1);
+		buf[len++] = '\n';
+		first = true;
+	}
+};
+
+// Column names of an exported capture: the end of each interval, its length in TSC ticks, then one column per
+// core and counter.
+std::vector<std::string> export_columns(const capture_t &capture) {
+	std::vector<std::string> names = {"time_ns", "tsc_delta"};
+	for (u_int32_t core = 0; core < capture.header.num_cores; ++core)
+		for (const auto &event : capture.events)
+			names.push_back("core" + std::to_string(core) + ":" + std::string(event.name, strnlen(event.name, sizeof(event.name))));
+	return names;
+}
+
+void export_csv(int fd, const capture_t &capture, bool util) {
+	csv_writer_t csv(fd);
+	for (const auto &name : export_columns(capture))
+		csv.field(name);
+	csv.end_row();
+
+	const size_t num_counters = capture.num_counters();
+	for (size_t r = 1; r < capture.num_records; ++r) {
+		if (!capture.continues(r))
+			continue;
+		const u_int64_t tsc_delta = capture.tsc(r) - capture.tsc(r - 1);
+		const u_int64_t *counts = capture.counts(r);
+		const u_int64_t *counts0 = capture.counts(r - 1);
+		csv.field(capture.time_ns(r));
+		csv.field(tsc_delta);
+		for (size_t j = 0; j < num_counters; ++j) {
+			if (util)
+				csv.field(tsc_delta ? (counts[j] - counts0[j]) / (double) tsc_delta * 100 : 0.0);
+			else
+				csv.field(counts[j] - counts0[j]);
+		}
+		csv.end_row();
+	}
+}
+
+// Transposes intervals into columns, one record batch of at most batch_bytes at a time.
+void export_arrow(int fd, const capture_t &capture, bool util, size_t batch_bytes) {
+	const std::vector<std::string> names = export_columns(capture);
+	std::vector<bool> floating(names.size(), util);
+	floating[0] = floating[1] = false;
+	arrow_writer_t arrow(fd, names, floating);
+
+	const size_t num_counters = capture.num_counters();
+	const size_t num_columns = names.size();
+	const size_t batch_rows = std::max<size_t>(1, batch_bytes / (num_columns * 8));
+	std::vector<u_int64_t> columns(num_columns * std::min(batch_rows, std::max<size_t>(capture.num_records, 1)));
+	double *fcolumns = (double *) columns.data();
+
+	std::vector<size_t> batch;
+	for (size_t begin = 1; begin < capture.num_records;) {
+		batch.clear();
+		for (; begin < capture.num_records && batch.size() < batch_rows; ++begin)
+			if (capture.continues(begin))
+				batch.push_back(begin);
+		const size_t rows = batch.size();
+		if (!rows)
+			break;
+		for (size_t row = 0; row < rows; ++row) {
+			const size_t r = batch[row];
+			const u_int64_t tsc_delta = capture.tsc(r) - capture.tsc(r - 1);
+			const u_int64_t *counts = capture.counts(r);
+			const u_int64_t *counts0 = capture.counts(r - 1);
+			columns[row] = capture.time_ns(r);
+			columns[rows + row] = tsc_delta;
+			if (util) {
+				for (size_t j = 0; j < num_counters; ++j)
+					fcolumns[(2 + j) * rows + row] = tsc_delta ? (counts[j] - counts0[j]) / (double) tsc_delta * 100 : 0.0;
+			} else {
+				for (size_t j = 0; j < num_counters; ++j)
+					columns[(2 + j) * rows + row] = counts[j] - counts0[j];
+			}
+		}
+		arrow.write_batch((const char *) columns.data(), rows);
+	}
+	arrow.finish();
+}
+
+int export_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"format", required_argument, NULL, 'f'},
+		{"util", no_argument, NULL, 'u'},
+		{"batch-size", required_argument, NULL, 'b'},
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string format = "csv";
+	bool util = false;
+	size_t batch_bytes = 64 << 20;
+	int c;
+	while ((c = getopt_long(argc, argv, "f:ub:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			format = optarg;
+			break;
+		case 'u':
+			util = true;
+			break;
+		case 'b':
+			batch_bytes = std::stoul(optarg) << 20;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || (format != "csv" && format != "arrow")) {
+		std::cerr << "Usage: core-port-stat export [--format=csv|arrow] [--util] [--batch-size=MB] CAPTURE [OUTPUT]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		capture_t capture(argv[optind]);
+		capture.advise_sequential();
+
+		int fd = STDOUT_FILENO;
+		if (optind + 1 < argc && strcmp(argv[optind + 1], "-") != 0) {
+			fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				throw std::runtime_error(std::string("can't open ") + argv[optind + 1] + ": " + strerror(errno));
+		}
+		if (format == "csv")
+			export_csv(fd, capture, util);
+		else
+			export_arrow(fd, capture, util, batch_bytes);
+		if (fd != STDOUT_FILENO)
+			close(fd);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Parses a duration such as "10m" into nanoseconds; the units are ms, s (the default), m, h and d.
+u_int64_t parse_duration_ns(const std::string &s) {
+	size_t idx;
+	const double amount = std::stod(s, &idx);
+	const std::string unit = s.substr(idx);
+	double scale;
+	if (unit == "" || unit == "s")
+		scale = 1e9;
+	else if (unit == "ms")
+		scale = 1e6;
+	else if (unit == "m")
+		scale = 60e9;
+	else if (unit == "h")
+		scale = 3600e9;
+	else if (unit == "d")
+		scale = 86400e9;
+	else
+		throw std::runtime_error("invalid time unit: " + s);
+	if (amount < 0)
+		throw std::runtime_error("negative duration: " + s);
+	return amount * scale;
+}
+
+// Parses a point in time given as Unix seconds, local "YYYY-MM-DD HH:MM:SS" (or with a 'T'), or an offset such as
+// "+10m" from the start of the capture or "-10m" from its end.
+u_int64_t parse_capture_time(const std::string &s, const capture_t &capture) {
+	if (s.empty() || capture.num_records == 0)
+		throw std::runtime_error("invalid time: " + s);
+
+	if (s[0] == '+' || s[0] == '-') {
+		const u_int64_t offset = parse_duration_ns(s.substr(1));
+		if (s[0] == '+')
+			return capture.time_ns(0) + offset;
+		const u_int64_t end = capture.time_ns(capture.num_records - 1);
+		return end > offset ? end - offset : 0;
+	}
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	const char *end = strptime(s.c_str(), "%Y-%m-%d %H:%M:%S", &tm);
+	if (!end)
+		end = strptime(s.c_str(), "%Y-%m-%dT%H:%M:%S", &tm);
+	if (end && *end == '\0') {
+		tm.tm_isdst = -1;
+		return (u_int64_t) mktime(&tm) * 1000000000;
+	}
+
+	size_t idx;
+	const double seconds = std::stod(s, &idx);
+	if (idx != s.size())
+		throw std::runtime_error("invalid time: " + s);
+	return seconds * 1e9;
+}
+
+std::string format_time_ns(u_int64_t time_ns) {
+	const time_t t = time_ns / 1000000000;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char buf[64];
+	const size_t n = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	snprintf(buf + n, sizeof(buf) - n, ".%03llu", (unsigned long long) (time_ns % 1000000000 / 1000000));
+	return buf;
+}
+
+// Finds the records bounding --from and --to by bisection.
+void capture_range(const capture_t &capture, const std::string &from, const std::string &to, size_t &first, size_t &last) {
+	if (capture.num_records < 2)
+		throw std::runtime_error("capture holds no complete interval");
+
+	first = 0;
+	last = capture.num_records - 1;
+	if (!from.empty())
+		first = std::min(capture.lower_bound(parse_capture_time(from, capture)), capture.num_records - 1);
+	if (!to.empty()) {
+		const size_t end = capture.lower_bound(parse_capture_time(to, capture) + 1);
+		last = end > 0 ? end - 1 : 0;
+	}
+	if (last <= first)
+		throw std::runtime_error("no complete interval between --from and --to");
+}
+
+// Fills interval with the deltas between records r0 and r, leaving out the intervals that span a restart.
+void capture_interval(const capture_t &capture, size_t r0, size_t r, interval_t &interval) {
+	const size_t num_counters = capture.num_counters();
+	interval.time_ns = capture.time_ns(r);
+	interval.tsc = capture.tsc(r);
+	interval.tsc_delta = 0;
+	interval.lateness_ns = 0;
+	interval.num_events = capture.header.num_events;
+	interval.estimated.assign(interval.num_events, false);
+	interval.deltas.assign(num_counters, 0);
+	interval.utils.resize(num_counters);
+	std::fill(interval.cycles, interval.cycles + NUM_PHASES, 0);
+	auto add = [&](size_t begin, size_t end) {
+		interval.tsc_delta += capture.tsc(end) - capture.tsc(begin);
+		const u_int64_t *counts = capture.counts(end);
+		const u_int64_t *counts0 = capture.counts(begin);
+		for (size_t j = 0; j < num_counters; ++j)
+			interval.deltas[j] += counts[j] - counts0[j];
+	};
+	size_t begin = r0;
+	for (auto it = std::upper_bound(capture.restarts.begin(), capture.restarts.end(), r0); it != capture.restarts.end() && *it <= r; ++it) {
+		add(begin, *it - 1);
+		begin = *it;
+	}
+	add(begin, r);
+	for (size_t j = 0; j < num_counters; ++j)
+		interval.utils[j] = interval.tsc_delta ? interval.deltas[j] / (double) interval.tsc_delta * 100 : 0.0;
+	// without multiplexed events there are no masks to read between the ends
+	if (capture.header.flags & CAPTURE_ESTIMATES)
+		for (size_t i = r0 + 1; i <= r; ++i)
+			for (size_t e = 0; e < interval.num_events; ++e)
+				interval.estimated[e] = interval.estimated[e] || capture.estimated(i, e);
+}
+
+int report_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"from", required_argument, NULL, 'F'},
+		{"to", required_argument, NULL, 'T'},
+		{"each", no_argument, NULL, 'e'},
+		{"rollup", no_argument, NULL, 'R'},
+		{"classify", optional_argument, NULL, 'b'},
+		{"frontend", no_argument, NULL, 'd'},
+		{"flops", no_argument, NULL, 'x'},  // long only, -F is --from
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string from, to;
+	bool each = false, rollup = false, classify = false, frontend_analysis = false, flops_analysis = false;
+	double classify_threshold = 0.8;
+	int c;
+	while ((c = getopt_long(argc, argv, "F:T:eRb::d", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'F':
+			from = optarg;
+			break;
+		case 'T':
+			to = optarg;
+			break;
+		case 'e':
+			each = true;
+			break;
+		case 'R':
+			rollup = true;
+			break;
+		case 'b':
+			classify = true;
+			if (optarg)
+				classify_threshold = atof(optarg) / 100;
+			break;
+		case 'd':
+			frontend_analysis = true;
+			break;
+		case 'x':
+			flops_analysis = true;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		std::cerr << "Usage: core-port-stat report [--from=TIME] [--to=TIME] [--each] [--rollup] [--classify[=PCT]] [--frontend] [--flops] CAPTURE" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		const capture_t capture(argv[optind]);
+		// every record holds accumulated counts, so only the ends of the range are read
+		size_t first, last;
+		capture_range(capture, from, to, first, last);
+
+		printf("%s: %s - %s, %zu intervals\n",
+			std::string(capture.header.hostname, strnlen(capture.header.hostname, sizeof(capture.header.hostname))).c_str(),
+			format_time_ns(capture.time_ns(first)).c_str(), format_time_ns(capture.time_ns(last)).c_str(), capture.intervals(first, last));
+
+		// captures record packages but not NUMA nodes
+		rollup_t packages("package", "packages", "package_imbalance", capture.packages, capture.header.num_events);
+		std::unique_ptr<port_classifier_t> classifier;
+		if (classify)
+			classifier.reset(new port_classifier_t(classify_threshold, capture.events, capture.header.num_cores));
+		std::unique_ptr<frontend_t> frontend;
+		if (frontend_analysis)
+			frontend.reset(new frontend_t(capture.events, capture.header.num_cores));
+		std::unique_ptr<flops_t> flops;
+		if (flops_analysis)
+			flops.reset(new flops_t(capture.events, capture.header.num_cores, capture.header.tsc_hz));
+		interval_t interval;
+		std::string line;
+		auto print = [&](const std::string &label) {
+			line = label + " ";
+			format_text(line, interval, capture.header.num_cores);
+			line += '\n';
+			if (rollup) {
+				packages.update(interval.utils);
+				line += std::string(label.size() + 1, ' ');
+				packages.format_text(line);
+			}
+			if (classifier) {
+				classifier->update(interval);
+				line += std::string(label.size() + 1, ' ');
+				classifier->format_text(line);
+			}
+			if (frontend) {
+				frontend->update(interval);
+				line += std::string(label.size() + 1, ' ');
+				frontend->format_text(line);
+			}
+			if (flops) {
+				flops->update(interval);
+				line += std::string(label.size() + 1, ' ');
+				flops->format_text(line);
+			}
+			fwrite(line.data(), 1, line.size(), stdout);
+		};
+		if (each) {
+			for (size_t r = first + 1; r <= last; ++r) {
+				if (!capture.continues(r))
+					continue;
+				capture_interval(capture, r - 1, r, interval);
+				print(format_time_ns(interval.time_ns));
+			}
+		}
+
+		capture_interval(capture, first, last, interval);
+		print("mean");
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Maps a utilization in [0, 1] to one of the levels of a viridis-like color ramp.
+static const int HEATMAP_LEVELS = 64;
+
+std::string heatmap_color(int level) {
+	static const double STOPS[][3] = {
+		{68, 1, 84},
+		{59, 82, 139},
+		{33, 145, 140},
+		{94, 201, 98},
+		{253, 231, 37},
+	};
+	const double x = level / (double) (HEATMAP_LEVELS - 1) * (length_of(STOPS) - 1);
+	const size_t i = std::min<size_t>(x, length_of(STOPS) - 2);
+	const double t = x - i;
+	char buf[8];
+	snprintf(buf, sizeof(buf), "#%02x%02x%02x",
+		(int) (STOPS[i][0] + (STOPS[i + 1][0] - STOPS[i][0]) * t),
+		(int) (STOPS[i][1] + (STOPS[i + 1][1] - STOPS[i][1]) * t),
+		(int) (STOPS[i][2] + (STOPS[i + 1][2] - STOPS[i][2]) * t));
+	return buf;
+}
+
+enum heatmap_stat_t {
+	STAT_MEAN,
+	STAT_MIN,
+	STAT_MAX,
+};
+
+// Renders one SVG heat map per event, with time on the x axis and cores grouped by package on the y axis. Each pixel
+// column covers a contiguous range of intervals reduced with `stat`, and runs of equal color along a row are merged
+// into one rectangle. Only one pixel column is held in memory at a time.
+void render_heatmaps(const capture_t &capture, size_t first, size_t last, const std::string &prefix, int width, int row_height, heatmap_stat_t stat) {
+	const int num_cores = capture.header.num_cores;
+	const size_t num_events = capture.header.num_events;
+	const size_t num_intervals = last - first;
+	width = std::min<size_t>(width, num_intervals);
+
+	// cores ordered by package, with a gap between packages
+	std::vector<int> order(num_cores);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return capture.packages[a] < capture.packages[b]; });
+	static const int LEFT = 90, TOP = 30, GAP = 6, BOTTOM = 30;
+	std::vector<int> row_y(num_cores);
+	int y = TOP;
+	for (int i = 0; i < num_cores; ++i) {
+		if (i > 0 && capture.packages[order[i]] != capture.packages[order[i - 1]])
+			y += GAP;
+		row_y[order[i]] = y;
+		y += row_height;
+	}
+	const int height = y + BOTTOM;
+
+	std::vector<FILE *> files(num_events);
+	std::set<std::string> file_names;
+	for (size_t e = 0; e < num_events; ++e) {
+		const std::string name(capture.events[e].name, strnlen(capture.events[e].name, sizeof(capture.events[e].name)));
+		// imported raw events such as cpu/event=0xc2,umask=0x01/ are no file names
+		std::string file_name = name;
+		for (auto &c : file_name)
+			if (!isalnum((unsigned char) c) && c != '.' && c != '_' && c != '-')
+				c = '_';
+		if (!file_names.insert(file_name).second)
+			file_names.insert(file_name += "-" + std::to_string(e));
+		const std::string path = prefix + "." + file_name + ".svg";
+		files[e] = fopen(path.c_str(), "w");
+		if (!files[e])
+			throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+		setvbuf(files[e], NULL, _IOFBF, 1 << 20);
+
+		FILE *out = files[e];
+		fprintf(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" font-family=\"sans-serif\" font-size=\"11\" shape-rendering=\"crispEdges\">\n",
+			LEFT + width + 10, height);
+		fprintf(out, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+		fprintf(out, "<text x=\"%d\" y=\"18\" font-size=\"13\">%s on %s (%s per pixel column, 0-100%%)</text>\n",
+			LEFT, name.c_str(), std::string(capture.header.hostname, strnlen(capture.header.hostname, sizeof(capture.header.hostname))).c_str(),
+			stat == STAT_MEAN ? "mean" : stat == STAT_MIN ? "min" : "max");
+		for (int i = 0; i < num_cores; ++i) {
+			const int core = order[i];
+			if (i == 0 || capture.packages[core] != capture.packages[order[i - 1]])
+				fprintf(out, "<text x=\"4\" y=\"%d\">package %d</text>\n", row_y[core] + row_height, capture.packages[core]);
+			if (row_height >= 10)
+				fprintf(out, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">%d</text>\n", LEFT - 4, row_y[core] + row_height - 1, core);
+		}
+		fprintf(out, "<text x=\"%d\" y=\"%d\">%s</text>\n", LEFT, height - 10, format_time_ns(capture.time_ns(first)).c_str());
+		fprintf(out, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">%s</text>\n", LEFT + width, height - 10, format_time_ns(capture.time_ns(last)).c_str());
+	}
+
+	// per core and event: the reduction of the current column and the run of equal color being extended
+	const size_t num_counters = capture.num_counters();
+	std::vector<double> acc(num_counters);
+	std::vector<int> run_start(num_counters, 0), run_level(num_counters, -1);
+	auto flush_run = [&](size_t j, int x) {
+		if (run_level[j] >= 0 && x > run_start[j])
+			fprintf(files[j % num_events], "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" fill=\"%s\"/>\n",
+				LEFT + run_start[j], row_y[j / num_events], x - run_start[j], row_height, heatmap_color(run_level[j]).c_str());
+	};
+
+	for (int x = 0; x < width; ++x) {
+		const size_t begin = first + num_intervals * x / width;
+		const size_t end = first + num_intervals * (x + 1) / width;
+		std::fill(acc.begin(), acc.end(), stat == STAT_MIN ? INFINITY : stat == STAT_MAX ? -INFINITY : 0.0);
+		size_t n = 0;
+		for (size_t r = begin + 1; r <= end; ++r) {
+			if (!capture.continues(r))
+				continue;
+			++n;
+			const u_int64_t tsc_delta = capture.tsc(r) - capture.tsc(r - 1);
+			const u_int64_t *counts = capture.counts(r);
+			const u_int64_t *counts0 = capture.counts(r - 1);
+			for (size_t j = 0; j < num_counters; ++j) {
+				const double util = tsc_delta ? (counts[j] - counts0[j]) / (double) tsc_delta : 0.0;
+				if (stat == STAT_MIN)
+					acc[j] = std::min(acc[j], util);
+				else if (stat == STAT_MAX)
+					acc[j] = std::max(acc[j], util);
+				else
+					acc[j] += util;
+			}
+		}
+		for (size_t j = 0; j < num_counters; ++j) {
+			acc[j] = !n ? 0.0 : stat == STAT_MEAN ? acc[j] / n : acc[j];
+			const int level = std::max(0, std::min(HEATMAP_LEVELS - 1, (int) (acc[j] * (HEATMAP_LEVELS - 1) + 0.5)));
+			if (level != run_level[j]) {
+				flush_run(j, x);
+				run_start[j] = x;
+				run_level[j] = level;
+			}
+		}
+	}
+
+	for (size_t j = 0; j < num_counters; ++j)
+		flush_run(j, width);
+	for (FILE *out : files) {
+		fprintf(out, "</svg>\n");
+		if (fclose(out) != 0)
+			throw std::runtime_error(std::string("failed to write heat map: ") + strerror(errno));
+	}
+}
+
+int render_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"from", required_argument, NULL, 'F'},
+		{"to", required_argument, NULL, 'T'},
+		{"width", required_argument, NULL, 'W'},
+		{"row-height", required_argument, NULL, 'H'},
+		{"stat", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string from, to;
+	int width = 1200, row_height = 8;
+	heatmap_stat_t stat = STAT_MEAN;
+	int c;
+	while ((c = getopt_long(argc, argv, "F:T:W:H:s:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'F':
+			from = optarg;
+			break;
+		case 'T':
+			to = optarg;
+			break;
+		case 'W':
+			width = std::max(1, std::stoi(optarg));
+			break;
+		case 'H':
+			row_height = std::max(1, std::stoi(optarg));
+			break;
+		case 's':
+			if (strcmp(optarg, "mean") == 0)
+				stat = STAT_MEAN;
+			else if (strcmp(optarg, "min") == 0)
+				stat = STAT_MIN;
+			else if (strcmp(optarg, "max") == 0)
+				stat = STAT_MAX;
+			else
+				return EXIT_FAILURE;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind + 2 != argc) {
+		std::cerr << "Usage: core-port-stat render [--from=TIME] [--to=TIME] [--width=PX] [--row-height=PX] [--stat=mean|min|max] CAPTURE PREFIX" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		const capture_t capture(argv[optind]);
+		capture.advise_sequential();
+		size_t first, last;
+		capture_range(capture, from, to, first, last);
+		render_heatmaps(capture, first, last, argv[optind + 1], width, row_height, stat);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Just enough JSON to read perfmon event lists. Numbers, strings and literals are all kept as text; an object keeps
+// its keys and values in parallel, in order.
+struct json_value_t {
+	enum type_t { SCALAR, ARRAY, OBJECT } type;
+	std::string text;
+	std::vector<std::string> keys;
+	std::vector<json_value_t> items;
+public:
+	json_value_t()
+		: type(SCALAR) {}
+
+	const json_value_t *get(const char *key) const {
+		for (size_t i = 0; i < keys.size(); ++i)
+			if (keys[i] == key)
+				return &items[i];
+		return NULL;
+	}
+
+	std::string get_text(const char *key) const {
+		const json_value_t *v = get(key);
+		return v && v->type == SCALAR ? v->text : std::string();
+	}
+};
+
+struct json_parser_t {
+private:
+	const char *p;
+	const char *end;
+
+	void skip_space() {
+		while (p < end && isspace((unsigned char) *p))
+			++p;
+	}
+
+	void expect(char c) {
+		skip_space();
+		if (p >= end || *p != c)
+			throw std::runtime_error(std::string("invalid JSON: expected '") + c + "'");
+		++p;
+	}
+
+	std::string parse_string() {
+		expect('"');
+		std::string s;
+		while (p < end && *p != '"') {
+			if (*p == '\\' && p + 1 < end) {
+				++p;
+				switch (*p) {
+				case 'n': s += '\n'; break;
+				case 't': s += '\t'; break;
+				case 'r': s += '\r'; break;
+				case 'b': s += '\b'; break;
+				case 'f': s += '\f'; break;
+				case 'u': {
+					// only in descriptions; anything outside ASCII becomes '?'
+					if (end - p < 5)
+						throw std::runtime_error("invalid JSON: truncated escape");
+					const unsigned long code = std::stoul(std::string(p + 1, 4), NULL, 16);
+					s += code < 0x80 ? (char) code : '?';
+					p += 4;
+					break;
+				}
+				default: s += *p; break;
+				}
+			} else {
+				s += *p;
+			}
+			++p;
+		}
+		expect('"');
+		return s;
+	}
+
+public:
+	json_parser_t(const char *p, const char *end)
+		: p(p), end(end) {}
+
+	json_value_t parse() {
+		json_value_t v;
+		skip_space();
+		if (p >= end)
+			throw std::runtime_error("invalid JSON: unexpected end");
+		if (*p == '{') {
+			v.type = json_value_t::OBJECT;
+			++p;
+			skip_space();
+			if (p < end && *p == '}') {
+				++p;
+				return v;
+			}
+			do {
+				v.keys.push_back(parse_string());
+				expect(':');
+				v.items.push_back(parse());
+				skip_space();
+			} while (p < end && *p++ == ',');
+			if (p[-1] != '}')
+				throw std::runtime_error("invalid JSON: expected '}'");
+		} else if (*p == '[') {
+			v.type = json_value_t::ARRAY;
+			++p;
+			skip_space();
+			if (p < end && *p == ']') {
+				++p;
+				return v;
+			}
+			do {
+				v.items.push_back(parse());
+				skip_space();
+			} while (p < end && *p++ == ',');
+			if (p[-1] != ']')
+				throw std::runtime_error("invalid JSON: expected ']'");
+		} else if (*p == '"') {
+			v.text = parse_string();
+		} else {
+			const char *start = p;
+			while (p < end && (isalnum((unsigned char) *p) || *p == '-' || *p == '+' || *p == '.'))
+				++p;
+			if (p == start)
+				throw std::runtime_error(std::string("invalid JSON: unexpected '") + *p + "'");
+			v.text.assign(start, p);
+		}
+		return v;
+	}
+};
+
+// An event index is an event_index_header_t, a perfect hash displacement seed per bucket, one event_index_entry_t per
+// slot and a table of NUL-terminated strings. An event name hashes with seed 0 to its bucket, and with the bucket's
+// seed to its slot, so a lookup reads one seed, one entry and one name.
+static const char EVENT_INDEX_MAGIC[8] = {'C', 'P', 'S', 'E', 'V', 'T', '\0', '\0'};
+static const u_int32_t EVENT_INDEX_VERSION = 1;
+
+struct event_index_header_t {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t num_events;
+	u_int32_t num_slots;
+	u_int32_t num_buckets;  // even, so that the entries stay 8-byte aligned
+	u_int32_t strings_size;
+	u_int32_t reserved;
+} __attribute__((packed));
+
+enum {
+	EVENT_INVERT = 1 << 0,
+	EVENT_EDGE = 1 << 1,
+	EVENT_ANY_THREAD = 1 << 2,
+};
+
+struct event_index_entry_t {
+	u_int32_t name;         // offsets into the string table
+	u_int32_t description;
+	u_int16_t name_length;  // 0 for an empty slot
+	u_int8_t event;
+	u_int8_t umask;
+	u_int8_t cmask;
+	u_int8_t flags;
+	int8_t fixed;           // fixed counter, or -1
+	u_int8_t counters;      // general-purpose counters, bit n for IA32_PMCn
+	u_int32_t msr_index;    // auxiliary MSR such as MSR_OFFCORE_RSP_0, or 0
+	u_int32_t reserved;
+	u_int64_t msr_value;
+} __attribute__((packed));
+static_assert(sizeof(event_index_entry_t) == 32, "event index entries are 32 bytes");
+
+u_int64_t event_name_hash(const char *s, size_t n, u_int64_t seed) {
+	u_int64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+	for (size_t i = 0; i < n; ++i) {
+		h ^= (unsigned char) s[i];
+		h *= 0x100000001b3ull;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+// First number of a perfmon field such as "0xB7, 0xBB" or "4"; 0 if empty.
+u_int64_t perfmon_number(const std::string &field) {
+	const std::string first = trim(field.substr(0, field.find(',')));
+	return first.empty() ? 0 : std::stoull(first, NULL, 0);
+}
+
+// Compiles perfmon JSON event lists, either a bare array of events or an object with an "Events" array, into an
+// event index. Uncore events and duplicate names after the first are skipped.
+void compile_event_index(const std::vector<std::string> &inputs, const std::string &output) {
+	std::vector<event_index_entry_t> entries;
+	std::vector<std::string> names;
+	std::string strings;
+	std::set<std::string> seen;
+	for (const auto &input : inputs) {
+		std::ifstream in(input);
+		if (!in)
+			throw std::runtime_error("can't open " + input);
+		const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		json_value_t root = json_parser_t(text.data(), text.data() + text.size()).parse();
+		const json_value_t *events = root.type == json_value_t::OBJECT ? root.get("Events") : &root;
+		if (!events || events->type != json_value_t::ARRAY)
+			throw std::runtime_error(input + " is not a perfmon event list");
+
+		for (const auto &e : events->items) {
+			std::string name = e.get_text("EventName");
+			const std::string code = e.get_text("EventCode");
+			if (e.type != json_value_t::OBJECT || name.empty() || code.empty() || e.get("Unit"))
+				continue;
+			std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+			if (name.size() > 0xffff || !seen.insert(name).second)
+				continue;
+
+			event_index_entry_t entry;
+			memset(&entry, 0, sizeof(entry));
+			// offcore events list a code and MSR per MSR_OFFCORE_RSP; the first is enough
+			entry.event = perfmon_number(code);
+			entry.umask = perfmon_number(e.get_text("UMask"));
+			entry.cmask = perfmon_number(e.get_text("CounterMask"));
+			entry.flags = (e.get_text("Invert") == "1" ? EVENT_INVERT : 0) | (e.get_text("EdgeDetect") == "1" ? EVENT_EDGE : 0) |
+				(e.get_text("AnyThread") == "1" ? EVENT_ANY_THREAD : 0);
+			entry.fixed = -1;
+			std::string counter = e.get_text("Counter");
+			std::transform(counter.begin(), counter.end(), counter.begin(), ::tolower);
+			if (counter.compare(0, 13, "fixed counter") == 0) {
+				entry.fixed = std::stoi(counter.substr(13));
+			} else {
+				for (const auto &n : split(counter, ','))
+					if (!trim(n).empty() && isdigit((unsigned char) trim(n)[0]) && std::stoi(trim(n)) < 8)
+						entry.counters |= 1 << std::stoi(trim(n));
+				if (!entry.counters)
+					entry.counters = 0xff;
+			}
+			entry.msr_index = perfmon_number(e.get_text("MSRIndex"));
+			entry.msr_value = perfmon_number(e.get_text("MSRValue"));
+
+			entry.name = strings.size();
+			entry.name_length = name.size();
+			strings += name;
+			strings += '\0';
+			entry.description = strings.size();
+			strings += e.get_text("BriefDescription");
+			strings += '\0';
+			entries.push_back(entry);
+			names.push_back(name);
+		}
+	}
+
+	// hash and displace: fill the largest buckets first, trying seeds until all their names land on free slots
+	const size_t num_events = entries.size();
+	const size_t num_buckets = (num_events / 4 + 2) & ~(size_t) 1;
+	const size_t num_slots = num_events + num_events / 4 + 1;
+	std::vector<std::vector<size_t>> buckets(num_buckets);
+	for (size_t i = 0; i < num_events; ++i)
+		buckets[event_name_hash(names[i].data(), names[i].size(), 0) % num_buckets].push_back(i);
+	std::vector<size_t> order(num_buckets);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return buckets[a].size() > buckets[b].size();
+	});
+
+	std::vector<u_int32_t> seeds(num_buckets, 0);
+	std::vector<event_index_entry_t> slots(num_slots);
+	memset(slots.data(), 0, slots.size() * sizeof(event_index_entry_t));
+	std::vector<bool> taken(num_slots);
+	std::vector<size_t> placed;
+	for (size_t b : order) {
+		if (buckets[b].empty())
+			break;
+		u_int32_t seed = 1;
+		for (;; ++seed) {
+			if (seed == 0)
+				throw std::runtime_error("failed to build a perfect hash of the event names");
+			placed.clear();
+			for (size_t i : buckets[b]) {
+				const size_t slot = event_name_hash(names[i].data(), names[i].size(), seed) % num_slots;
+				if (taken[slot] || std::find(placed.begin(), placed.end(), slot) != placed.end())
+					break;
+				placed.push_back(slot);
+			}
+			if (placed.size() == buckets[b].size())
+				break;
+		}
+		seeds[b] = seed;
+		for (size_t j = 0; j < placed.size(); ++j) {
+			taken[placed[j]] = true;
+			slots[placed[j]] = entries[buckets[b][j]];
+		}
+	}
+
+	event_index_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, EVENT_INDEX_MAGIC, sizeof(h.magic));
+	h.version = EVENT_INDEX_VERSION;
+	h.num_events = num_events;
+	h.num_slots = num_slots;
+	h.num_buckets = num_buckets;
+	h.strings_size = strings.size();
+
+	const int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("can't open " + output + ": " + strerror(errno));
+	write_fully(fd, (const char *) &h, sizeof(h));
+	write_fully(fd, (const char *) seeds.data(), seeds.size() * sizeof(u_int32_t));
+	write_fully(fd, (const char *) slots.data(), slots.size() * sizeof(event_index_entry_t));
+	write_fully(fd, strings.data(), strings.size());
+	close(fd);
+}
+
+// Read-only view of an event index, mapped into memory.
+struct event_index_t {
+private:
+	int fd;
+	const char *base;
+	size_t length;
+	const u_int32_t *seeds;
+	const event_index_entry_t *slots;
+	const char *strings;
+
+public:
+	event_index_header_t header;
+
+	event_index_t(const event_index_t &) = delete;
+	event_index_t &operator=(const event_index_t &) = delete;
+	event_index_t(const std::string &path)
+		: fd(-1), base(NULL), length(0) {
+		fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(event_index_header_t))
+			throw std::runtime_error(path + " is not an event index");
+		length = st.st_size;
+		void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			throw std::runtime_error("can't map " + path + ": " + strerror(errno));
+		base = (const char *) p;
+
+		memcpy(&header, base, sizeof(header));
+		if (memcmp(header.magic, EVENT_INDEX_MAGIC, sizeof(EVENT_INDEX_MAGIC)) != 0 || header.version != EVENT_INDEX_VERSION)
+			throw std::runtime_error(path + " is not an event index of a supported version");
+		if (header.num_buckets == 0 || header.num_slots == 0 || header.strings_size == 0 ||
+		    sizeof(header) + (u_int64_t) header.num_buckets * sizeof(u_int32_t) + (u_int64_t) header.num_slots * sizeof(event_index_entry_t) +
+		    header.strings_size != length)
+			throw std::runtime_error(path + " is corrupt");
+		seeds = (const u_int32_t *) (base + sizeof(header));
+		slots = (const event_index_entry_t *) (seeds + header.num_buckets);
+		strings = (const char *) (slots + header.num_slots);
+		// every name and description lies within the string table and is terminated, so lookups can trust them
+		if (strings[header.strings_size - 1] != '\0')
+			throw std::runtime_error(path + " is corrupt");
+		for (u_int32_t i = 0; i < header.num_slots; ++i) {
+			const event_index_entry_t &entry = slots[i];
+			if (entry.name_length && ((u_int64_t) entry.name + entry.name_length >= header.strings_size ||
+			                          strings[entry.name + entry.name_length] != '\0' || entry.description >= header.strings_size))
+				throw std::runtime_error(path + " is corrupt");
+		}
+	}
+	~event_index_t() {
+		if (base)
+			munmap((void *) base, length);
+		if (fd >= 0)
+			close(fd);
+	}
+
+public:
+	// looks up an event by its name, in any case; NULL if it isn't in the index
+	const event_index_entry_t *find(std::string name) const {
+		std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+		const u_int32_t seed = seeds[event_name_hash(name.data(), name.size(), 0) % header.num_buckets];
+		const event_index_entry_t *entry = &slots[event_name_hash(name.data(), name.size(), seed) % header.num_slots];
+		if (entry->name_length != name.size() || memcmp(strings + entry->name, name.data(), name.size()) != 0)
+			return NULL;
+		return entry;
+	}
+
+	size_t num_slots() const {
+		return header.num_slots;
+	}
+
+	// NULL for an empty slot
+	const event_index_entry_t *slot(size_t i) const {
+		return slots[i].name_length ? &slots[i] : NULL;
+	}
+
+	const char *string(u_int32_t offset) const {
+		return strings + offset;
+	}
+
+	// the event as programmed into a general-purpose counter; names point into the index
+	pmc_event_type_t event(const event_index_entry_t &entry) const {
+		pmc_event_type_t event(entry.event, entry.umask, string(entry.name), entry.cmask, entry.flags & EVENT_INVERT,
+			entry.flags & EVENT_EDGE, entry.counters);
+		event.msr_index = entry.msr_index;
+		event.msr_value = entry.msr_value;
+		return event;
+	}
+};
+
+void print_index_entry(FILE *out, const event_index_t &index, const event_index_entry_t &entry) {
+	fprintf(out, "%-48s event=0x%02x umask=0x%02x", index.string(entry.name), entry.event, entry.umask);
+	if (entry.cmask)
+		fprintf(out, " cmask=%d", entry.cmask);
+	if (entry.flags & EVENT_INVERT)
+		fprintf(out, " inv");
+	if (entry.flags & EVENT_EDGE)
+		fprintf(out, " edge");
+	if (entry.msr_index)
+		fprintf(out, " msr=0x%x:0x%llx", entry.msr_index, (unsigned long long) entry.msr_value);
+	if (entry.fixed >= 0) {
+		fprintf(out, " fixed=%d", entry.fixed);
+	} else if (entry.counters != 0xff) {
+		fprintf(out, " counters=");
+		for (int n = 0; n < 8; ++n)
+			if (entry.counters & (1 << n))
+				fprintf(out, "%d", n);
+	}
+	fprintf(out, "\n    %s\n", index.string(entry.description));
+}
+
+int events_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"index", required_argument, NULL, 'x'},
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string index_path = DEFAULT_EVENT_INDEX;
+	int c;
+	while ((c = getopt_long(argc, argv, "+x:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'x':
+			index_path = optarg;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	const std::string command = optind < argc ? argv[optind] : "";
+	if (command != "compile" && command != "list") {
+		std::cerr << "Usage: core-port-stat events [--index=INDEX] compile JSON...\n"
+			"       core-port-stat events [--index=INDEX] list [PATTERN]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		if (command == "compile") {
+			compile_event_index(std::vector<std::string>(argv + optind + 1, argv + argc), index_path);
+			const event_index_t index(index_path);
+			printf("%s: %u events\n", index_path.c_str(), index.header.num_events);
+		} else {
+			const event_index_t index(index_path);
+			std::string pattern = optind + 1 < argc ? argv[optind + 1] : "*";
+			std::transform(pattern.begin(), pattern.end(), pattern.begin(), ::toupper);
+			if (const event_index_entry_t *entry = index.find(pattern)) {
+				print_index_entry(stdout, index, *entry);
+				return EXIT_SUCCESS;
+			}
+			std::vector<const event_index_entry_t *> matches;
+			for (size_t i = 0; i < index.num_slots(); ++i)
+				if (index.slot(i) && match_mnemonic(pattern.c_str(), index.string(index.slot(i)->name)))
+					matches.push_back(index.slot(i));
+			std::sort(matches.begin(), matches.end(), [&](const event_index_entry_t *a, const event_index_entry_t *b) {
+				return strcmp(index.string(a->name), index.string(b->name)) < 0;
+			});
+			for (const auto *entry : matches)
+				print_index_entry(stdout, index, *entry);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Resolves a perf event name to an encoding: raw "r01a1", "cpu/event=0xa1,umask=0x01,any=1/", or a name from the
+// event table such as "uops_dispatched_port.port_0". Returns false for events it doesn't know.
+bool parse_perf_event(const std::string &name, pmc_event_type_t &event) {
+	std::string lower = name;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	// drop modifiers such as ":u" or ":k"
+	lower = lower.substr(0, lower.find(':'));
+
+	std::vector<pmc_event_type_t> known_events(UOPS_DISPATCHED_PORT, UOPS_DISPATCHED_PORT + NUM_PORTS);
+	known_events.insert(known_events.end(), FIXED_EVENTS, FIXED_EVENTS + length_of(FIXED_EVENTS));
+	for (const auto &known : known_events) {
+		std::string known_lower = known.name;
+		std::transform(known_lower.begin(), known_lower.end(), known_lower.begin(), ::tolower);
+		if (lower == known_lower) {
+			event = known;
+			return true;
+		}
+	}
+
+	bool found = false;
+	if (lower.size() > 1 && lower[0] == 'r' && lower.find_first_not_of("0123456789abcdef", 1) == std::string::npos) {
+		const unsigned long config = std::stoul(lower.substr(1), NULL, 16);
+		event.event = config & 0xff;
+		event.umask = (config >> 8) & 0xff;
+		found = true;
+	} else if (lower.compare(0, 4, "cpu/") == 0 && lower.back() == '/') {
+		event.event = event.umask = 0;
+		for (const auto &term : split(lower.substr(4, lower.size() - 5), ',')) {
+			const auto eq = term.find('=');
+			if (eq == std::string::npos)
+				continue;
+			const std::string key = term.substr(0, eq);
+			const int value = std::stoi(term.substr(eq + 1), NULL, 0);
+			if (key == "event") {
+				event.event = value;
+				found = true;
+			} else if (key == "umask") {
+				event.umask = value;
+			}
+		}
+	}
+
+	// raw encodings of known events get their names
+	for (const auto &known : known_events)
+		if (found && known.event == event.event && known.umask == event.umask)
+			event.name = known.name;
+	return found;
+}
+
+// Name of a microarchitecture by CPU family and model, for grouping captures of different hosts.
+std::string microarchitecture(u_int32_t family, u_int32_t model) {
+	static const struct {
+		u_int32_t model;
+		const char *name;
+	} MODELS[] = {
+		{42, "Sandy Bridge"}, {45, "Sandy Bridge-EP"}, {58, "Ivy Bridge"}, {62, "Ivy Bridge-EP"},
+		{60, "Haswell"}, {63, "Haswell-EP"}, {69, "Haswell"}, {70, "Haswell"},
+		{61, "Broadwell"}, {71, "Broadwell"}, {79, "Broadwell-EP"}, {86, "Broadwell-DE"},
+		{78, "Skylake"}, {94, "Skylake"}, {85, "Skylake-SP"}, {142, "Kaby Lake"}, {158, "Coffee Lake"},
+	};
+	if (family == 6)
+		for (const auto &m : MODELS)
+			if (m.model == model)
+				return m.name;
+	return "family " + std::to_string(family) + " model " + std::to_string(model);
+}
+
+// Utilization histogram bins growing by 1% each from 0.01%, past 4,000,000%: ports stay under 100%, but fixed-counter and
+// named events count many times the TSC cycles (instructions, uops at 4 per cycle, both threads' cycles).
+static const size_t MERGE_BINS = 2000;
+static const double MERGE_BIN_MIN = 0.01;  // the upper edge of the first bin, which holds everything below it
+static const double MERGE_BIN_GROWTH = 1.01;
+
+// Mergeable sketch of a distribution of utilizations, weighted by core-seconds: the exact weight in each bin, so that
+// sketches of any subsets of the intervals add up to the sketch of their union. The bins are log-spaced, so a
+// percentile is within 1% of the true value whatever the event's range.
+struct utilization_sketch_t {
+	std::vector<double> bins;
+	double weight;
+	double sum;
+	double max;
+
+	utilization_sketch_t()
+		: bins(MERGE_BINS), weight(0), sum(0), max(0) {}
+
+	void add(double util, double w) {
+		const size_t bin = util < MERGE_BIN_MIN ? 0 : std::min<size_t>(1 + log(util / MERGE_BIN_MIN) / log(MERGE_BIN_GROWTH), MERGE_BINS - 1);
+		bins[bin] += w;
+		weight += w;
+		sum += util * w;
+		max = std::max(max, util);
+	}
+
+	void merge(const utilization_sketch_t &other) {
+		for (size_t i = 0; i < MERGE_BINS; ++i)
+			bins[i] += other.bins[i];
+		weight += other.weight;
+		sum += other.sum;
+		max = std::max(max, other.max);
+	}
+
+	// upper edge of the bin holding quantile q in [0, 1]
+	double quantile(double q) const {
+		const double target = q * weight;
+		double cumulative = 0;
+		for (size_t i = 0; i < MERGE_BINS; ++i) {
+			cumulative += bins[i];
+			if (cumulative >= target && cumulative > 0)
+				return std::min(MERGE_BIN_MIN * pow(MERGE_BIN_GROWTH, i), max);
+		}
+		return max;
+	}
+};
+
+// Intervals of the captures sharing the grouping attributes, one sketch per event name.
+struct merge_group_t {
+	std::map<std::string, utilization_sketch_t> events;
+	std::set<std::string> hosts;
+	size_t captures;
+	double core_seconds;
+
+	merge_group_t()
+		: captures(0), core_seconds(0) {}
+
+	void merge(const merge_group_t &other) {
+		for (const auto &e : other.events)
+			events[e.first].merge(e.second);
+		hosts.insert(other.hosts.begin(), other.hosts.end());
+		captures += other.captures;
+		core_seconds += other.core_seconds;
+	}
+};
+
+typedef std::map<std::string, merge_group_t> merge_groups_t;
+
+// Values of the grouping attributes (uarch, model, host, cores or packages) of a capture.
+std::string merge_group_key(const capture_t &capture, const std::vector<std::string> &by) {
+	std::string key;
+	for (const auto &attribute : by) {
+		if (!key.empty())
+			key += ", ";
+		key += attribute + "=";
+		if (attribute == "uarch")
+			key += microarchitecture(capture.header.cpu_family, capture.header.cpu_model);
+		else if (attribute == "model")
+			key += std::to_string(capture.header.cpu_family) + ":" + std::to_string(capture.header.cpu_model);
+		else if (attribute == "host")
+			key += std::string(capture.header.hostname, strnlen(capture.header.hostname, sizeof(capture.header.hostname)));
+		else if (attribute == "cores")
+			key += std::to_string(capture.header.num_cores);
+		else
+			key += std::to_string(std::set<int>(capture.packages.begin(), capture.packages.end()).size());
+	}
+	return key.empty() ? "all" : key;
+}
+
+// Folds the intervals of a capture between from and to into groups. Every core of every interval is one sample of
+// its utilization, weighted by the interval's length in seconds, so hosts count by core-seconds whatever their core
+// count and sampling interval.
+void merge_capture(const std::string &path, const std::string &from, const std::string &to, const std::vector<std::string> &by,
+                   merge_groups_t &groups) {
+	const capture_t capture(path);
+	capture.advise_sequential();
+	size_t first, last;
+	capture_range(capture, from, to, first, last);
+	if (!capture.header.tsc_hz)
+		throw std::runtime_error(path + " has no TSC frequency");
+
+	merge_group_t &group = groups[merge_group_key(capture, by)];
+	group.hosts.insert(std::string(capture.header.hostname, strnlen(capture.header.hostname, sizeof(capture.header.hostname))));
+	++group.captures;
+	// resolved once, so that the samples don't look up names
+	std::vector<utilization_sketch_t *> sketches;
+	for (const auto &event : capture.events)
+		sketches.push_back(&group.events[std::string(event.name, strnlen(event.name, sizeof(event.name)))]);
+
+	const u_int32_t num_cores = capture.header.num_cores, num_events = capture.header.num_events;
+	for (size_t r = first + 1; r <= last; ++r) {
+		const u_int64_t tsc_delta = capture.tsc(r) - capture.tsc(r - 1);
+		if (!tsc_delta || !capture.continues(r))
+			continue;
+		const double seconds = tsc_delta / (double) capture.header.tsc_hz;
+		const u_int64_t *counts = capture.counts(r);
+		const u_int64_t *counts0 = capture.counts(r - 1);
+		for (u_int32_t core = 0; core < num_cores; ++core)
+			for (u_int32_t e = 0; e < num_events; ++e) {
+				const size_t j = core * num_events + e;
+				sketches[e]->add((counts[j] - counts0[j]) / (double) tsc_delta * 100, seconds);
+			}
+		group.core_seconds += seconds * num_cores;
+	}
+}
+
+// Runs tasks 0..num_tasks-1 on num_threads workers. Each worker takes tasks from the back of its own deque and, once
+// that is empty, steals from the front of the others', so a few large tasks don't leave the other workers idle.
+template <typename task_fn_t>
+void run_work_stealing(size_t num_tasks, size_t num_threads, const task_fn_t &run_task) {
+	struct worker_t {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+	std::vector<worker_t> workers(num_threads);
+	for (size_t task = 0; task < num_tasks; ++task)
+		workers[task % num_threads].tasks.push_back(task);
+
+	auto take = [&workers](size_t w, bool own, size_t &task) {
+		std::lock_guard<std::mutex> lock(workers[w].mutex);
+		if (workers[w].tasks.empty())
+			return false;
+		if (own) {
+			task = workers[w].tasks.back();
+			workers[w].tasks.pop_back();
+		} else {
+			task = workers[w].tasks.front();
+			workers[w].tasks.pop_front();
+		}
+		return true;
+	};
+	std::vector<std::thread> threads;
+	for (size_t w = 0; w < num_threads; ++w) {
+		threads.emplace_back([&, w]() {
+			size_t task;
+			for (;;) {
+				bool found = take(w, true, task);
+				// tasks are never added, so a full round without any means they are all taken
+				for (size_t i = 1; !found && i < num_threads; ++i)
+					found = take((w + i) % num_threads, false, task);
+				if (!found)
+					break;
+				run_task(task, w);
+			}
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+}
+
+// percentiles printed by default
+static const char DEFAULT_MERGE_QUANTILES[] = "50,90,99";
+
+int merge_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"from", required_argument, NULL, 'F'},
+		{"to", required_argument, NULL, 'T'},
+		{"by", required_argument, NULL, 'b'},
+		{"quantiles", required_argument, NULL, 'q'},
+		{"threads", required_argument, NULL, 'j'},
+		{"ndjson", no_argument, NULL, 'n'},
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string from, to, by_list = "uarch", quantile_list = DEFAULT_MERGE_QUANTILES;
+	size_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	bool ndjson = false;
+	int c;
+	while ((c = getopt_long(argc, argv, "F:T:b:q:j:n", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'F':
+			from = optarg;
+			break;
+		case 'T':
+			to = optarg;
+			break;
+		case 'b':
+			by_list = optarg;
+			break;
+		case 'q':
+			quantile_list = optarg;
+			break;
+		case 'j':
+			num_threads = std::max(atoi(optarg), 1);
+			break;
+		case 'n':
+			ndjson = true;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		std::cerr << "Usage: core-port-stat merge [--from=TIME] [--to=TIME] [--by=ATTR,...] [--quantiles=PCT,...] [--threads=N] [--ndjson] CAPTURE..." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::string> by;
+	std::vector<double> quantiles;
+	try {
+		std::stringstream attributes(by_list);
+		for (std::string attribute; std::getline(attributes, attribute, ',');)
+			if (attribute == "uarch" || attribute == "model" || attribute == "host" || attribute == "cores" || attribute == "packages")
+				by.push_back(attribute);
+			else if (attribute != "none")
+				throw std::runtime_error("unknown grouping attribute: " + attribute);
+		std::stringstream percentiles(quantile_list);
+		for (std::string pct; std::getline(percentiles, pct, ',');) {
+			quantiles.push_back(std::stod(pct));
+			if (quantiles.back() < 0 || quantiles.back() > 100)
+				throw std::runtime_error("quantile must be in [0, 100]: " + pct);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid argument: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const std::vector<std::string> paths(argv + optind, argv + argc);
+	num_threads = std::min(num_threads, paths.size());
+	// each worker folds into its own groups, merged once at the end
+	std::vector<merge_groups_t> partial(num_threads);
+	std::vector<std::string> errors(paths.size());
+	run_work_stealing(paths.size(), num_threads, [&](size_t task, size_t worker) {
+		try {
+			merge_capture(paths[task], from, to, by, partial[worker]);
+		} catch (const std::exception &e) {
+			errors[task] = e.what();
+		}
+	});
+
+	merge_groups_t groups;
+	for (const auto &worker : partial)
+		for (const auto &g : worker)
+			groups[g.first].merge(g.second);
+	size_t skipped = 0;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (!errors[i].empty()) {
+			std::cerr << "skipping " << paths[i] << ": " << errors[i] << std::endl;
+			++skipped;
+		}
+	}
+	if (skipped == paths.size())
+		return EXIT_FAILURE;
+
+	std::string text;
+	json_writer_t json;
+	char buf[256];
+	for (const auto &g : groups) {
+		const merge_group_t &group = g.second;
+		if (ndjson) {
+			json.begin_object().key("group").value(g.first.c_str());
+			json.key("captures").value((u_int64_t) group.captures).key("hosts").value((u_int64_t) group.hosts.size());
+			json.key("core_seconds").value(group.core_seconds, 1).key("events").begin_object();
+			for (const auto &e : group.events) {
+				json.key(e.first.c_str()).begin_object().key("mean").value(e.second.weight ? e.second.sum / e.second.weight : 0.0, 2);
+				for (double q : quantiles) {
+					snprintf(buf, sizeof(buf), "p%g", q);
+					json.key(buf).value(e.second.quantile(q / 100), 1);
+				}
+				json.key("max").value(e.second.max, 2).end_object();
+			}
+			json.end_object().end_object().newline();
+			continue;
+		}
+		snprintf(buf, sizeof(buf), "%s: %zu captures from %zu hosts, %.1f core-hours\n",
+			g.first.c_str(), group.captures, group.hosts.size(), group.core_seconds / 3600);
+		text += buf;
+		snprintf(buf, sizeof(buf), "  %-40s %7s", "event (utilization %)", "mean");
+		text += buf;
+		for (double q : quantiles) {
+			char label[32];
+			snprintf(label, sizeof(label), "p%g", q);
+			snprintf(buf, sizeof(buf), " %7s", label);
+			text += buf;
+		}
+		text += "     max\n";
+		for (const auto &e : group.events) {
+			snprintf(buf, sizeof(buf), "  %-40s %7.2f", e.first.c_str(), e.second.weight ? e.second.sum / e.second.weight : 0.0);
+			text += buf;
+			for (double q : quantiles) {
+				snprintf(buf, sizeof(buf), " %7.1f", e.second.quantile(q / 100));
+				text += buf;
+			}
+			snprintf(buf, sizeof(buf), " %7.2f\n", e.second.max);
+			text += buf;
+		}
+	}
+	if (ndjson)
+		fwrite(json.data(), 1, json.size(), stdout);
+	else
+		fwrite(text.data(), 1, text.size(), stdout);
+	return EXIT_SUCCESS;
+}
+
+// A query reads a capture as the table of its samples, one row per interval, core and event, with the columns time
+// (the end of the interval), core, socket, event, port (of a UOPS_DISPATCHED_PORT event, -1 for the others), util
+// (the fraction of TSC cycles the event counted) and delta (its count):
+//
+//   select ITEM, ... [where CONDITION and ...] [group by COLUMN, ...] [window DURATION]
+//
+// An ITEM is a grouping column, time (the start of the window) or an aggregate: count(*), sum, mean (or avg), min or
+// max of util or delta, or a percentile such as p99(util). A CONDITION compares a column with a number, or the event
+// or time with a quoted name or time (see parse_capture_time).
+enum query_column_t { QUERY_TIME, QUERY_CORE, QUERY_SOCKET, QUERY_EVENT, QUERY_PORT, QUERY_UTIL, QUERY_DELTA, NUM_QUERY_COLUMNS };
+static const char *const QUERY_COLUMNS[NUM_QUERY_COLUMNS] = {"time", "core", "socket", "event", "port", "util", "delta"};
+
+enum query_op_t { QUERY_EQ, QUERY_NE, QUERY_LT, QUERY_LE, QUERY_GT, QUERY_GE };
+static const char *const QUERY_OPS[] = {"=", "!=", "<", "<=", ">", ">="};
+
+enum query_aggregate_t { QUERY_VALUE, QUERY_COUNT, QUERY_SUM, QUERY_MEAN, QUERY_MIN, QUERY_MAX, QUERY_QUANTILE };
+
+struct query_item_t {
+	query_aggregate_t aggregate;
+	query_column_t column;
+	double quantile;  // in [0, 1]
+	std::string label;
+};
+
+struct query_condition_t {
+	query_column_t column;
+	query_op_t op;
+	double number;
+	std::string text;  // literal as written, resolved against the capture for event and time
+};
+
+struct query_t {
+	std::vector<query_item_t> items;
+	std::vector<query_condition_t> conditions;
+	std::vector<query_column_t> group_by;
+	u_int64_t window_ns;  // 0 for none
+};
+
+// Splits a query into words, numbers (with any unit and sign), quoted strings (with their quotes), operators and punctuation.
+std::vector<std::string> tokenize_query(const std::string &s) {
+	std::vector<std::string> tokens;
+	for (size_t i = 0; i < s.size();) {
+		const char c = s[i];
+		if (isspace((unsigned char) c)) {
+			++i;
+		} else if (c == '\'' || c == '"') {
+			const size_t end = s.find(c, i + 1);
+			if (end == std::string::npos)
+				throw std::runtime_error("unterminated string in query");
+			tokens.push_back(s.substr(i, end + 1 - i));
+			i = end + 1;
+		} else if (isalnum((unsigned char) c) || c == '_' || c == '.' || (c == '-' && i + 1 < s.size() && isdigit((unsigned char) s[i + 1]))) {
+			size_t end = i + 1;
+			while (end < s.size() && (isalnum((unsigned char) s[end]) || s[end] == '_' || s[end] == '.'))
+				++end;
+			tokens.push_back(s.substr(i, end - i));
+			i = end;
+		} else if (c == '<' || c == '>' || c == '!' || c == '=') {
+			const size_t n = i + 1 < s.size() && s[i + 1] == '=' ? 2 : 1;
+			tokens.push_back(s.substr(i, n));
+			i += n;
+		} else if (c == ',' || c == '(' || c == ')' || c == '*') {
+			tokens.push_back(std::string(1, c));
+			++i;
+		} else {
+			throw std::runtime_error(std::string("unexpected '") + c + "' in query");
+		}
+	}
+	return tokens;
+}
+
+struct query_parser_t {
+private:
+	std::vector<std::string> tokens;
+	size_t pos;
+
+	static std::string lower(std::string s) {
+		std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+		return s;
+	}
+
+	bool at_end() const {
+		return pos >= tokens.size();
+	}
+
+	const std::string &peek() const {
+		static const std::string END;
+		return at_end() ? END : tokens[pos];
+	}
+
+	std::string next() {
+		if (at_end())
+			throw std::runtime_error("unexpected end of query");
+		return tokens[pos++];
+	}
+
+	// consumes the next token if it is the keyword or symbol, ignoring case
+	bool accept(const char *word) {
+		if (at_end() || lower(tokens[pos]) != word)
+			return false;
+		++pos;
+		return true;
+	}
+
+	void expect(const char *word) {
+		if (!accept(word))
+			throw std::runtime_error(std::string("expected '") + word + "' at '" + peek() + "'");
+	}
+
+	query_column_t column(const std::string &name) {
+		const std::string n = lower(name);
+		for (int c = 0; c < NUM_QUERY_COLUMNS; ++c)
+			if (n == QUERY_COLUMNS[c])
+				return (query_column_t) c;
+		if (n == "package")
+			return QUERY_SOCKET;
+		throw std::runtime_error("unknown column: " + name);
+	}
+
+	query_item_t item() {
+		query_item_t item;
+		item.quantile = 0;
+		const std::string name = next();
+		if (!accept("(")) {
+			item.aggregate = QUERY_VALUE;
+			item.column = column(name);
+			item.label = QUERY_COLUMNS[item.column];
+			return item;
+		}
+		const std::string function = lower(name);
+		if (function == "count" && accept("*")) {
+			item.aggregate = QUERY_COUNT;
+			item.column = QUERY_UTIL;
+			expect(")");
+			item.label = "count(*)";
+			return item;
+		}
+		item.column = column(next());
+		expect(")");
+		if (item.column != QUERY_UTIL && item.column != QUERY_DELTA)
+			throw std::runtime_error("only util and delta can be aggregated");
+		if (function == "count")
+			item.aggregate = QUERY_COUNT;
+		else if (function == "sum")
+			item.aggregate = QUERY_SUM;
+		else if (function == "mean" || function == "avg")
+			item.aggregate = QUERY_MEAN;
+		else if (function == "min")
+			item.aggregate = QUERY_MIN;
+		else if (function == "max")
+			item.aggregate = QUERY_MAX;
+		else if (function.size() > 1 && function[0] == 'p' && isdigit((unsigned char) function[1])) {
+			item.aggregate = QUERY_QUANTILE;
+			item.quantile = std::stod(function.substr(1)) / 100;
+			if (item.quantile > 1)
+				throw std::runtime_error("percentile above 100: " + name);
+			if (item.column != QUERY_UTIL)
+				throw std::runtime_error("percentiles are of util");
+		} else
+			throw std::runtime_error("unknown aggregate: " + name);
+		item.label = function + "(" + QUERY_COLUMNS[item.column] + ")";
+		return item;
+	}
+
+	query_condition_t condition() {
+		query_condition_t condition;
+		condition.column = column(next());
+		const std::string op = next();
+		const size_t num_ops = sizeof(QUERY_OPS) / sizeof(QUERY_OPS[0]);
+		const size_t o = std::find(QUERY_OPS, QUERY_OPS + num_ops, op) - QUERY_OPS;
+		if (o == num_ops)
+			throw std::runtime_error("expected a comparison at '" + op + "'");
+		condition.op = (query_op_t) o;
+		const std::string literal = next();
+		condition.number = 0;
+		if (literal[0] == '\'' || literal[0] == '"') {
+			condition.text = literal.substr(1, literal.size() - 2);
+			if (condition.column != QUERY_EVENT && condition.column != QUERY_TIME)
+				throw std::runtime_error(std::string(QUERY_COLUMNS[condition.column]) + " is compared with a number");
+		} else {
+			char *end;
+			condition.text = literal;
+			condition.number = strtod(literal.c_str(), &end);
+			if (*end || !isdigit((unsigned char) literal[literal[0] == '-']) || condition.column == QUERY_EVENT)
+				throw std::runtime_error("invalid value: " + literal);
+		}
+		if (condition.column == QUERY_EVENT && condition.op != QUERY_EQ && condition.op != QUERY_NE)
+			throw std::runtime_error("events are compared with = or !=");
+		return condition;
+	}
+
+public:
+	query_parser_t(const std::string &text)
+		: tokens(tokenize_query(text)), pos(0) {}
+
+	query_t parse() {
+		query_t query;
+		query.window_ns = 0;
+		expect("select");
+		do
+			query.items.push_back(item());
+		while (accept(","));
+		if (accept("where")) {
+			do
+				query.conditions.push_back(condition());
+			while (accept("and"));
+		}
+		if (accept("group")) {
+			expect("by");
+			do {
+				const query_column_t c = column(next());
+				if (c == QUERY_TIME || c == QUERY_UTIL || c == QUERY_DELTA)
+					throw std::runtime_error(std::string("can't group by ") + QUERY_COLUMNS[c] + (c == QUERY_TIME ? ", use window" : ""));
+				query.group_by.push_back(c);
+			} while (accept(","));
+		}
+		if (accept("window")) {
+			const std::string duration = next();
+			if (!isdigit((unsigned char) duration[0]))
+				throw std::runtime_error("invalid window: " + duration);
+			query.window_ns = parse_duration_ns(duration);
+			if (!query.window_ns)
+				throw std::runtime_error("window must be positive");
+		}
+		if (!at_end())
+			throw std::runtime_error("unexpected '" + peek() + "' in query");
+
+		for (const auto &item : query.items) {
+			if (item.aggregate != QUERY_VALUE)
+				continue;
+			if (item.column == QUERY_TIME ? !query.window_ns : std::find(query.group_by.begin(), query.group_by.end(), item.column) == query.group_by.end())
+				throw std::runtime_error(std::string(QUERY_COLUMNS[item.column]) + " is neither grouped by nor aggregated");
+		}
+		return query;
+	}
+};
+
+// Aggregates of one group. Utilizations are kept exactly for percentiles until there are MERGE_BINS of them, then
+// folded into a sketch, so memory stays bounded however many rows a group has.
+struct query_state_t {
+	u_int64_t count;
+	double sum[2], min[2], max[2];  // of util and delta
+	std::vector<float> utils;
+	std::unique_ptr<utilization_sketch_t> sketch;
+
+	query_state_t()
+		: count(0) {
+		sum[0] = sum[1] = 0;
+		min[0] = min[1] = INFINITY;
+		max[0] = max[1] = -INFINITY;
+	}
+
+	void add(double util, double delta, bool quantiles) {
+		++count;
+		const double v[2] = {util, delta};
+		for (int i = 0; i < 2; ++i) {
+			sum[i] += v[i];
+			min[i] = std::min(min[i], v[i]);
+			max[i] = std::max(max[i], v[i]);
+		}
+		if (!quantiles)
+			return;
+		if (sketch) {
+			sketch->add(util * 100, 1);
+			return;
+		}
+		utils.push_back(util);
+		if (utils.size() == MERGE_BINS) {
+			sketch.reset(new utilization_sketch_t);
+			for (float u : utils)
+				sketch->add(u * 100, 1);
+			utils.clear();
+			utils.shrink_to_fit();
+		}
+	}
+
+	double quantile(double q) {
+		if (sketch)
+			return sketch->quantile(q) / 100;
+		if (utils.empty())
+			return NAN;
+		// nearest rank
+		const size_t rank = std::min<size_t>(std::max(std::ceil(q * utils.size()), 1.0) - 1, utils.size() - 1);
+		std::nth_element(utils.begin(), utils.begin() + rank, utils.end());
+		return utils[rank];
+	}
+};
+
+// window start (if any), then the group by columns
+typedef std::map<std::vector<int64_t>, query_state_t> query_groups_t;
+
+bool query_compare(double value, query_op_t op, double operand) {
+	switch (op) {
+	case QUERY_EQ:
+		return value == operand;
+	case QUERY_NE:
+		return value != operand;
+	case QUERY_LT:
+		return value < operand;
+	case QUERY_LE:
+		return value <= operand;
+	case QUERY_GT:
+		return value > operand;
+	default:
+		return value >= operand;
+	}
+}
+
+// rows (intervals) of a capture processed at a time, column by column
+static const size_t QUERY_BLOCK_ROWS = 1024;
+
+// Runs a query over a capture, vectorized: the time conditions become a range of records found by bisection; the
+// core, socket, event and port conditions select the counters once; then for each block of intervals, each selected
+// counter's column of utilizations and deltas is computed, filtered into a selection vector by the util and delta
+// conditions and aggregated.
+void execute_query(const query_t &query, const capture_t &capture, const std::vector<int> &ports, query_groups_t &groups) {
+	if (capture.num_records < 2)
+		return;
+	const size_t num_events = capture.header.num_events, num_counters = capture.num_counters();
+
+	// rows begin..end-1 are the intervals ending at those records
+	size_t begin = 1, end = capture.num_records;
+	std::vector<const query_condition_t *> row_conditions;
+	std::vector<char> selected(num_counters, 1);
+	for (const auto &condition : query.conditions) {
+		if (condition.column == QUERY_TIME) {
+			const u_int64_t t = parse_capture_time(condition.text, capture);
+			switch (condition.op) {
+			case QUERY_EQ:
+				begin = std::max(begin, capture.lower_bound(t));
+				end = std::min(end, capture.lower_bound(t + 1));
+				break;
+			case QUERY_LT:
+				end = std::min(end, capture.lower_bound(t));
+				break;
+			case QUERY_LE:
+				end = std::min(end, capture.lower_bound(t + 1));
+				break;
+			case QUERY_GT:
+				begin = std::max(begin, capture.lower_bound(t + 1));
+				break;
+			case QUERY_GE:
+				begin = std::max(begin, capture.lower_bound(t));
+				break;
+			default:
+				throw std::runtime_error("time is compared with =, <, <=, > or >=");
+			}
+			continue;
+		}
+		if (condition.column == QUERY_UTIL || condition.column == QUERY_DELTA) {
+			row_conditions.push_back(&condition);
+			continue;
+		}
+		for (size_t j = 0; j < num_counters; ++j) {
+			const size_t core = j / num_events, e = j % num_events;
+			bool match;
+			if (condition.column == QUERY_EVENT) {
+				const capture_event_t &event = capture.events[e];
+				match = (condition.text == std::string(event.name, strnlen(event.name, sizeof(event.name)))) == (condition.op == QUERY_EQ);
+			} else {
+				// each branch is a double, as the port of an event that isn't one is -1
+				const double value = condition.column == QUERY_CORE ? (double) core :
+					condition.column == QUERY_SOCKET ? (double) capture.packages[core] : (double) ports[e];
+				match = query_compare(value, condition.op, condition.number);
+			}
+			selected[j] = selected[j] && match;
+		}
+	}
+
+	bool quantiles = false;
+	for (const auto &item : query.items)
+		quantiles = quantiles || item.aggregate == QUERY_QUANTILE;
+
+	std::vector<const u_int64_t *> records(QUERY_BLOCK_ROWS + 1);
+	std::vector<u_int64_t> tsc_delta(QUERY_BLOCK_ROWS);
+	std::vector<int64_t> window(QUERY_BLOCK_ROWS);
+	std::vector<double> util(QUERY_BLOCK_ROWS), delta(QUERY_BLOCK_ROWS);
+	std::vector<u_int32_t> selection(QUERY_BLOCK_ROWS);
+	std::vector<int64_t> key(query.group_by.size() + 1);
+	for (size_t first = begin; first < end; first += QUERY_BLOCK_ROWS) {
+		const size_t n = std::min(QUERY_BLOCK_ROWS, end - first);
+		for (size_t k = 0; k <= n; ++k)
+			records[k] = capture.record(first - 1 + k);
+		// an interval that doesn't continue its record is left out like an empty one
+		for (size_t k = 0; k < n; ++k) {
+			tsc_delta[k] = capture.continues(first + k) ? records[k + 1][1] - records[k][1] : 0;
+			window[k] = query.window_ns ? records[k + 1][0] / query.window_ns * query.window_ns : 0;
+		}
+
+		for (size_t j = 0; j < num_counters; ++j) {
+			if (!selected[j])
+				continue;
+			const size_t column = CAPTURE_RECORD_HEADER + j;
+			size_t num_selected = 0;
+			for (size_t k = 0; k < n; ++k) {
+				delta[k] = records[k + 1][column] - records[k][column];
+				util[k] = tsc_delta[k] ? delta[k] / tsc_delta[k] : 0.0;
+				if (tsc_delta[k])
+					selection[num_selected++] = k;
+			}
+			for (const auto *condition : row_conditions) {
+				const std::vector<double> &values = condition->column == QUERY_UTIL ? util : delta;
+				size_t kept = 0;
+				for (size_t i = 0; i < num_selected; ++i)
+					if (query_compare(values[selection[i]], condition->op, condition->number))
+						selection[kept++] = selection[i];
+				num_selected = kept;
+			}
+			if (!num_selected)
+				continue;
+
+			const size_t core = j / num_events, e = j % num_events;
+			for (size_t g = 0; g < query.group_by.size(); ++g) {
+				switch (query.group_by[g]) {
+				case QUERY_CORE:
+					key[g + 1] = core;
+					break;
+				case QUERY_SOCKET:
+					key[g + 1] = capture.packages[core];
+					break;
+				case QUERY_EVENT:
+					key[g + 1] = e;
+					break;
+				default:
+					key[g + 1] = ports[e];
+					break;
+				}
+			}
+			// rows are in time order, so the group only changes with the window
+			query_state_t *state = NULL;
+			for (size_t i = 0; i < num_selected; ++i) {
+				const size_t k = selection[i];
+				if (!state || window[k] != key[0]) {
+					key[0] = window[k];
+					state = &groups[key];
+				}
+				state->add(util[k], delta[k], quantiles);
+			}
+		}
+	}
+}
+
+// Numeric value of an item for a group: its grouping column or aggregate.
+double query_number(const query_t &query, const query_item_t &item, const std::vector<int64_t> &key, query_state_t &state) {
+	const int i = item.column == QUERY_DELTA;
+	switch (item.aggregate) {
+	case QUERY_VALUE:
+		if (item.column == QUERY_TIME)
+			return key[0];
+		return key[1 + (std::find(query.group_by.begin(), query.group_by.end(), item.column) - query.group_by.begin())];
+	case QUERY_COUNT:
+		return state.count;
+	case QUERY_SUM:
+		return state.sum[i];
+	case QUERY_MEAN:
+		return state.sum[i] / state.count;
+	case QUERY_MIN:
+		return state.min[i];
+	case QUERY_MAX:
+		return state.max[i];
+	default:
+		return state.quantile(item.quantile);
+	}
+}
+
+// whether an item is a time or event name rather than a number
+bool query_is_name(const query_item_t &item) {
+	return item.aggregate == QUERY_VALUE && (item.column == QUERY_TIME || item.column == QUERY_EVENT);
+}
+
+// whether an item's values are whole: counts, cores, sockets and ports, and sums and extremes of deltas
+bool query_is_integral(const query_item_t &item) {
+	return item.aggregate == QUERY_COUNT || (item.aggregate == QUERY_VALUE && item.column != QUERY_TIME && item.column != QUERY_EVENT) ||
+		(item.column == QUERY_DELTA && item.aggregate != QUERY_MEAN);
+}
+
+std::string query_name(const query_item_t &item, const capture_t &capture, double value) {
+	if (item.column == QUERY_TIME)
+		return format_time_ns(value);
+	const capture_event_t &event = capture.events[(size_t) value];
+	return std::string(event.name, strnlen(event.name, sizeof(event.name)));
+}
+
+int query_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"ndjson", no_argument, NULL, 'n'},
+		{NULL, 0, NULL, 0},
+	};
+
+	bool ndjson = false;
+	int c;
+	while ((c = getopt_long(argc, argv, "n", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			ndjson = true;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind + 2 != argc) {
+		std::cerr << "Usage: core-port-stat query [--ndjson] CAPTURE 'select ITEM, ... [where CONDITION and ...] [group by COLUMN, ...] [window DURATION]'" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		const query_t query = query_parser_t(argv[optind + 1]).parse();
+		const capture_t capture(argv[optind]);
+		std::vector<int> ports(capture.header.num_events, -1);
+		for (size_t port = 0; port < NUM_PORTS; ++port) {
+			const int e = find_event(capture.events, UOPS_DISPATCHED_PORT[port]);
+			if (e >= 0)
+				ports[e] = port;
+		}
+		query_groups_t groups;
+		execute_query(query, capture, ports, groups);
+
+		std::string out;
+		if (ndjson) {
+			json_writer_t json;
+			for (auto &g : groups) {
+				json.begin_object();
+				for (const auto &item : query.items) {
+					const double value = query_number(query, item, g.first, g.second);
+					json.key(item.label.c_str());
+					if (query_is_name(item))
+						json.value(query_name(item, capture, value).c_str());
+					else if (item.aggregate == QUERY_VALUE)
+						json.value((int) value);  // cores, sockets and ports, which are -1 for other events
+					else if (query_is_integral(item))
+						json.value((u_int64_t) value);
+					else
+						json.value(value, item.column == QUERY_DELTA ? 1 : 4);
+				}
+				json.end_object().newline();
+			}
+			out.assign(json.data(), json.size());
+		} else {
+			std::vector<std::vector<std::string> > rows(1);
+			for (const auto &item : query.items)
+				rows[0].push_back(item.label);
+			char buf[64];
+			for (auto &g : groups) {
+				rows.push_back(std::vector<std::string>());
+				for (const auto &item : query.items) {
+					const double value = query_number(query, item, g.first, g.second);
+					if (query_is_name(item)) {
+						rows.back().push_back(query_name(item, capture, value));
+						continue;
+					}
+					snprintf(buf, sizeof(buf), query_is_integral(item) ? "%.0f" : item.column == QUERY_DELTA ? "%.1f" : "%.4f", value);
+					rows.back().push_back(buf);
+				}
+			}
+			std::vector<size_t> widths(query.items.size());
+			for (const auto &row : rows)
+				for (size_t i = 0; i < row.size(); ++i)
+					widths[i] = std::max(widths[i], row[i].size());
+			for (const auto &row : rows) {
+				for (size_t i = 0; i < row.size(); ++i) {
+					if (i)
+						out += "  ";
+					// names to the left, numbers to the right
+					const std::string pad(widths[i] - row[i].size(), ' ');
+					out += query_is_name(query.items[i]) ? row[i] + (i + 1 < row.size() ? pad : "") : pad + row[i];
+				}
+				out += '\n';
+			}
+		}
+		fwrite(out.data(), 1, out.size(), stdout);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Splits a line of `perf stat -x,` output into its fields. A raw event such as cpu/event=0xc2,umask=0x01/ has commas
+// of its own, so a field with an unclosed '/' is joined with those after it up to the closing one.
+std::vector<std::string> split_perf_stat_fields(const std::string &line) {
+	std::vector<std::string> fields;
+	bool open = false;
+	for (auto &field : split(line, ',')) {
+		if (open)
+			fields.back() += "," + field;
+		else
+			fields.push_back(field);
+		if (std::count(field.begin(), field.end(), '/') % 2)
+			open = !open;
+	}
+	return fields;
+}
+
+// Numbers the cores of the CPUs perf counted on, in the order they are first seen, using the topology in cpuinfo.
+struct import_cores_t {
+private:
+	const std::vector<cpu_t> &cpus;
+	std::map<int, int> cpu_cores;  // logical CPU -> core index
+
+public:
+	std::vector<int> packages;  // of each core
+
+	import_cores_t(const std::vector<cpu_t> &cpus) : cpus(cpus) {}
+
+	int core_of_cpu(int cpu) {
+		auto it = cpu_cores.find(cpu);
+		if (it != cpu_cores.end())
+			return it->second;
+		for (const auto &c : cpus) {
+			if (c.id != cpu)
+				continue;
+			for (const auto &other : cpus) {
+				if (other.physical_id == c.physical_id && other.core_id == c.core_id && cpu_cores.count(other.id)) {
+					cpu_cores[cpu] = cpu_cores[other.id];
+					return cpu_cores[cpu];
+				}
+			}
+			cpu_cores[cpu] = packages.size();
+			packages.push_back(c.physical_id);
+			return cpu_cores[cpu];
+		}
+		throw std::runtime_error("CPU" + std::to_string(cpu) + " is not in the topology; pass --cpuinfo of the host perf ran on");
+	}
+};
+
+// Converts `perf stat -x, -I MS` output into a capture. Counts may be per CPU (-A), per core (--per-core) or
+// system-wide; per-CPU counts are summed into cores using the topology in cpuinfo. Without a msr/tsc/ event, the
+// TSC of each interval is derived from its timestamp and tsc_hz.
+void import_perf_stat(std::istream &in, const std::string &output, const std::vector<cpu_t> &cpus, capture_header_t host) {
+	struct sample_t {
+		double time;
+		int core;
+		size_t event;
+		u_int64_t count;
+		bool scaled;  // perf counted it part of the time and scaled it up
+	};
+
+	import_cores_t cores(cpus);
+	std::map<std::string, int> core_keys;  // "S0-D0-C1" -> core index
+	std::vector<int> &packages = cores.packages;
+	std::vector<std::string> event_names;
+	std::vector<pmc_event_type_t> events;
+	std::map<std::string, size_t> event_index;
+	int tsc_event = -1;
+	u_int64_t start_ns = 0;
+	size_t skipped = 0;
+
+	std::vector<sample_t> samples;
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.compare(0, 13, "# started on ") == 0) {
+			struct tm tm;
+			memset(&tm, 0, sizeof(tm));
+			if (strptime(line.c_str() + 13, "%a %b %d %H:%M:%S %Y", &tm)) {
+				tm.tm_isdst = -1;
+				start_ns = (u_int64_t) mktime(&tm) * 1000000000;
+			}
+			continue;
+		}
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		const std::vector<std::string> fields = split_perf_stat_fields(line);
+		if (fields.size() < 4)
+			continue;
+		sample_t sample;
+		sample.time = std::stod(fields[0]);
+		size_t count_field;
+		const std::string where = trim(fields[1]);
+		if (where.compare(0, 3, "CPU") == 0) {
+			sample.core = cores.core_of_cpu(std::stoi(where.substr(3)));
+			count_field = 2;
+		} else if (where.size() > 1 && where[0] == 'S' && where.find("-C") != std::string::npos) {
+			// --per-core: "S0-D0-C1,<cpus>,<count>,..."
+			auto it = core_keys.find(where);
+			if (it == core_keys.end()) {
+				it = core_keys.insert(std::make_pair(where, (int) packages.size())).first;
+				packages.push_back(std::stoi(where.substr(1)));
+			}
+			sample.core = it->second;
+			count_field = 3;
+		} else {
+			if (packages.empty())
+				packages.push_back(0);
+			sample.core = 0;
+			count_field = 1;
+		}
+		if (fields.size() < count_field + 3)
+			continue;
+
+		const std::string name = fields[count_field + 2];
+		auto it = event_index.find(name);
+		if (it == event_index.end()) {
+			pmc_event_type_t event(0, 0, "");
+			const bool tsc = name == "msr/tsc/";
+			if (!tsc && !parse_perf_event(name, event))
+				std::cerr << "warning: importing unknown event " << name << " without its encoding" << std::endl;
+			it = event_index.insert(std::make_pair(name, events.size())).first;
+			event_names.push_back(event.name[0] ? event.name : name);
+			events.push_back(event);
+			if (tsc)
+				tsc_event = it->second;
+		}
+		sample.event = it->second;
+
+		const std::string count = fields[count_field];
+		if (count.empty() || !isdigit(count[0])) {
+			// "<not counted>" or "<not supported>"
+			++skipped;
+			sample.count = 0;
+		} else {
+			sample.count = std::stoull(count);
+		}
+		// after the unit, the event and the run time, the percentage of the time the event was counted
+		sample.scaled = fields.size() > count_field + 4 && !fields[count_field + 4].empty() && atof(fields[count_field + 4].c_str()) < 100;
+		samples.push_back(sample);
+	}
+	if (samples.empty())
+		throw std::runtime_error("no perf stat -x, -I intervals found");
+	if (skipped)
+		std::cerr << "warning: " << skipped << " counts were not counted and are imported as 0" << std::endl;
+
+	// msr/tsc/ becomes the record TSC rather than a counter
+	std::vector<size_t> columns(events.size());
+	std::vector<pmc_event_type_t> counters;
+	for (size_t e = 0; e < events.size(); ++e) {
+		columns[e] = (int) e == tsc_event ? (size_t) -1 : counters.size();
+		if ((int) e != tsc_event) {
+			counters.push_back(events[e]);
+			counters.back().name = event_names[e].c_str();
+		}
+	}
+
+	topology_t topology;
+	topology.num_cores = packages.size();
+	topology.packages = packages;
+	topology.cpus.resize(packages.size());
+	if (host.interval_ns == 0) {
+		for (const auto &sample : samples) {
+			if (sample.time > samples[0].time) {
+				host.interval_ns = (sample.time - samples[0].time) * 1e9 + 0.5;
+				break;
+			}
+		}
+	}
+	for (const auto &sample : samples)
+		if (sample.scaled)
+			host.flags |= CAPTURE_ESTIMATES;
+	capture_writer_t writer(output, host, topology, counters.data(), counters.size());
+
+	// perf -I prints the counts of each interval; the capture holds them accumulated, starting from zero
+	std::vector<u_int64_t> totals(topology.num_cores * counters.size());
+	std::vector<bool> estimated(counters.size());
+	u_int64_t tsc = 0;
+	writer.write(start_ns, tsc, totals, estimated);
+	double last_time = 0;
+	for (size_t i = 0; i < samples.size(); ) {
+		const double time = samples[i].time;
+		u_int64_t tsc_delta = 0;
+		estimated.assign(counters.size(), false);
+		for (; i < samples.size() && samples[i].time == time; ++i) {
+			const sample_t &sample = samples[i];
+			if ((int) sample.event == tsc_event) {
+				tsc_delta = std::max(tsc_delta, sample.count);
+			} else {
+				totals[sample.core * counters.size() + columns[sample.event]] += sample.count;
+				if (sample.scaled)
+					estimated[columns[sample.event]] = true;
+			}
+		}
+		tsc += tsc_event >= 0 ? tsc_delta : (u_int64_t) ((time - last_time) * host.tsc_hz);
+		last_time = time;
+		writer.write(start_ns + (u_int64_t) (time * 1e9), tsc, totals, estimated);
+	}
+}
+
+// perf.data as written by perf record (not in pipe mode): a perf_file_header_t, the attributes of its events, each
+// followed by the section of its sample IDs, then the records, then a section per header feature set in
+// adds_features, in bit order.
+static const u_int64_t PERF_FILE_MAGIC = 0x32454c4946524550ull;  // "PERFILE2", little-endian
+static const int PERF_HEADER_EVENT_DESC = 12;  // feature holding the event names
+
+struct perf_file_section_t {
+	u_int64_t offset;
+	u_int64_t size;
+};
+
+struct perf_file_header_t {
+	u_int64_t magic;
+	u_int64_t size;
+	u_int64_t attr_size;
+	perf_file_section_t attrs;
+	perf_file_section_t data;
+	perf_file_section_t event_types;
+	u_int64_t adds_features[4];
+};
+
+// Read-only view of a perf.data file, mapped into memory; every access is checked against its size.
+struct perf_data_t {
+private:
+	int fd;
+	const char *base;
+	size_t length;
+	std::string path;
+
+public:
+	perf_file_header_t header;
+	u_int64_t mtime_ns;  // when perf finished writing it
+
+	perf_data_t(const perf_data_t &) = delete;
+	perf_data_t &operator=(const perf_data_t &) = delete;
+	perf_data_t(const std::string &path)
+		: fd(-1), base(NULL), length(0), path(path), mtime_ns(0) {
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header))
+			throw std::runtime_error(path + " is not a perf.data file");
+		length = st.st_size;
+		mtime_ns = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+		void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			throw std::runtime_error("can't map " + path + ": " + strerror(errno));
+		base = (const char *) p;
+		memcpy(&header, base, sizeof(header));
+		if (header.magic != PERF_FILE_MAGIC)
+			throw std::runtime_error(path + " is not a little-endian perf.data file");
+		if (header.size != sizeof(header))
+			throw std::runtime_error(path + " was written in pipe mode; record with -o FILE");
+	}
+	~perf_data_t() {
+		if (base)
+			munmap((void *) base, length);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	// size bytes at offset
+	const char *at(u_int64_t offset, u_int64_t size) const {
+		if (offset > length || size > length - offset)
+			throw std::runtime_error(path + " is corrupt");
+		return base + offset;
+	}
+
+	template<class T>
+	T get(u_int64_t offset) const {
+		T value;
+		memcpy(&value, at(offset, sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	bool has_feature(int feature) const {
+		return header.adds_features[feature / 64] >> (feature % 64) & 1;
+	}
+
+	// section of a header feature, which must be set
+	perf_file_section_t feature(int feature) const {
+		size_t index = 0;
+		for (int f = 0; f < feature; ++f)
+			index += has_feature(f);
+		return get<perf_file_section_t>(header.data.offset + header.data.size + index * sizeof(perf_file_section_t));
+	}
+};
+
+// Converts the samples of `perf record` that read their counters (PERF_SAMPLE_READ, as with a '{...}:S' group) into a
+// capture with intervals of interval_ns. Each sample gives the counts of its CPU since the events were enabled, so the
+// counts of an interval are the differences between the last samples of each counter and CPU on either side of it,
+// scaled up and marked as estimated where the counter ran for part of the interval. Samples need their time and CPU,
+// which perf record -a gives them. perf's clock isn't the wall clock: the last sample is taken to be as old as the file.
+void import_perf_data(const std::string &path, const std::string &output, const std::vector<cpu_t> &cpus,
+                      capture_header_t host, u_int64_t interval_ns) {
+	struct read_t {
+		u_int64_t time;
+		int cpu;
+		size_t attr;
+		u_int64_t value;
+		u_int64_t enabled;
+		u_int64_t running;
+	};
+
+	perf_data_t perf(path);
+	const perf_file_header_t &h = perf.header;
+	// the attribute may be older or newer than the one of the headers, and has its own size
+	const u_int64_t entry_size = h.attr_size + sizeof(perf_file_section_t);
+	if (h.attr_size < PERF_ATTR_SIZE_VER0 || h.attrs.size % entry_size != 0 || h.attrs.size == 0)
+		throw std::runtime_error(path + " has no events or a corrupt attribute section");
+	std::vector<perf_event_attr> attrs(h.attrs.size / entry_size);
+	std::map<u_int64_t, size_t> ids;  // sample ID -> attribute
+	for (size_t a = 0; a < attrs.size(); ++a) {
+		const u_int64_t offset = h.attrs.offset + a * entry_size;
+		memset(&attrs[a], 0, sizeof(attrs[a]));
+		memcpy(&attrs[a], perf.at(offset, h.attr_size), std::min<u_int64_t>(h.attr_size, sizeof(attrs[a])));
+		const perf_file_section_t section = perf.get<perf_file_section_t>(offset + h.attr_size);
+		for (u_int64_t i = 0; i < section.size / sizeof(u_int64_t); ++i)
+			ids[perf.get<u_int64_t>(section.offset + i * sizeof(u_int64_t))] = a;
+	}
+
+	// names from the event descriptions, in the order of the attributes
+	std::vector<std::string> names(attrs.size());
+	if (perf.has_feature(PERF_HEADER_EVENT_DESC)) {
+		const perf_file_section_t section = perf.feature(PERF_HEADER_EVENT_DESC);
+		u_int64_t offset = section.offset;
+		const u_int32_t nr = perf.get<u_int32_t>(offset);
+		const u_int32_t attr_size = perf.get<u_int32_t>(offset + 4);
+		offset += 8;
+		for (u_int32_t i = 0; i < nr && i < attrs.size(); ++i) {
+			const u_int32_t nr_ids = perf.get<u_int32_t>(offset + attr_size);
+			const u_int32_t len = perf.get<u_int32_t>(offset + attr_size + 4);
+			const char *name = perf.at(offset + attr_size + 8, len);
+			names[i].assign(name, strnlen(name, len));
+			offset += attr_size + 8 + len + (u_int64_t) nr_ids * sizeof(u_int64_t);
+		}
+	}
+
+	// the attribute of a sample: by its ID, at the front with PERF_SAMPLE_IDENTIFIER or else where the first event puts it
+	const u_int64_t first_type = attrs[0].sample_type;
+	auto attr_of = [&](u_int64_t offset) -> size_t {
+		if (attrs.size() == 1)
+			return 0;
+		if (!(first_type & (PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_ID)))
+			throw std::runtime_error(path + " has samples of several events without their IDs");
+		if (!(first_type & PERF_SAMPLE_IDENTIFIER)) {
+			for (u_int64_t bit : {PERF_SAMPLE_IP, PERF_SAMPLE_TID, PERF_SAMPLE_TIME, PERF_SAMPLE_ADDR})
+				offset += first_type & bit ? sizeof(u_int64_t) : 0;
+		}
+		auto it = ids.find(perf.get<u_int64_t>(offset));
+		if (it == ids.end())
+			throw std::runtime_error(path + " has a sample of an unknown event");
+		return it->second;
+	};
+
+	std::vector<read_t> reads;
+	size_t unread = 0;
+	for (u_int64_t offset = h.data.offset; offset < h.data.offset + h.data.size; ) {
+		const perf_event_header record = perf.get<perf_event_header>(offset);
+		if (record.size < sizeof(record))
+			throw std::runtime_error(path + " has a corrupt record");
+		perf.at(offset, record.size);
+		u_int64_t field = offset + sizeof(record);
+		offset += record.size;
+		if (record.type != PERF_RECORD_SAMPLE)
+			continue;
+		const size_t attr = attr_of(field);
+		const perf_event_attr &a = attrs[attr];
+		const u_int64_t type = a.sample_type;
+		if (!(type & PERF_SAMPLE_READ) || !(type & PERF_SAMPLE_TIME) || !(type & PERF_SAMPLE_CPU)) {
+			++unread;
+			continue;
+		}
+		read_t read;
+		read.attr = attr;
+		// in the order of perf_event_type's PERF_RECORD_SAMPLE, up to the read values
+		for (u_int64_t bit : {PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_IP, PERF_SAMPLE_TID, PERF_SAMPLE_TIME, PERF_SAMPLE_ADDR,
+		                      PERF_SAMPLE_ID, PERF_SAMPLE_STREAM_ID, PERF_SAMPLE_CPU, PERF_SAMPLE_PERIOD}) {
+			if (!(type & bit))
+				continue;
+			if (bit == PERF_SAMPLE_TIME)
+				read.time = perf.get<u_int64_t>(field);
+			else if (bit == PERF_SAMPLE_CPU)
+				read.cpu = perf.get<u_int32_t>(field);
+			field += sizeof(u_int64_t);
+		}
+		const u_int64_t format = a.read_format;
+		const bool group = format & PERF_FORMAT_GROUP;
+		const u_int64_t nr = group ? perf.get<u_int64_t>(field) : 1;
+		field += group ? sizeof(u_int64_t) : 0;
+		// a group has the times first; a single value has them after it
+		u_int64_t times = group ? field : field + sizeof(u_int64_t);
+		read.enabled = format & PERF_FORMAT_TOTAL_TIME_ENABLED ? perf.get<u_int64_t>(times) : 0;
+		times += format & PERF_FORMAT_TOTAL_TIME_ENABLED ? sizeof(u_int64_t) : 0;
+		read.running = format & PERF_FORMAT_TOTAL_TIME_RUNNING ? perf.get<u_int64_t>(times) : 0;
+		times += format & PERF_FORMAT_TOTAL_TIME_RUNNING ? sizeof(u_int64_t) : 0;
+		if (group)
+			field = times;
+		for (u_int64_t i = 0; i < nr; ++i) {
+			read.value = perf.get<u_int64_t>(field);
+			field = group ? field + sizeof(u_int64_t) : times;
+			if (format & PERF_FORMAT_ID) {
+				auto it = ids.find(perf.get<u_int64_t>(field));
+				if (it == ids.end())
+					throw std::runtime_error(path + " reads an unknown event");
+				read.attr = it->second;
+				field += sizeof(u_int64_t);
+			} else {
+				// group members follow their leader
+				read.attr = attr + i;
+				if (read.attr >= attrs.size())
+					throw std::runtime_error(path + " reads an unknown event");
+			}
+			field += format & PERF_FORMAT_LOST ? sizeof(u_int64_t) : 0;
+			reads.push_back(read);
+		}
+	}
+	if (reads.empty())
+		throw std::runtime_error(path + " has no samples with their counts, time and CPU; record with perf record -a -e '{...}:S'");
+	if (unread)
+		std::cerr << "warning: " << unread << " samples without their counts, time or CPU were skipped" << std::endl;
+	// perf writes the records of the CPUs in rounds, not in time order
+	std::stable_sort(reads.begin(), reads.end(), [](const read_t &a, const read_t &b) {
+		return a.time < b.time;
+	});
+
+	// the events read become the capture's counters, in the order of their attributes
+	import_cores_t cores(cpus);
+	std::vector<bool> read_attrs(attrs.size());
+	for (const auto &read : reads) {
+		cores.core_of_cpu(read.cpu);
+		read_attrs[read.attr] = true;
+	}
+	std::vector<size_t> columns(attrs.size());
+	std::vector<pmc_event_type_t> counters;
+	std::vector<std::string> counter_names;
+	for (size_t a = 0; a < attrs.size(); ++a) {
+		if (!read_attrs[a])
+			continue;
+		columns[a] = counters.size();
+		pmc_event_type_t event(0, 0, "");
+		bool known = false;
+		if (attrs[a].type == PERF_TYPE_RAW) {
+			event.event = attrs[a].config & 0xff;
+			event.umask = attrs[a].config >> 8 & 0xff;
+			char raw[32];
+			snprintf(raw, sizeof(raw), "r%llx", (unsigned long long) (attrs[a].config & 0xffff));
+			parse_perf_event(raw, event);
+			known = true;
+		} else if (attrs[a].type == PERF_TYPE_HARDWARE && attrs[a].config == PERF_COUNT_HW_INSTRUCTIONS) {
+			event = FIXED_EVENTS[FIXED_INST_RETIRED];
+			known = true;
+		} else if (!names[a].empty()) {
+			known = parse_perf_event(names[a], event);
+		}
+		std::string name = event.name[0] ? event.name : names[a];
+		if (name.empty())
+			name = std::to_string(attrs[a].type) + ":" + std::to_string(attrs[a].config);
+		if (!known)
+			std::cerr << "warning: importing unknown event " << name << " without its encoding" << std::endl;
+		counters.push_back(event);
+		counter_names.push_back(name);
+	}
+	for (size_t c = 0; c < counters.size(); ++c)
+		counters[c].name = counter_names[c].c_str();
+
+	// the events were enabled, and counted from zero, the enabled time before their first sample
+	u_int64_t start = reads[0].time;
+	for (const auto &read : reads)
+		start = std::min(start, read.time - std::min(read.time, read.enabled));
+	const u_int64_t last = reads.back().time;
+	auto wall_ns = [&](u_int64_t time) {
+		return perf.mtime_ns + time > last ? perf.mtime_ns + time - last : 0;
+	};
+
+	std::map<std::pair<size_t, int>, read_t> latest, counted;  // of each counter and CPU: last sample, and at the last record
+	topology_t topology;
+	topology.num_cores = cores.packages.size();
+	topology.packages = cores.packages;
+	topology.cpus.resize(cores.packages.size());
+	host.interval_ns = interval_ns;
+	std::vector<u_int64_t> totals(topology.num_cores * counters.size());
+	std::vector<bool> estimated(counters.size());
+	std::vector<std::vector<bool>> masks;
+	std::vector<std::vector<u_int64_t>> records;
+	records.push_back(totals);
+	masks.push_back(estimated);
+	for (size_t i = 0; i < reads.size(); ) {
+		const u_int64_t end = start + records.size() * interval_ns;
+		for (; i < reads.size() && reads[i].time <= end; ++i)
+			latest[std::make_pair(reads[i].attr, reads[i].cpu)] = reads[i];
+		estimated.assign(counters.size(), false);
+		for (const auto &entry : latest) {
+			const read_t &now = entry.second;
+			auto it = counted.find(entry.first);
+			const read_t before = it != counted.end() ? it->second : read_t{start, now.cpu, now.attr, 0, 0, 0};
+			const u_int64_t enabled = now.enabled - std::min(now.enabled, before.enabled);
+			const u_int64_t running = now.running - std::min(now.running, before.running);
+			double count = now.value - std::min(now.value, before.value);
+			if (running < enabled) {
+				count = running ? count * enabled / running : 0;
+				estimated[columns[now.attr]] = true;
+			}
+			totals[cores.core_of_cpu(now.cpu) * counters.size() + columns[now.attr]] += (u_int64_t) (count + 0.5);
+			counted[entry.first] = now;
+		}
+		records.push_back(totals);
+		masks.push_back(estimated);
+	}
+
+	for (const auto &mask : masks)
+		for (bool e : mask)
+			if (e)
+				host.flags |= CAPTURE_ESTIMATES;
+	capture_writer_t writer(output, host, topology, counters.data(), counters.size());
+	for (size_t r = 0; r < records.size(); ++r) {
+		const u_int64_t time = start + r * interval_ns;
+		writer.write(wall_ns(time), (u_int64_t) ((time - start) / 1e9 * host.tsc_hz), records[r], masks[r]);
+	}
+}
+
+int import_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"cpuinfo", required_argument, NULL, 'c'},
+		{"tsc-mhz", required_argument, NULL, 't'},
+		{"hostname", required_argument, NULL, 'n'},
+		{"interval", required_argument, NULL, 'i'},
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string cpuinfo_path = "/proc/cpuinfo", hostname;
+	double tsc_mhz = 0;
+	u_int64_t interval_ms = 1000;
+	int c;
+	while ((c = getopt_long(argc, argv, "c:t:n:i:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			cpuinfo_path = optarg;
+			break;
+		case 't':
+			tsc_mhz = std::stod(optarg);
+			break;
+		case 'n':
+			hostname = optarg;
+			break;
+		case 'i':
+			interval_ms = std::stoull(optarg);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind + 2 != argc || interval_ms == 0) {
+		std::cerr << "Usage: core-port-stat import [--cpuinfo=FILE] [--tsc-mhz=MHZ] [--hostname=NAME] [--interval=MS] PERF_STAT_CSV|PERF_DATA CAPTURE" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		const std::vector<cpu_t> cpus = cpuinfo(cpuinfo_path);
+		capture_header_t host;
+		memset(&host, 0, sizeof(host));
+		if (!cpus.empty()) {
+			host.cpu_family = cpus[0].cpu_family;
+			host.cpu_model = cpus[0].model;
+		}
+		host.tsc_hz = tsc_mhz > 0 ? tsc_mhz * 1e6 : calibrate_tsc_hz();
+		if (hostname.empty())
+			gethostname(host.hostname, sizeof(host.hostname) - 1);
+		else
+			strncpy(host.hostname, hostname.c_str(), sizeof(host.hostname) - 1);
+
+		std::ifstream in(argv[optind]);
+		if (!in)
+			throw std::runtime_error(std::string("can't open ") + argv[optind]);
+		// perf.data starts with its magic; anything else is taken for perf stat output
+		char magic[8] = {};
+		in.read(magic, sizeof(magic));
+		if (in.gcount() == sizeof(magic) && memcmp(magic, &PERF_FILE_MAGIC, sizeof(magic)) == 0) {
+			import_perf_data(argv[optind], argv[optind + 1], cpus, host, interval_ms * 1000000);
+		} else {
+			in.clear();
+			in.seekg(0);
+			import_perf_stat(in, argv[optind + 1], cpus, host);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+port_prediction_t predict_file(const std::string &path) {
+	if (path == "-")
+		return predict_ports(std::cin);
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("can't open " + path);
+	return predict_ports(in);
+}
+
+int predict_main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"bytes", required_argument, NULL, 'b'},
+		{NULL, 0, NULL, 0},
+	};
+
+	std::string bytes;
+	int c;
+	while ((c = getopt_long(argc, argv, "b:", long_options, NULL)) != -1) {
+		if (c != 'b')
+			return EXIT_FAILURE;
+		bytes = optarg;
+	}
+
+	try {
+		port_prediction_t prediction;
+		if (!bytes.empty())
+			prediction = predict_ports_of_bytes(bytes);
+		else
+			prediction = predict_file(optind < argc ? argv[optind] : "-");
+		print_prediction(stdout, prediction);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Adds an event given by name to the multiplexed or fixed events, from the builtin tables or else the event index,
+// which is opened on first use. The ports are always counted.
+void add_named_event(const std::string &name, const std::string &index_path, std::unique_ptr<event_index_t> &index,
+                     std::vector<pmc_event_type_t> &multiplexed, std::vector<fixed_counter_t> &fixed) {
+	for (size_t f = 0; f < length_of(FIXED_EVENTS); ++f) {
+		if (strcasecmp(name.c_str(), FIXED_EVENTS[f].name) == 0) {
+			if (std::find(fixed.begin(), fixed.end(), (fixed_counter_t) f) == fixed.end())
+				fixed.push_back((fixed_counter_t) f);
+			return;
+		}
+	}
+
+	for (const auto &port : UOPS_DISPATCHED_PORT)
+		if (strcasecmp(name.c_str(), port.name) == 0)
+			return;
+
+	if (!index)
+		index.reset(new event_index_t(index_path));
+	const event_index_entry_t *entry = index->find(name);
+	if (!entry)
+		throw std::runtime_error("unknown event " + name + " (not in " + index_path + ")");
+	if (entry->fixed >= 0) {
+		if ((size_t) entry->fixed >= length_of(FIXED_EVENTS))
+			throw std::runtime_error("unsupported fixed counter for " + name);
+		// the fixed counters count for both threads of a core, like every counter here
+		if (strcasecmp(name.c_str(), FIXED_EVENTS[entry->fixed].name) != 0)
+			std::cerr << "warning: " << name << " is counted per core as " << FIXED_EVENTS[entry->fixed].name << " on fixed counter "
+			          << (int) entry->fixed << std::endl;
+		if (std::find(fixed.begin(), fixed.end(), (fixed_counter_t) entry->fixed) == fixed.end())
+			fixed.push_back((fixed_counter_t) entry->fixed);
+		return;
+	}
+	if (entry->msr_index && entry->msr_index != MSR_OFFCORE_RSP[0] && entry->msr_index != MSR_OFFCORE_RSP[1]) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "0x%x", entry->msr_index);
+		throw std::runtime_error(name + " needs MSR " + buf + ", which isn't supported");
+	}
+	const pmc_event_type_t event = index->event(*entry);
+
+	for (const auto &e : multiplexed)
+		if (e.event == event.event && e.umask == event.umask && e.cmask == event.cmask && e.invert == event.invert && e.edge == event.edge &&
+		    e.msr_value == event.msr_value)
+			return;
+	multiplexed.push_back(event);
+}
+
+// Creates a timerfd on CLOCK_MONOTONIC that expires at first_ns and then every interval_ns, on its own schedule
+// however long each expiration takes to handle.
+int periodic_timer(u_int64_t first_ns, u_int64_t interval_ns) {
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error(std::string("can't create timer: ") + strerror(errno));
+	struct itimerspec spec;
+	spec.it_value.tv_sec = first_ns / 1000000000;
+	spec.it_value.tv_nsec = first_ns % 1000000000;
+	spec.it_interval.tv_sec = interval_ns / 1000000000;
+	spec.it_interval.tv_nsec = interval_ns % 1000000000;
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+		throw std::runtime_error(std::string("can't set timer: ") + strerror(errno));
+	return fd;
+}
+
+// Times a timer expired since it was last read, 0 if none.
+u_int64_t timer_expirations(int fd) {
+	u_int64_t n;
+	return read(fd, &n, sizeof(n)) == sizeof(n) ? n : 0;
+}
+
+// The sampler's event loop: an epoll set of timers, a signalfd and sockets, all non-blocking, so that epoll_wait is
+// the only place the sampler waits and one thread does all the work.
+struct event_loop_t {
+private:
+	int epoll_fd;
+
+public:
+	event_loop_t(const event_loop_t &) = delete;
+	event_loop_t &operator=(const event_loop_t &) = delete;
+	event_loop_t() {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			throw std::runtime_error(std::string("can't create epoll set: ") + strerror(errno));
+	}
+	~event_loop_t() {
+		close(epoll_fd);
+	}
+
+	void add(int fd, u_int32_t events) {
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+			throw std::runtime_error(std::string("can't watch descriptor: ") + strerror(errno));
+	}
+
+	void modify(int fd, u_int32_t events) {
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	void remove(int fd) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	int wait(struct epoll_event *events, int max_events) {
+		int n;
+		while ((n = epoll_wait(epoll_fd, events, max_events, -1)) < 0 && errno == EINTR)
+			;
+		return n;
+	}
+};
+
+// unsent output that drops a client which doesn't keep up, so that it can't hold the sampler's memory
+static const size_t CLIENT_BUFFER_LIMIT = 4 << 20;
+// a command line longer than this drops the client
+static const size_t CLIENT_LINE_LIMIT = 4096;
+
+// Unix socket serving the running sampler. Each client is sent every interval as NDJSON and may send commands, one
+// per line, that the sampler answers on the same socket.
+struct control_server_t {
+private:
+	struct client_t {
+		std::string in;
+		std::string out;
+		bool writing;  // waiting for the socket to take more output
+		bool eof;      // the client shut down its side, so it goes once answered
+	};
+	event_loop_t &loop;
+	std::string path;
+	int listen_fd;
+	std::map<int, client_t> clients;
+
+	void drop(int fd) {
+		loop.remove(fd);
+		close(fd);
+		clients.erase(fd);
+	}
+
+	// Sends what the socket takes; returns false if the client is gone or done.
+	bool flush(int fd, client_t &client) {
+		const u_int32_t reading = client.eof ? 0u : (u_int32_t) EPOLLIN;
+		while (!client.out.empty()) {
+			const ssize_t n = send(fd, client.out.data(), client.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n > 0) {
+				client.out.erase(0, n);
+			} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				if (!client.writing) {
+					loop.modify(fd, reading | EPOLLOUT);
+					client.writing = true;
+				}
+				return true;
+			} else if (n < 0 && errno != EINTR) {
+				return false;
+			}
+		}
+		if (client.writing) {
+			loop.modify(fd, reading);
+			client.writing = false;
+		}
+		return !client.eof;
+	}
+
+public:
+	control_server_t(const control_server_t &) = delete;
+	control_server_t &operator=(const control_server_t &) = delete;
+	control_server_t(event_loop_t &loop, const std::string &path)
+		: loop(loop), path(path), listen_fd(-1) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("socket path too long: " + path);
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		// a socket left behind by a sampler that died
+		struct stat st;
+		if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(path.c_str());
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0)
+			throw std::runtime_error("can't serve on " + path + ": " + strerror(errno));
+		loop.add(listen_fd, EPOLLIN);
+	}
+	~control_server_t() {
+		for (const auto &client : clients)
+			close(client.first);
+		if (listen_fd >= 0) {
+			close(listen_fd);
+			unlink(path.c_str());
+		}
+	}
+
+	bool owns(int fd) const {
+		return fd == listen_fd || clients.count(fd);
+	}
+
+	size_t num_clients() const {
+		return clients.size();
+	}
+
+	// Handles the readiness of one of its sockets, appending the complete command lines received to commands.
+	void handle(int fd, u_int32_t events, std::vector<std::pair<int, std::string>> &commands) {
+		if (fd == listen_fd) {
+			int client_fd;
+			while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				loop.add(client_fd, EPOLLIN);
+				clients[client_fd].writing = false;
+				clients[client_fd].eof = false;
+			}
+			return;
+		}
+		client_t &client = clients[fd];
+		if ((events & EPOLLOUT) && !flush(fd, client)) {
+			drop(fd);
+			return;
+		}
+		if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			return;
+		char buf[1024];
+		for (;;) {
+			const ssize_t n = read(fd, buf, sizeof(buf));
+			if (n > 0) {
+				client.in.append(buf, n);
+			} else if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			} else if (n == 0) {
+				// answer the commands before the client goes
+				client.eof = true;
+				loop.modify(fd, client.writing ? (u_int32_t) EPOLLOUT : 0u);
+				break;
+			} else {
+				drop(fd);
+				return;
+			}
+		}
+		const size_t num_commands = commands.size();
+		size_t start = 0, end;
+		while ((end = client.in.find('\n', start)) != std::string::npos) {
+			std::string line = client.in.substr(start, end - start);
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.resize(line.size() - 1);
+			commands.push_back(std::make_pair(fd, line));
+			start = end + 1;
+		}
+		client.in.erase(0, start);
+		if (client.in.size() > CLIENT_LINE_LIMIT || (client.eof && commands.size() == num_commands && client.out.empty()))
+			drop(fd);
+	}
+
+	void reply(int fd, const char *data, size_t len) {
+		auto it = clients.find(fd);
+		if (it == clients.end())
+			return;
+		it->second.out.append(data, len);
+		if (it->second.out.size() > CLIENT_BUFFER_LIMIT || !flush(fd, it->second))
+			drop(fd);
+	}
+
+	void broadcast(const char *data, size_t len) {
+		std::vector<int> fds;
+		for (const auto &client : clients)
+			fds.push_back(client.first);
+		for (int fd : fds)
+			reply(fd, data, len);
+	}
+};
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "predict") == 0)
+		return predict_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "export") == 0)
+		return export_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "report") == 0)
+		return report_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "render") == 0)
+		return render_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "merge") == 0)
+		return merge_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "query") == 0)
+		return query_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "import") == 0)
+		return import_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "events") == 0)
+		return events_main(argc - 1, argv + 1);
+
+	options_t opts;
+	try {
+		opts = parse_options(argc, argv);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid argument: " << e.what() << std::endl;
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	port_prediction_t prediction;
+	if (!opts.predict_path.empty()) {
+		try {
+			prediction = predict_file(opts.predict_path);
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		print_prediction(stderr, prediction);
+		std::cerr << std::endl;
+	}
+
+	std::cerr << "CPU Family: " << cpu_family() << std::endl;
+	std::cerr << "CPU Model: " << cpu_model() << std::endl;
+	std::cerr << std::endl;
+
+	pmc_info_t info = pmcinfo();
+	std::cerr << "Version ID of architectural performance monitoring (CPUID.0AH:EAX[7:0]): " << info.version_id << std::endl;
+	std::cerr << "Number of general-purpose performance monitoring counter per logical processor (CPUID.0AH:EAX[15:8]): " << info.num_pmc_per_thread << std::endl;
+	std::cerr << "Bit width of general-purpose performance monitoring counter: " << info.pmc_bitwidth << std::endl;
+	std::cerr << "Number of fixed-function performance counters (CPUID.0AH:EDX[4:0]): " << info.num_fixed << std::endl;
+	std::cerr << "Bit width of fixed-function performance counters: " << info.fixed_bitwidth << std::endl;
+	std::cerr << std::endl;
+
+	// Sandy Bridge and Sandy Bridge-EP
+	if (info.version_id < 3 || cpu_family() != 6 || (cpu_model() != 42 && cpu_model() != 45)) {
+		std::cerr << "Sorry your CPU is not supported yet: family = " << cpu_family() << ", " << "model = " << cpu_model() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const std::vector<cpu_t> cpus = cpuinfo();
+	if (cpus[0].flags.find("constant_tsc") == cpus[0].flags.end() || cpus[0].flags.find("nonstop_tsc") == cpus[0].flags.end()) {
+		std::cerr << "Cannot calculate core utilization because constant_tsc or nonstop_tsc is not available on your CPU." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const topology_t topology = build_topology(cpus);
+	const int num_cores = topology.num_cores;
+	std::vector<std::vector<msr_t>> core_msrs(num_cores);
+	for (size_t i = 0; i < cpus.size(); ++i)
+		core_msrs[topology.core_of_cpu[i]].emplace_back(cpus[i].open_msr());
+
+	// the ports on the general-purpose counters, the named and offcore events taking turns in those left, then the
+	// fixed counters the analyses need
+	std::vector<fixed_counter_t> fixed;
+	if (opts.classify || opts.frontend || opts.power)
+		fixed.push_back(FIXED_CPU_CLK_UNHALTED);
+	if (opts.power)
+		fixed.push_back(FIXED_REF_TSC);
+	if (opts.assists || !opts.fingerprints.empty())
+		fixed.push_back(FIXED_INST_RETIRED);
+	if (!opts.fingerprints.empty() && std::find(fixed.begin(), fixed.end(), FIXED_CPU_CLK_UNHALTED) == fixed.end())
+		fixed.push_back(FIXED_CPU_CLK_UNHALTED);
+	size_t threads_per_core = cpus.size();
+	for (const auto &core_cpus : topology.cpus)
+		threads_per_core = std::min(threads_per_core, core_cpus.size());
+	const std::vector<pmc_event_type_t> ports(UOPS_DISPATCHED_PORT, UOPS_DISPATCHED_PORT + NUM_PORTS);
+	std::vector<pmc_event_type_t> multiplexed;
+	std::unique_ptr<event_index_t> event_index;  // event names point into it
+	std::vector<counter_t> counters;
+	try {
+		for (const auto &name : opts.events)
+			add_named_event(name, opts.event_index, event_index, multiplexed, fixed);
+		if (opts.frontend)
+			multiplexed.insert(multiplexed.end(), FRONTEND_EVENTS, FRONTEND_EVENTS + NUM_FRONTEND_EVENTS);
+		if (opts.assists)
+			multiplexed.insert(multiplexed.end(), ASSIST_EVENTS, ASSIST_EVENTS + NUM_ASSIST_EVENTS);
+		if (opts.flops)
+			for (const auto &fp : SANDY_BRIDGE_FP_EVENTS)
+				multiplexed.push_back(fp.event);
+		if (opts.memory) {
+			const std::vector<pmc_event_type_t> offcore = offcore_class_events(cpu_model());
+			multiplexed.insert(multiplexed.end(), offcore.begin(), offcore.end());
+		}
+		pmc_info_t counter_info = info;
+		if (opts.load_latency)
+			counter_info.num_pmc_per_thread = std::min(counter_info.num_pmc_per_thread, LOAD_LATENCY_PMC);
+		counters = assign_counters(ports, multiplexed, fixed, counter_info, threads_per_core);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<pmc_event_type_t> events;
+	int num_groups = 0;
+	for (const auto &counter : counters) {
+		events.push_back(counter.event);
+		num_groups = std::max(num_groups, counter.group);
+	}
+	const size_t num_events = counters.size();
+	if (num_groups > 1)
+		std::cerr << "Multiplexing " << multiplexed.size() << " events in " << num_groups << " groups, one per interval" << std::endl << std::endl;
+
+	std::unique_ptr<pmu_state_t> pmu_state;
+	try {
+		pmu_state.reset(new pmu_state_t(core_msrs, counters));
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<u_int64_t> counter_masks;
+	for (const auto &counter : counters) {
+		const int bitwidth = counter.fixed >= 0 ? info.fixed_bitwidth : info.pmc_bitwidth;
+		counter_masks.push_back(bitwidth < 64 ? (1ull << bitwidth) - 1 : ~0ull);
+	}
+
+	// per-interval buffers, indexed by core * num_events + event
+	std::vector<u_int64_t> values(num_cores * num_events);
+	std::vector<u_int64_t> raw(num_cores * num_events);
+	interval_t interval;
+	interval.num_events = num_events;
+	interval.deltas.resize(num_cores * num_events);
+	interval.utils.resize(num_cores * num_events);
+	interval.estimated.assign(num_events, false);
+	std::fill(interval.cycles, interval.cycles + NUM_PHASES, 0);
+	// the deltas of the multiplexed events when they were last counted, and the length of that interval per group
+	std::vector<u_int64_t> last_deltas(num_cores * num_events);
+	std::vector<u_int64_t> last_hz(num_groups + 1);
+	std::string line;
+	line.reserve(num_cores * (num_events * 8 + 3) + 64);
+	json_writer_t json;
+
+	std::vector<rollup_t> rollups;
+	if (opts.rollup) {
+		rollups.push_back(rollup_t("package", "packages", "package_imbalance", topology.packages, num_events));
+		rollups.push_back(rollup_t("node", "nodes", "node_imbalance", topology.nodes, num_events));
+	}
+	std::unique_ptr<port_classifier_t> classifier;
+	if (opts.classify)
+		classifier.reset(new port_classifier_t(opts.classify_threshold, events, num_cores));
+
+	std::unique_ptr<frontend_t> frontend;
+	if (opts.frontend)
+		frontend.reset(new frontend_t(events, num_cores));
+	const u_int64_t tsc_hz = opts.flops || opts.memory || opts.power || opts.loops || opts.load_latency ? calibrate_tsc_hz() : 0;
+	std::unique_ptr<flops_t> flops;
+	if (opts.flops)
+		flops.reset(new flops_t(events, num_cores, tsc_hz));
+	std::unique_ptr<memory_traffic_t> memory;
+	if (opts.memory)
+		memory.reset(new memory_traffic_t(events, num_cores, tsc_hz));
+	std::unique_ptr<roofline_t> roofline;
+	if (opts.roofline) {
+		const double peak_flops = opts.peak_gflops > 0 ? opts.peak_gflops * 1e9 : (double) PEAK_FLOPS_PER_CYCLE * tsc_hz;
+		double bandwidth = opts.bandwidth_gbps * 1e9, core_bandwidth = bandwidth;
+		if (bandwidth <= 0) {
+			std::cerr << "Measuring memory bandwidth..." << std::endl;
+			const std::vector<cpu_id_t> package_cpus = first_package_cpus(topology);
+			bandwidth = measure_bandwidth(package_cpus);
+			core_bandwidth = measure_bandwidth(std::vector<cpu_id_t>(1, package_cpus[0]));
+		}
+		std::cerr << "Roofline: peak " << peak_flops / 1e9 << " GFLOPS per core, " << bandwidth / 1e9 << " GB/s per package, " <<
+			core_bandwidth / 1e9 << " GB/s per core alone" << std::endl << std::endl;
+		roofline.reset(new roofline_t(*flops, *memory, topology.packages, peak_flops, bandwidth, core_bandwidth));
+	}
+	std::unique_ptr<power_t> power;
+	if (opts.power)
+		power.reset(new power_t(events, num_cores, tsc_hz));
+	std::unique_ptr<assists_t> assists;
+	if (opts.assists)
+		assists.reset(new assists_t(events, topology, opts.assist_threshold));
+
+	std::unique_ptr<sched_tracer_t> tracer;
+	std::unique_ptr<task_top_t> top;
+	std::vector<task_slice_t> slices;
+	if (opts.top > 0 || !opts.fingerprints.empty()) {
+		try {
+			tracer.reset(new sched_tracer_t(cpus, topology.core_of_cpu, SCHED_RING_PAGES));
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		top.reset(new task_top_t(num_events, opts.top, num_cores));
+	}
+	std::unique_ptr<fingerprint_store_t> fingerprints;
+	if (!opts.fingerprints.empty()) {
+		try {
+			fingerprints.reset(new fingerprint_store_t(opts.fingerprints, events));
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	std::unique_ptr<loop_sampler_t> loops;
+	if (opts.loops > 0) {
+		try {
+			if (std::find(fixed.begin(), fixed.end(), FIXED_INST_RETIRED) != fixed.end())
+				throw std::runtime_error(std::string("--loops samples on the fixed counter of ") + FIXED_EVENTS[FIXED_INST_RETIRED].name +
+					", which can't be counted along with it");
+			loops.reset(new loop_sampler_t(cpus, opts.loops, tsc_hz, LBR_RING_PAGES));
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	std::unique_ptr<load_sampler_t> loads;
+	if (opts.load_latency) {
+		try {
+			loads.reset(new load_sampler_t(cpus, opts.load_latency, load_sampler_t::ring_pages(opts.interval_ns, tsc_hz)));
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::unique_ptr<capture_writer_t> recorder;
+	std::unique_ptr<ring_writer_t> ring;
+	std::vector<u_int64_t> totals(num_cores * num_events);
+	capture_header_t host;
+	if (!opts.ring_path.empty() || !opts.record_path.empty()) {
+		host = local_capture_header(opts.interval_ns);
+		if (num_groups > 1)
+			host.flags |= CAPTURE_ESTIMATES;
+	}
+	if (!opts.ring_path.empty()) {
+		try {
+			const u_int64_t capacity = std::max<u_int64_t>(opts.ring_hours * 3600e9 / opts.interval_ns, 2);
+			ring.reset(new ring_writer_t(opts.ring_path, host, topology, events.data(), num_events, capacity));
+			// the counts go on from where the ring left them
+			totals = ring->resumed;
+			if (ring->committed())
+				std::cerr << "Resuming " << opts.ring_path << " after " << ring->committed() << " records" << std::endl << std::endl;
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!opts.record_path.empty()) {
+		try {
+			recorder.reset(new capture_writer_t(opts.record_path, host, topology, events.data(), num_events));
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// SIGINT and SIGTERM are taken from a signalfd by the event loop instead of interrupting it
+	sigset_t stop_signals, old_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &stop_signals, &old_mask);
+	event_loop_t loop;
+	const int signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	std::unique_ptr<control_server_t> server;
+	try {
+		if (signal_fd < 0)
+			throw std::runtime_error(std::string("can't create signalfd: ") + strerror(errno));
+		loop.add(signal_fd, EPOLLIN);
+		if (!opts.serve_path.empty())
+			server.reset(new control_server_t(loop, opts.serve_path));
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	try {
+		isolate_sampler(opts);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// a wakeup later than this is reported as late; a whole interval behind is a missed deadline
+	const u_int64_t tolerance_ns = opts.interval_ns / 100;
+	deadline_stats_t deadlines;
+	overhead_t overhead;
+
+	u_int64_t deadline = monotonic_ns();
+	int sample_timer = -1, flush_timer = -1;
+	try {
+		sample_timer = periodic_timer(deadline + opts.interval_ns, opts.interval_ns);
+		loop.add(sample_timer, EPOLLIN);
+		if (ring) {
+			flush_timer = periodic_timer(deadline + FLUSH_INTERVAL_NS, FLUSH_INTERVAL_NS);
+			loop.add(flush_timer, EPOLLIN);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	struct epoll_event ready[16];
+	std::vector<std::pair<int, std::string>> commands;
+	json_writer_t reply;
+	bool stopping = false;
+	// the PMU is programmed from here on, so a failure restores it through pmu_state before exiting, as exit() doesn't
+	// run the destructors of locals
+	try {
+		// configure, once nothing else can fail; the first multiplexed group starts
+		int active = num_groups > 0 ? 1 : 0;
+		for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
+			for (const auto &counter : counters)
+				if (counter.fixed < 0 && (counter.group == 0 || counter.group == active))
+					program_counter(core_msrs[core_id], counter);
+			if (!fixed.empty()) {
+				auto &msr = core_msrs[core_id][0];
+				u_int64_t ctrl = msr.rdmsr(IA32_FIXED_CTR_CTRL);
+				u_int64_t global = msr.rdmsr(IA32_PERF_GLOBAL_CTRL);
+				for (fixed_counter_t f : fixed) {
+					// ring 0, ring 3 and any thread, without PMI
+					ctrl = (ctrl & ~(0xfull << (4 * f))) | (0x7ull << (4 * f));
+					global |= 1ull << (32 + f);
+				}
+				msr.wrmsr(IA32_FIXED_CTR_CTRL, ctrl);
+				msr.wrmsr(IA32_PERF_GLOBAL_CTRL, global);
+			}
+		}
+
+		// reset
+		for (core_id_t core_id = 0; core_id < num_cores; ++core_id)
+			for (const auto &counter : counters)
+				core_msrs[core_id][counter.cpu_idx].wrmsr(counter.msr(), 0);
+
+		u_int64_t tsc0 = rdtsc();
+		if (recorder) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			recorder->write((u_int64_t) now.tv_sec * 1000000000 + now.tv_nsec, tsc0, totals, interval.estimated);
+		}
+		if (ring) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			ring->write((u_int64_t) now.tv_sec * 1000000000 + now.tv_nsec, tsc0, totals, interval.estimated);
+		}
+		while (!stopping) {
+			const int num_ready = loop.wait(ready, sizeof(ready) / sizeof(ready[0]));
+			++overhead.syscalls;
+			u_int64_t ticks = 0;
+			commands.clear();
+			for (int r = 0; r < num_ready; ++r) {
+				const int fd = ready[r].data.fd;
+				if (fd == sample_timer) {
+					ticks = timer_expirations(sample_timer);
+				} else if (fd == signal_fd) {
+					struct signalfd_siginfo info;
+					while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+						stopping = true;
+				} else if (fd == flush_timer) {
+					timer_expirations(flush_timer);
+					ring->flush();
+					overhead.syscalls += 2;
+				} else if (server && server->owns(fd)) {
+					server->handle(fd, ready[r].events, commands);
+				}
+			}
+			for (const auto &command : commands) {
+				reply.clear();
+				reply.begin_object();
+				if (command.second == "stop") {
+					stopping = true;
+					reply.key("type").value("stopping").end_object().newline();
+				} else if (command.second == "status") {
+					reply.key("type").value("status").key("intervals").value(deadlines.intervals).key("late").value(deadlines.late);
+					reply.key("missed").value(deadlines.missed).key("max_lateness_ms").value(deadlines.max_lateness_ns / 1e6, 3);
+					reply.key("clients").value((u_int64_t) server->num_clients()).end_object().newline();
+				} else if (command.second == "overhead") {
+					reply.clear();
+					overhead.report(reply);
+				} else {
+					reply.key("type").value("error").key("message").value(("unknown command: " + command.second).c_str()).end_object().newline();
+				}
+				server->reply(command.first, reply.data(), reply.size());
+			}
+			if (stopping || !ticks)
+				continue;
+
+			u_int64_t tsc = rdtsc();
+			// the timer counts the ticks missed while the sampler was held up; the interval ends at the last one
+			deadline += ticks * opts.interval_ns;
+			const u_int64_t lateness = monotonic_ns() - deadline;
+			++deadlines.intervals;
+			deadlines.missed += ticks - 1;
+			deadlines.max_lateness_ns = std::max(deadlines.max_lateness_ns, lateness);
+			if (lateness > tolerance_ns)
+				++deadlines.late;
+
+			u_int64_t hz = tsc - tsc0;
+			tsc0 = tsc;
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			interval.time_ns = (u_int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+			interval.tsc = tsc;
+			interval.tsc_delta = hz;
+			interval.lateness_ns = lateness;
+
+			// read
+			for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
+				for (size_t i = 0; i < num_events; ++i) {
+					if (counters[i].group == 0 || counters[i].group == active) {
+						raw[core_id * num_events + i] = core_msrs[core_id][counters[i].cpu_idx].rdmsr(counters[i].msr());
+						++overhead.syscalls;
+					}
+				}
+			}
+			if (power)
+				overhead.syscalls += power->sample(core_msrs);
+			const u_int64_t read_ns = tracer ? monotonic_ns() : 0;
+			const u_int64_t tsc_read = rdtsc();
+
+			// delta
+			std::vector<u_int64_t> &deltas = interval.deltas;
+			for (size_t i = 0; i < num_events; ++i)
+				interval.estimated[i] = counters[i].group != 0 && counters[i].group != active;
+			for (size_t j = 0; j < raw.size(); j += num_events) {
+				for (size_t i = 0; i < num_events; ++i) {
+					if (!interval.estimated[i]) {
+						deltas[j + i] = (raw[j + i] - values[j + i]) & counter_masks[i];
+						last_deltas[j + i] = deltas[j + i];
+					} else {
+						// scale the rate of the last interval the event was counted in to this one
+						const u_int64_t last = last_hz[counters[i].group];
+						deltas[j + i] = last ? (u_int64_t) ((double) last_deltas[j + i] * hz / last) : 0;
+					}
+				}
+			}
+			values.swap(raw);
+			last_hz[active] = hz;
+			if (num_groups > 1) {
+				// the next group takes over the multiplexed counters from zero
+				active = active % num_groups + 1;
+				for (core_id_t core_id = 0; core_id < num_cores; ++core_id) {
+					for (size_t i = 0; i < num_events; ++i) {
+						if (counters[i].group == active) {
+							program_counter(core_msrs[core_id], counters[i]);
+							core_msrs[core_id][counters[i].cpu_idx].wrmsr(counters[i].msr(), 0);
+							values[core_id * num_events + i] = 0;
+							overhead.syscalls += counters[i].event.msr_index ? 3 : 2;
+						}
+					}
+				}
+			}
+			const u_int64_t tsc_delta = rdtsc();
+
+			// aggregate
+			for (size_t j = 0; j < deltas.size(); ++j)
+				interval.utils[j] = deltas[j] / (double) hz * 100;
+			for (auto &rollup : rollups)
+				rollup.update(interval.utils);
+			if (classifier)
+				classifier->update(interval);
+			if (frontend)
+				frontend->update(interval);
+			if (flops)
+				flops->update(interval);
+			if (memory)
+				memory->update(interval);
+			if (roofline)
+				roofline->update();
+			if (power)
+				power->update(interval);
+			if (assists)
+				assists->update(interval);
+			if (loads)
+				loads->drain();
+			if (loops)
+				loops->drain(interval.tsc_delta);
+			if (tracer) {
+				slices.clear();
+				tracer->drain(read_ns, slices);
+				top->update(interval, slices);
+				if (fingerprints)
+					fingerprints->update(*top);
+			}
+			const u_int64_t tsc_aggregate = rdtsc();
+			interval.cycles[PHASE_READ] = tsc_read - tsc;
+			interval.cycles[PHASE_DELTA] = tsc_delta - tsc_read;
+			interval.cycles[PHASE_AGGREGATE] = tsc_aggregate - tsc_delta;
+
+			// format/output
+			if (opts.ndjson || (server && server->num_clients())) {
+				json.clear();
+				format_ndjson(json, interval, topology, rollups, classifier.get(), frontend.get(), flops.get(), memory.get(), roofline.get(), power.get(), assists.get(), loads.get(), loops.get(), top.get());
+				if (opts.ndjson)
+					write_fully(STDOUT_FILENO, json.data(), json.size());
+				if (server)
+					server->broadcast(json.data(), json.size());
+			}
+			if (!opts.ndjson) {
+				line.clear();
+				format_text(line, interval, num_cores);
+				if (lateness > tolerance_ns) {
+					char buf[64];
+					snprintf(buf, sizeof(buf), "(late %.2fms)", lateness / 1e6);
+					line += buf;
+				}
+				line += '\n';
+				for (const auto &rollup : rollups)
+					rollup.format_text(line);
+				if (classifier)
+					classifier->format_text(line);
+				if (frontend)
+					frontend->format_text(line);
+				if (flops)
+					flops->format_text(line);
+				if (memory)
+					memory->format_text(line);
+				if (roofline) {
+					roofline->format_text(line);
+					roofline->format_chart(line);
+				}
+				if (power)
+					power->format_text(line);
+				if (assists)
+					assists->format_text(line);
+				if (loads)
+					loads->format_text(line);
+				if (loops)
+					loops->format_text(line);
+				if (top && opts.top > 0)
+					top->format_text(line, tracer->lost);
+				if (!opts.predict_path.empty())
+					format_prediction(line, interval, num_cores, prediction);
+				fwrite(line.data(), 1, line.size(), stderr);
+			}
+			++overhead.syscalls;
+			if (recorder || ring) {
+				for (size_t j = 0; j < deltas.size(); ++j)
+					totals[j] += deltas[j];
+			}
+			if (recorder) {
+				recorder->write(interval.time_ns, tsc, totals, interval.estimated);
+				++overhead.syscalls;
+			}
+			if (ring)
+				ring->write(interval.time_ns, tsc, totals, interval.estimated);
+			const u_int64_t tsc_output = rdtsc();
+			interval.cycles[PHASE_OUTPUT] = tsc_output - tsc_aggregate;
+			// disassembles outside of the phases, for the intervals to come
+			if (loops)
+				loops->predict();
+
+			for (int phase = 0; phase < NUM_PHASES; ++phase)
+				overhead.cycles[phase] += interval.cycles[phase];
+			overhead.tsc_elapsed += hz;
+			// counted without --overhead too, for the overhead command of the control socket
+			++overhead.intervals;
+			if (opts.overhead_every > 0 && overhead.intervals >= (u_int64_t) opts.overhead_every) {
+				if (opts.ndjson) {
+					json.clear();
+					overhead.report(json);
+					write_fully(STDOUT_FILENO, json.data(), json.size());
+				} else {
+					overhead.report(stderr);
+				}
+				overhead.reset();
+			}
+		}
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		pmu_state.reset();
+		exit(EXIT_FAILURE);
+	}
 
-				auto &msr = core_msrs[core_id][cpu_idx];
-				u_int64_t value = msr.rdmsr(IA32_PMC[pmc_idx]);
-				u_int64_t &value0 = values[core_id][i];
-				fprintf(stderr, "%6.2f%%", (value - value0) / (double) hz * 100);
-				value0 = value;
+	fprintf(stderr, "\nsampler: %llu intervals, %llu late (> %.2fms), %llu missed, max lateness %.2fms\n",
+		(unsigned long long) deadlines.intervals, (unsigned long long) deadlines.late,
+		tolerance_ns / 1e6, (unsigned long long) deadlines.missed, deadlines.max_lateness_ns / 1e6);
+	pmu_state.reset();
+	server.reset();
+	close(sample_timer);
+	if (flush_timer >= 0)
+		close(flush_timer);
+	close(signal_fd);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	if (fingerprints) {
+		try {
+			if (opts.ndjson) {
+				json.clear();
+				fingerprints->finish(NULL, &json);
+				write_fully(STDOUT_FILENO, json.data(), json.size());
+			} else {
+				fingerprints->finish(stderr, NULL);
 			}
-			fprintf(stderr, "] ");
+		} catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			return EXIT_FAILURE;
 		}
-		fprintf(stderr, "\n");
 	}
 
 	return 0;
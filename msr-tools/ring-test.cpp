@@ -0,0 +1,93 @@
+// Checks that a ring capture is recovered from its sequence words when its committed count is stale.
+#define main core_port_stat_main
+#include "core-port-stat.cpp"
+#undef main
+
+static const u_int64_t TEST_CAPACITY = 8;
+
+static int failures = 0;
+
+static void expect(bool ok, const std::string &what) {
+	if (!ok) {
+		std::cerr << "FAIL: " << what << std::endl;
+		++failures;
+	}
+}
+
+// Writes the committed count of the ring at path, as a crash may leave it.
+static void set_committed(const std::string &path, u_int64_t committed) {
+	capture_t capture(path);
+	const int fd = open(path.c_str(), O_WRONLY);
+	if (fd < 0 || pwrite(fd, &committed, sizeof(committed), capture_ring_offset(capture.header) + offsetof(capture_ring_t, committed)) != sizeof(committed))
+		throw std::runtime_error("can't write " + path);
+	close(fd);
+}
+
+// Checks that the ring at path reads as the records first to last, record n counting n.
+static void expect_records(const std::string &path, u_int64_t first, u_int64_t last, const std::string &what) {
+	capture_t capture(path);
+	expect(capture.num_records == last - first + 1, what + ": " + std::to_string(capture.num_records) + " records");
+	for (size_t i = 0; i < capture.num_records; ++i)
+		expect(capture.counts(i)[0] == first + i, what + ": record " + std::to_string(i) + " counts " + std::to_string(capture.counts(i)[0]));
+}
+
+int main() {
+	char path[] = "/tmp/ring-test-XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0) {
+		std::cerr << "can't create a temporary file: " << strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	try {
+		capture_header_t host;
+		memset(&host, 0, sizeof(host));
+		host.interval_ns = 1000 * 1000 * 1000;
+		topology_t topology;
+		topology.num_cores = 1;
+		topology.packages.assign(1, 0);
+		const pmc_event_type_t events[] = {pmc_event_type_t(0xa1, 0x01, "UOPS_DISPATCHED_PORT.PORT_0")};
+		const std::vector<bool> estimated(length_of(events), false);
+
+		// records 0 to 22 in 8 slots, so that slots 0 to 6 hold the third lap
+		{
+			ring_writer_t writer(path, host, topology, events, length_of(events), TEST_CAPACITY);
+			for (u_int64_t n = 0; n < 23; ++n)
+				writer.write(n, n, std::vector<u_int64_t>(1, n), estimated);
+		}
+		expect_records(path, 15, 22, "full ring");
+
+		// a count left behind by a crash, with slots 4 to 6 already holding the lap after the one it starts in
+		set_committed(path, 20);
+		expect_records(path, 15, 22, "stale count");
+		{
+			ring_writer_t writer(path, host, topology, events, length_of(events), TEST_CAPACITY);
+			expect(writer.committed() == 23, "stale count resumed at " + std::to_string(writer.committed()));
+			expect(writer.resumed[0] == 22, "stale count resumed from " + std::to_string(writer.resumed[0]));
+			writer.write(23, 23, std::vector<u_int64_t>(1, 23), estimated);
+		}
+		expect_records(path, 16, 23, "write after a stale count");
+		{
+			capture_t capture(path);
+			expect(capture.restarts == std::vector<size_t>(1, 7), "restart after a stale count");
+		}
+
+		// a count that reached the disk before its records: it doesn't go back
+		set_committed(path, 26);
+		expect_records(path, 16, 23, "count ahead");
+		{
+			ring_writer_t writer(path, host, topology, events, length_of(events), TEST_CAPACITY);
+			expect(writer.committed() == 26, "count ahead resumed at " + std::to_string(writer.committed()));
+			expect(writer.resumed[0] == 23, "count ahead resumed from " + std::to_string(writer.resumed[0]));
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "FAIL: " << e.what() << std::endl;
+		++failures;
+	}
+	unlink(path);
+	if (failures)
+		exit(EXIT_FAILURE);
+	std::cout << "ring-test: ok" << std::endl;
+	return 0;
+}